@@ -28,10 +28,24 @@
 #define my_kfifo_len __kfifo_len
 #define my_kfifo_put kfifo_put
 #define my_kfifo_get kfifo_get
+/* The old kfifo_put takes the lock given to kfifo_alloc itself */
+#define my_kfifo_put_locked(fifo, buf, n, lock) kfifo_put(fifo, buf, n)
+#define my_kfifo_get_locked(fifo, buf, n, lock) kfifo_get(fifo, buf, n)
 #else
 #define my_kfifo_len kfifo_len
 #define my_kfifo_get kfifo_out
 #define my_kfifo_put kfifo_in
+#define my_kfifo_put_locked kfifo_in_spinlocked
+#define my_kfifo_get_locked kfifo_out_spinlocked
+#endif
+
+#ifndef IS_ERR_OR_NULL
+#define IS_ERR_OR_NULL(ptr) (!(ptr) || IS_ERR(ptr))
+#endif
+
+/* Sparse annotation, 2.6.33 and later */
+#ifndef __percpu
+#define __percpu
 #endif
 
 #endif /* __DVB_HDHOMERUN_COMPAT_H__ */
@@ -55,33 +55,32 @@ MODULE_VERSION(HDHOMERUN_VERSION);
 
 static unsigned int hdhomerun_control_poll(struct file *f, struct poll_table_struct *p)
 {
+	struct hdhomerun_control_conn *conn = f->private_data;
 	unsigned int mask = 0;
-	poll_wait(f, &inq, p);
-	poll_wait(f, &outq, p);
-	if (my_kfifo_len(&control_fifo_user) != 0) mask |= POLLIN | POLLRDNORM; /* readable */
-	mask |= POLLOUT | POLLWRNORM; /* writable... always? */
+
+	poll_wait(f, &conn->inq, p);
+	if (my_kfifo_len(&conn->fifo) != 0) mask |= POLLIN | POLLRDNORM; /* readable */
+	mask |= POLLOUT | POLLWRNORM; /* replies never block */
 	return mask;
 }
 
 static ssize_t hdhomerun_control_read(struct file *f, char *buf,
 				      size_t count, loff_t *offset)
 {
+	struct hdhomerun_control_conn *conn = f->private_data;
 	char *user_data;
 	ssize_t retval;
 
-	DEBUG_FUNC(HDHOMERUN_CONTROL);
-	DEBUG_OUT(HDHOMERUN_CONTROL, "Count: %Zu, offset %lld, buf size: %d\n", count, *offset, my_kfifo_len(&control_fifo_user));
-
 	if (!buf)
 		return -EINVAL;
 
 	if (count == 0)
 		return 0;
 
-	while(my_kfifo_len(&control_fifo_user) <= 0) {
+	while(my_kfifo_len(&conn->fifo) <= 0) {
 		if (f->f_flags & O_NONBLOCK)
 			return -EAGAIN;
-		if (wait_event_interruptible(inq, (my_kfifo_len(&control_fifo_user) != 0) ))
+		if (wait_event_interruptible(conn->inq, (my_kfifo_len(&conn->fifo) != 0) ))
 			return -ERESTARTSYS;
 	}
 
@@ -89,85 +88,68 @@ static ssize_t hdhomerun_control_read(struct file *f, char *buf,
 	if (!user_data)
 		return -ENOMEM;
 	
-	retval = my_kfifo_get(&control_fifo_user, user_data, count);
+	retval = my_kfifo_get_locked(&conn->fifo, user_data, count, &conn->fifo_lock);
 
 	if(copy_to_user(buf, user_data, retval)) {
 		retval = -EFAULT;
 	} 
 
-	DEBUG_OUT(HDHOMERUN_CONTROL, "retval %Zu\n", retval);
-
 	kfree(user_data);
 	return retval;
 }
 
+/* Replies, one or more whole messages */
 static ssize_t hdhomerun_control_write(struct file *f, const char __user *buf,
 				       size_t count, loff_t *offset)
 {
-	char *user_data;
-	ssize_t retval = count;
-	
-	DEBUG_FUNC(1);
-	DEBUG_OUT(HDHOMERUN_CONTROL, "Count: %Zu, offset %lld, buf size: %d\n", count, *offset, my_kfifo_len(&control_fifo_kernel));
+	struct hdhomerun_control_conn *conn = f->private_data;
+	struct dvbhdhomerun_control_mesg mesg;
+	size_t done = 0;
 	
-	user_data = kmalloc(count, GFP_KERNEL);
-	if(!user_data) {
-		retval = -ENOMEM;
-		goto error;
-	}
-	
-	if (copy_from_user(user_data, buf, count)) {
-		retval = -EFAULT;
-		goto error;
+	if(count < sizeof(struct dvbhdhomerun_control_mesg)) {
+		return -EINVAL;
 	}
-	
-	if(wait_for_write) {
-		while(my_kfifo_len(&control_fifo_kernel) == control_bufsize) {
-			if (f->f_flags & O_NONBLOCK)
-				return -EAGAIN;
-			if (wait_event_interruptible(outq, (my_kfifo_len(&control_fifo_kernel) < control_bufsize) ))
-				return -ERESTARTSYS;
+
+	while(count - done >= sizeof(struct dvbhdhomerun_control_mesg)) {
+		if (copy_from_user(&mesg, buf + done, sizeof(struct dvbhdhomerun_control_mesg))) {
+			return done ? done : -EFAULT;
 		}
-		retval = my_kfifo_put(&control_fifo_kernel, user_data, count);
-	} else {
-		DEBUG_OUT(HDHOMERUN_CONTROL, "%s ignoring write\n", __FUNCTION__);
-	}	
-	DEBUG_OUT(HDHOMERUN_CONTROL, "retval %Zu\n", retval);
-	
-	wake_up_interruptible(&control_readq);
-	
-error:
-	kfree(user_data);
-	return retval;
+		hdhomerun_control_reply(conn, &mesg);
+		done += sizeof(struct dvbhdhomerun_control_mesg);
+	}
+
+	return done;
 }
 
 static int hdhomerun_control_open(struct inode *inode, struct file *file)
 {
+	struct hdhomerun_control_conn *conn;
+
 	DEBUG_FUNC(1);
 
-	printk(KERN_INFO "hdhomerun: userhdhomerun connected\n");
+	conn = hdhomerun_control_conn_create();
+	if(conn == NULL) {
+		return -ENOMEM;
+	}
+	file->private_data = conn;
 
-	userspace_ready = 1; /*  need mutex here */
+	printk(KERN_INFO "hdhomerun: userhdhomerun connected\n");
 
 	return 0;
 }
 
 static int hdhomerun_control_release(struct inode *inode, struct file *file)
 {
+	struct hdhomerun_control_conn *conn = file->private_data;
+
 	DEBUG_FUNC(1);
 
-	DEBUG_OUT(HDHOMERUN_CONTROL, "Control buf size (user)  : %d\n", my_kfifo_len(&control_fifo_user));
-	DEBUG_OUT(HDHOMERUN_CONTROL, "Control buf size (kernel): %d\n", my_kfifo_len(&control_fifo_kernel));
-	
-	/* Clear the contents of the fifo when the user space program
-	   disconnects. We want to start fresh when we reconnect
-	   again. This is probably a problem for the programs using
-	   the /dev/dvb/adapterX/etcY */
-	kfifo_reset(&control_fifo_kernel);
-	kfifo_reset(&control_fifo_user);
+	DEBUG_OUT(HDHOMERUN_CONTROL, "Control buf size: %d\n", my_kfifo_len(&conn->fifo));
 	
-	wait_for_write = 0; /* need mutex here */
-	userspace_ready =0; /* need mutex here */
+	/* Only the tuners registered through this file are affected,
+	   other userhdhomerun's carry on. */
+	hdhomerun_control_conn_release(conn);
+	file->private_data = NULL;
 
    printk(KERN_INFO "hdhomerun: userhdhomerun disconnected\n");
 
@@ -219,8 +201,17 @@ static int hdhomerun_control_ioctl(struct inode *inode,struct file *f,
 			retval = dvb_hdhomerun_register_hdhomerun(&tuner_data);
 			if(retval != 0) {
 				printk(KERN_ERR "hdhomerun: register_hdhomerun() failed, no dvb device created\n");
-				return -EFAULT;
+				/* Out of tuner ids, max_devices is too small */
+				return retval == -ENOSPC ? retval : -EFAULT;
+			}
+
+			/* Requests for the tuner go to whoever registered it */
+			retval = hdhomerun_control_set_owner(tuner_data.id, f->private_data, tuner_data.standby);
+			if(retval < 0) {
+				printk(KERN_ERR "hdhomerun: %s is in use by another userhdhomerun\n", tuner_data.name);
+				return retval;
 			}
+			tuner_data.standby = retval == 1;
 
 			retval = copy_to_user((void *)arg, &tuner_data, sizeof(struct hdhomerun_register_tuner_data));
 			break;
@@ -265,37 +256,6 @@ int dvb_hdhomerun_control_init() {
 		goto error;
 	}
 
-	/* Buffer for sending message between kernel/userspace */
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,33)
-	control_fifo_user = *(kfifo_alloc(control_bufsize, GFP_KERNEL, &control_spinlock_user));
-	if (IS_ERR(&control_fifo_user)) {
-		return PTR_ERR(&control_fifo_user);
-	}
-#else
-	ret = kfifo_alloc(&control_fifo_user, control_bufsize, GFP_KERNEL);
-	if (ret) {
-		printk(KERN_ERR "Error kfifo_alloc\n");
-		return PTR_ERR(&control_fifo_user);
-	}
-#endif
-
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,33)
-	control_fifo_kernel = *(kfifo_alloc(control_bufsize, GFP_KERNEL, &control_spinlock_kernel));
-	if (IS_ERR(&control_fifo_kernel)) {
-		return PTR_ERR(&control_fifo_kernel);
-	}
-#else
-	ret = kfifo_alloc(&control_fifo_kernel, control_bufsize, GFP_KERNEL);
-	if (ret) {
-		printk(KERN_ERR "Error kfifo_alloc\n");
-		return PTR_ERR(&control_fifo_kernel);
-	}
-#endif 
-
-	init_waitqueue_head(&control_readq);
-	init_waitqueue_head(&inq);
-	init_waitqueue_head(&outq);
-
 error:
 	return ret;
 }
@@ -303,10 +263,6 @@ EXPORT_SYMBOL(dvb_hdhomerun_control_init);
 
 void dvb_hdhomerun_control_exit() {
 	DEBUG_FUNC(1);
-#if LINUX_VERSION_CODE > KERNEL_VERSION(2,6,32)
-	kfifo_free(&control_fifo_user);
-	kfifo_free(&control_fifo_kernel);
-#endif
 
 	misc_deregister(&hdhomerun_control_device);
 }
@@ -39,7 +39,8 @@ typedef enum {
 	DVB_HDHOMERUN_START_FEED,
 	DVB_HDHOMERUN_STOP_FEED,
 	DVB_HDHOMERUN_DMX_SET_PES_FILTER,
-	DVB_HDHOMERUN_INT_REGISTER_DEVICE  
+	DVB_HDHOMERUN_INT_REGISTER_DEVICE,
+	DVB_HDHOMERUN_NUM_MESG_TYPES
 } hdhomerun_control_mesg_type_t;
 
 
@@ -54,8 +55,23 @@ struct hdhomerun_register_tuner_data {
    int id;
    int type;
    bool use_full_name;
+   /* In: take the tuner over when its userhdhomerun goes away.
+      Out: true when somebody else has the tuner for now. */
+   bool standby;
 };
 
+/* Set by hdhomerun_control_post_async(), userspace must not reply.
+   START_FEED/STOP_FEED are posted this way, in the order the demux
+   asks for them and under the adapter's feedlock. Userspace handles
+   the messages for a tuner in that same order, so a quick stop/start
+   of a pid always leaves the pid in the filter. */
+#define DVB_HDHOMERUN_MESG_NO_REPLY 0x1
+
+/* Set by userspace in a reply when the tuner is in use otherwise, for
+   now only an FE_SET_FRONTEND while it streams over HTTP. The request
+   fails with -EBUSY. */
+#define DVB_HDHOMERUN_MESG_BUSY 0x2
+
 struct dvbhdhomerun_control_mesg {
 	unsigned int type;
 	union {
@@ -67,6 +83,17 @@ struct dvbhdhomerun_control_mesg {
 		struct hdhomerun_register_tuner_data reg_data;
 	} u;
 	int id;
+	unsigned int flags;
+	/* Set by the kernel, userspace hands it back in the reply */
+	unsigned int seq;
+	/* ms the kernel waits for the reply, 0 for ever. Userspace can
+	   skip requests that are past it, the reply would be dropped. */
+	unsigned int timeout;
+	/* CLOCK_MONOTONIC ns: posted by the kernel, read by userspace,
+	   and the reply written after the HDHomeRun call. */
+	uint64_t ts_posted;
+	uint64_t ts_picked;
+	uint64_t ts_handled;
 };
 
 
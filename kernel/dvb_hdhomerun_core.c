@@ -19,8 +19,19 @@
  *
  */
 
+#include <linux/bitops.h>
+#include <linux/debugfs.h>
+#include <linux/fs.h>
+#include <linux/jiffies.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
 #include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/mutex.h>
 #include <linux/sched.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/string.h>
 
 #include "dvb_hdhomerun_control.h"
 #include "dvb_hdhomerun_compat.h"
@@ -28,38 +39,155 @@
 
 #include "dvb_hdhomerun_core.h"
 
-/* for the control device */
-struct kfifo control_fifo_user;
-EXPORT_SYMBOL(control_fifo_user);
+#define CREATE_TRACE_POINTS
+#include "dvb_hdhomerun_trace.h"
 
-struct kfifo control_fifo_kernel;
-EXPORT_SYMBOL(control_fifo_kernel);
+/* Used by dvb_hdhomerun */
+EXPORT_TRACEPOINT_SYMBOL(hdhomerun_feed);
+EXPORT_TRACEPOINT_SYMBOL(hdhomerun_data_write);
 
-spinlock_t control_spinlock_user;
-EXPORT_SYMBOL(control_spinlock_user);
+int control_bufsize = 32768;
+EXPORT_SYMBOL(control_bufsize);
 
-spinlock_t control_spinlock_kernel;
-EXPORT_SYMBOL(control_spinlock_kernel);
+/* Per tuner, indexed by tuner id and grown as tuners are registered */
+struct hdhomerun_control_tuner {
+	/* Gets the requests, NULL when no userhdhomerun has the tuner */
+	struct hdhomerun_control_conn *owner;
+	/* Takes over when the owner goes away */
+	struct hdhomerun_control_conn *standby;
+	/* Last FE_SET_FRONTEND, replayed to a new owner */
+	struct dvbhdhomerun_control_mesg tune;
+	int have_tune;
+	/* Got a new owner that needs to be brought up to date */
+	int replay;
+};
 
-wait_queue_head_t control_readq;
-EXPORT_SYMBOL(control_readq);
+static struct hdhomerun_control_tuner *control_tuners = NULL;
+static int control_tuners_size = 0;
+static DEFINE_MUTEX(control_tuners_mutex);
 
-wait_queue_head_t inq;
-EXPORT_SYMBOL(inq);
+/* Protects the pending lists and the dead flag of all connections.
+   A request moves to another connection on takeover. */
+static DEFINE_SPINLOCK(control_pending_lock);
 
-wait_queue_head_t outq;
-EXPORT_SYMBOL(outq);
+/* Matches replies to requests */
+static atomic_t control_seq = ATOMIC_INIT(0);
 
-int control_bufsize = 32768;
-EXPORT_SYMBOL(control_bufsize);
+/* Sends the pids a tuner streams to its new owner */
+static void (*control_takeover_handler)(int id) = NULL;
+
+/* A request waiting in hdhomerun_control_post_and_wait() */
+struct hdhomerun_control_request {
+	struct list_head list;
+	struct dvbhdhomerun_control_mesg *mesg;
+	wait_queue_head_t wq;
+	/* 1 when replied, negative when failed */
+	int done;
+};
+
+/* How long a request waits for userspace, in ms. 0 waits for ever. */
+static int timeout_set_frontend = 5000;
+module_param(timeout_set_frontend, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(timeout_set_frontend, "ms to wait for userhdhomerun to tune (default 5000, 0 = no limit)");
+
+static int timeout_read_status = 2000;
+module_param(timeout_read_status, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(timeout_read_status, "ms to wait for a status read (default 2000, 0 = no limit)");
+
+static int timeout_read_signal_strength = 2000;
+module_param(timeout_read_signal_strength, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(timeout_read_signal_strength, "ms to wait for a signal strength read (default 2000, 0 = no limit)");
+
+static int timeout_default = 2000;
+module_param(timeout_default, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(timeout_default, "ms to wait for any other request (default 2000, 0 = no limit)");
+
+/* Per message type. Expired requests, and replies that came after
+   the request expired or was interrupted. */
+static atomic_t control_expired[DVB_HDHOMERUN_NUM_MESG_TYPES];
+static atomic_t control_late[DVB_HDHOMERUN_NUM_MESG_TYPES];
+
+/* Where the time between post and wakeup goes: kfifo and read by
+   userspace, userspace up to the reply, reply to wakeup, and all of
+   it. Log2 buckets in us, bucket n counts < 2^n us. */
+enum {
+	CONTROL_STAGE_FIFO = 0,
+	CONTROL_STAGE_DAEMON,
+	CONTROL_STAGE_REPLY,
+	CONTROL_STAGE_TOTAL,
+	CONTROL_NUM_STAGES
+};
+
+#define CONTROL_LATENCY_BUCKETS 32
+
+static atomic_t control_latency[DVB_HDHOMERUN_NUM_MESG_TYPES][CONTROL_NUM_STAGES][CONTROL_LATENCY_BUCKETS];
+
+static const char *control_stage_names[CONTROL_NUM_STAGES] = {
+	"fifo", "daemon", "reply", "total"
+};
+
+static const char *control_mesg_names[DVB_HDHOMERUN_NUM_MESG_TYPES] = {
+	[DVB_HDHOMERUN_FE_READ_STATUS] = "read_status",
+	[DVB_HDHOMERUN_FE_READ_BER] = "read_ber",
+	[DVB_HDHOMERUN_FE_READ_UNCORRECTED_BLOCKS] = "read_uncorrected_blocks",
+	[DVB_HDHOMERUN_FE_SET_FRONTEND] = "set_frontend",
+	[DVB_HDHOMERUN_FE_READ_SIGNAL_STRENGTH] = "read_signal_strength",
+	[DVB_HDHOMERUN_START_FEED] = "start_feed",
+	[DVB_HDHOMERUN_STOP_FEED] = "stop_feed",
+	[DVB_HDHOMERUN_DMX_SET_PES_FILTER] = "dmx_set_pes_filter",
+	[DVB_HDHOMERUN_INT_REGISTER_DEVICE] = "register_device",
+};
+
+static struct dentry *hdhomerun_debugfs_dir = NULL;
+
+static u64 hdhomerun_control_now(void)
+{
+	return ktime_to_ns(ktime_get());
+}
+
+static void hdhomerun_control_add_latency(unsigned int type, int stage, u64 from, u64 to)
+{
+	int bucket;
+
+	/* Userspace didn't fill in the timestamp */
+	if(from == 0 || to < from) {
+		return;
+	}
 
-/* Handles the case where the user space app ctrl-c's. I.E the hdhomerun app, shouldn't write to fifo.*/
-int wait_for_write = 0; /* Need mutex on this */
-EXPORT_SYMBOL(wait_for_write);
+	bucket = fls64(div_u64(to - from, NSEC_PER_USEC));
+	if(bucket >= CONTROL_LATENCY_BUCKETS) {
+		bucket = CONTROL_LATENCY_BUCKETS - 1;
+	}
+	atomic_inc(&control_latency[type][stage][bucket]);
+}
+
+static void hdhomerun_control_record_latency(struct dvbhdhomerun_control_mesg *mesg)
+{
+	u64 now = hdhomerun_control_now();
 
-/* Handles the case where the hdhomerun app is not running */
-int userspace_ready = 0; /* Need mutex on this */
-EXPORT_SYMBOL(userspace_ready);
+	if(mesg->type >= DVB_HDHOMERUN_NUM_MESG_TYPES) {
+		return;
+	}
+
+	hdhomerun_control_add_latency(mesg->type, CONTROL_STAGE_FIFO, mesg->ts_posted, mesg->ts_picked);
+	hdhomerun_control_add_latency(mesg->type, CONTROL_STAGE_DAEMON, mesg->ts_picked, mesg->ts_handled);
+	hdhomerun_control_add_latency(mesg->type, CONTROL_STAGE_REPLY, mesg->ts_handled, now);
+	hdhomerun_control_add_latency(mesg->type, CONTROL_STAGE_TOTAL, mesg->ts_posted, now);
+}
+
+static int hdhomerun_control_timeout(unsigned int type)
+{
+	switch(type) {
+	case DVB_HDHOMERUN_FE_SET_FRONTEND:
+		return timeout_set_frontend;
+	case DVB_HDHOMERUN_FE_READ_STATUS:
+		return timeout_read_status;
+	case DVB_HDHOMERUN_FE_READ_SIGNAL_STRENGTH:
+		return timeout_read_signal_strength;
+	default:
+		return timeout_default;
+	}
+}
 
 int hdhomerun_debug_mask = 0x0;
 module_param(hdhomerun_debug_mask, int, S_IRUGO | S_IWUSR);
@@ -71,53 +199,517 @@ MODULE_DESCRIPTION("HDHomeRun Driver Core Module");
 MODULE_LICENSE("GPL");
 MODULE_VERSION(HDHOMERUN_VERSION);
 
-int hdhomerun_control_post_message(struct dvbhdhomerun_control_mesg *mesg) {
-	int ret = -1;
+static void hdhomerun_control_conn_free(struct kref *ref)
+{
+	struct hdhomerun_control_conn *conn = container_of(ref, struct hdhomerun_control_conn, ref);
+
+#if LINUX_VERSION_CODE > KERNEL_VERSION(2,6,32)
+	kfifo_free(&conn->fifo);
+#endif
+	kfree(conn);
+}
+
+struct hdhomerun_control_conn *hdhomerun_control_conn_create(void)
+{
+	struct hdhomerun_control_conn *conn;
 
 	DEBUG_FUNC(1);
 
-	if(userspace_ready) {
-		if(my_kfifo_put(&control_fifo_user, (unsigned char*)mesg, sizeof(struct dvbhdhomerun_control_mesg)) < sizeof(struct dvbhdhomerun_control_mesg) ) {
-			printk(KERN_CRIT "No buffer space for hdhomerun control device!\n");
-		} else {
-			ret = 1;
+	conn = kzalloc(sizeof(struct hdhomerun_control_conn), GFP_KERNEL);
+	if(conn == NULL) {
+		return NULL;
+	}
+
+	kref_init(&conn->ref);
+	spin_lock_init(&conn->fifo_lock);
+	INIT_LIST_HEAD(&conn->pending);
+	init_waitqueue_head(&conn->inq);
+
+	/* Buffer for sending message from kernel to userspace */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,33)
+	{
+		struct kfifo *fifo = kfifo_alloc(control_bufsize, GFP_KERNEL, &conn->fifo_lock);
+		if (IS_ERR(fifo)) {
+			kfree(conn);
+			return NULL;
 		}
-		wake_up_interruptible(&inq);
+		conn->fifo = *fifo;
 	}
+#else
+	if (kfifo_alloc(&conn->fifo, control_bufsize, GFP_KERNEL)) {
+		printk(KERN_ERR "Error kfifo_alloc\n");
+		kfree(conn);
+		return NULL;
+	}
+#endif
+
+	return conn;
+}
+EXPORT_SYMBOL(hdhomerun_control_conn_create);
+
+static int hdhomerun_control_post_message(struct hdhomerun_control_conn *conn,
+					  struct dvbhdhomerun_control_mesg *mesg) {
+	int ret = -1;
+
+	DEBUG_FUNC(1);
+
+	/* Several adapters and their demux callbacks may post at the
+	   same time */
+	if(my_kfifo_put_locked(&conn->fifo, (unsigned char*)mesg, sizeof(struct dvbhdhomerun_control_mesg), &conn->fifo_lock) < sizeof(struct dvbhdhomerun_control_mesg) ) {
+		printk(KERN_CRIT "No buffer space for hdhomerun control device!\n");
+	} else {
+		ret = 1;
+	}
+	wake_up_interruptible(&conn->inq);
+
 	return ret;
 }
-EXPORT_SYMBOL(hdhomerun_control_post_message);
 
-int hdhomerun_control_wait_for_message(struct dvbhdhomerun_control_mesg *mesg) {
+/* Brings a new owner up to date: the channel first, then the pids the
+   demux is streaming. */
+static void hdhomerun_control_replay(int id)
+{
+	struct hdhomerun_control_conn *conn = NULL;
+	struct dvbhdhomerun_control_mesg tune;
+	int have_tune = 0;
+
+	mutex_lock(&control_tuners_mutex);
+	if(id < control_tuners_size && control_tuners[id].replay) {
+		control_tuners[id].replay = 0;
+		conn = control_tuners[id].owner;
+		have_tune = control_tuners[id].have_tune;
+		tune = control_tuners[id].tune;
+		if(conn != NULL) {
+			kref_get(&conn->ref);
+		}
+	}
+	mutex_unlock(&control_tuners_mutex);
+
+	if(conn == NULL) {
+		return;
+	}
+
+	printk(KERN_INFO "hdhomerun: tuner %d has a new userhdhomerun\n", id);
+
+	if(have_tune) {
+		tune.flags = DVB_HDHOMERUN_MESG_NO_REPLY;
+		tune.seq = atomic_inc_return(&control_seq);
+		tune.timeout = 0;
+		tune.ts_posted = hdhomerun_control_now();
+		tune.ts_picked = 0;
+		tune.ts_handled = 0;
+		hdhomerun_control_post_message(conn, &tune);
+	}
+	kref_put(&conn->ref, hdhomerun_control_conn_free);
+
+	if(control_takeover_handler != NULL) {
+		control_takeover_handler(id);
+	}
+}
+
+/* The file is closed. Its tuners go to their standby userhdhomerun,
+   which also gets the requests still waiting for a reply. Without a
+   standby the tuners get no owner and the requests fail, nobody is
+   going to answer them. */
+void hdhomerun_control_conn_release(struct hdhomerun_control_conn *conn)
+{
+	struct hdhomerun_control_request *req;
+	struct hdhomerun_control_request *tmp;
+	struct hdhomerun_control_conn *owner;
+	unsigned long flags;
+	int size;
+	int i;
+
 	DEBUG_FUNC(1);
-	wait_for_write = 1;
-	do {
-		if(wait_event_interruptible(control_readq, my_kfifo_len(&control_fifo_kernel) > 0)) {
-			DEBUG_OUT(HDHOMERUN_CONTROL,"%s read interrupted\n", __FUNCTION__);
-			wait_for_write = 0;
-			return -ERESTARTSYS;
+
+	mutex_lock(&control_tuners_mutex);
+	size = control_tuners_size;
+	for(i = 0; i < size; ++i) {
+		if(control_tuners[i].standby == conn) {
+			control_tuners[i].standby = NULL;
+		}
+		if(control_tuners[i].owner == conn) {
+			control_tuners[i].owner = control_tuners[i].standby;
+			control_tuners[i].standby = NULL;
+			control_tuners[i].replay = control_tuners[i].owner != NULL;
+		}
+	}
+
+	spin_lock_irqsave(&control_pending_lock, flags);
+	conn->dead = 1;
+	list_for_each_entry_safe(req, tmp, &conn->pending, list) {
+		list_del_init(&req->list);
+
+		i = req->mesg->id;
+		owner = (i >= 0 && i < control_tuners_size) ? control_tuners[i].owner : NULL;
+		if(owner != NULL && !owner->dead) {
+			list_add_tail(&req->list, &owner->pending);
+			hdhomerun_control_post_message(owner, req->mesg);
+		}
+		else {
+			req->done = -ENODEV;
+			wake_up(&req->wq);
+		}
+	}
+	spin_unlock_irqrestore(&control_pending_lock, flags);
+
+	mutex_unlock(&control_tuners_mutex);
+
+	for(i = 0; i < size; ++i) {
+		hdhomerun_control_replay(i);
+	}
+
+	kref_put(&conn->ref, hdhomerun_control_conn_free);
+}
+EXPORT_SYMBOL(hdhomerun_control_conn_release);
+
+/* Requests for tuner id go to conn from now on. A tuner belongs to
+   the userhdhomerun that registered it until it closes the control
+   device. With standby set conn waits in line for a tuner that is
+   already owned, and takes over when the owner goes away. */
+int hdhomerun_control_set_owner(int id, struct hdhomerun_control_conn *conn, int standby)
+{
+	struct hdhomerun_control_tuner *tuners;
+	struct hdhomerun_control_tuner *tuner;
+	int size;
+	int ret = 0;
+
+	DEBUG_FUNC(1);
+
+	if(id < 0) {
+		return -EINVAL;
+	}
+
+	mutex_lock(&control_tuners_mutex);
+
+	if(id >= control_tuners_size) {
+		size = control_tuners_size ? control_tuners_size : 8;
+		while(size <= id) {
+			size *= 2;
+		}
+
+		tuners = krealloc(control_tuners, size * sizeof(*tuners), GFP_KERNEL);
+		if(tuners == NULL) {
+			ret = -ENOMEM;
+			goto out;
 		}
-	} while(my_kfifo_len(&control_fifo_kernel) == 0);
+		memset(tuners + control_tuners_size, 0,
+		       (size - control_tuners_size) * sizeof(*tuners));
 
-	return my_kfifo_get(&control_fifo_kernel, (unsigned char*)mesg, sizeof(struct dvbhdhomerun_control_mesg));
-	wake_up_interruptible(&outq);
+		control_tuners = tuners;
+		control_tuners_size = size;
+	}
+
+	tuner = &control_tuners[id];
+	if(tuner->owner == NULL) {
+		/* A restarted userhdhomerun picks up where the last one
+		   left off. */
+		tuner->owner = conn;
+		tuner->replay = 1;
+	}
+	else if(tuner->owner == conn) {
+		/* Registered again */
+	}
+	else if(standby && (tuner->standby == NULL || tuner->standby == conn)) {
+		tuner->standby = conn;
+		ret = 1;
+	}
+	else {
+		ret = -EBUSY;
+	}
+
+ out:
+	mutex_unlock(&control_tuners_mutex);
+
+	if(ret == 0) {
+		hdhomerun_control_replay(id);
+	}
+
+	return ret;
+}
+EXPORT_SYMBOL(hdhomerun_control_set_owner);
+
+void hdhomerun_control_set_takeover_handler(void (*handler)(int id))
+{
+	mutex_lock(&control_tuners_mutex);
+	control_takeover_handler = handler;
+	mutex_unlock(&control_tuners_mutex);
+}
+EXPORT_SYMBOL(hdhomerun_control_set_takeover_handler);
+
+/* Takes a reference the caller has to drop. Remembers the channel for
+   a new owner. */
+static struct hdhomerun_control_conn *hdhomerun_control_get_owner(struct dvbhdhomerun_control_mesg *mesg)
+{
+	struct hdhomerun_control_conn *conn = NULL;
+	int id = mesg->id;
+
+	mutex_lock(&control_tuners_mutex);
+	if(id >= 0 && id < control_tuners_size) {
+		if(mesg->type == DVB_HDHOMERUN_FE_SET_FRONTEND) {
+			control_tuners[id].tune = *mesg;
+			control_tuners[id].have_tune = 1;
+		}
+
+		conn = control_tuners[id].owner;
+		if(conn != NULL) {
+			kref_get(&conn->ref);
+		}
+	}
+	mutex_unlock(&control_tuners_mutex);
+
+	return conn;
 }
-EXPORT_SYMBOL(hdhomerun_control_wait_for_message);
 
+/* Reply from userspace, wakes up the request it belongs to. Replies
+   nobody waits for any more are dropped. */
+int hdhomerun_control_reply(struct hdhomerun_control_conn *conn, struct dvbhdhomerun_control_mesg *mesg)
+{
+	struct hdhomerun_control_request *req;
+	unsigned long flags;
+	int ret = -ENOENT;
+
+	spin_lock_irqsave(&control_pending_lock, flags);
+	list_for_each_entry(req, &conn->pending, list) {
+		if(req->mesg->seq == mesg->seq) {
+			*req->mesg = *mesg;
+			req->done = 1;
+			list_del_init(&req->list);
+			/* Under the lock, the request goes away as soon as
+			   its waiter gets the lock */
+			wake_up(&req->wq);
+			ret = 0;
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&control_pending_lock, flags);
+
+	trace_hdhomerun_control_reply(mesg, ret == 0);
+
+	if(ret != 0) {
+		if(mesg->type < DVB_HDHOMERUN_NUM_MESG_TYPES) {
+			atomic_inc(&control_late[mesg->type]);
+		}
+	}
+
+	return ret;
+}
+EXPORT_SYMBOL(hdhomerun_control_reply);
+
+/* Returns -ENODEV when no userhdhomerun has the tuner,
+   -ETIMEDOUT when it doesn't answer in time and -EBUSY when it
+   answers that the tuner is in use otherwise. A reply coming after
+   the timeout is dropped. */
 int hdhomerun_control_post_and_wait(struct dvbhdhomerun_control_mesg *mesg) {
+	struct hdhomerun_control_conn *conn;
+	struct hdhomerun_control_request req;
+	unsigned long flags;
+	long left;
+	int timeout;
 	int ret;
 
-	ret = hdhomerun_control_post_message(mesg);
-	if(ret == 1) {
-		/* Now we wait for userspace to return to us */
-		ret = hdhomerun_control_wait_for_message(mesg);
-		if(ret == 0) {
-			DEBUG_OUT(HDHOMERUN_CONTROL, "dvbhdhomerun_wait_for_message failed, shouldn't happen!\n");
+	/* Handles the case where no userhdhomerun has this tuner */
+	conn = hdhomerun_control_get_owner(mesg);
+	if(conn == NULL) {
+		return -ENODEV;
+	}
+
+	timeout = hdhomerun_control_timeout(mesg->type);
+	if(timeout < 0) {
+		timeout = 0;
+	}
+
+	mesg->flags = 0;
+	mesg->seq = atomic_inc_return(&control_seq);
+	mesg->timeout = timeout;
+	mesg->ts_posted = hdhomerun_control_now();
+	mesg->ts_picked = 0;
+	mesg->ts_handled = 0;
+
+	INIT_LIST_HEAD(&req.list);
+	init_waitqueue_head(&req.wq);
+	req.mesg = mesg;
+	req.done = 0;
+
+	/* Posted under the lock, a takeover either sees the request in
+	   the pending list or happened before and we see conn dead. */
+	spin_lock_irqsave(&control_pending_lock, flags);
+	if(conn->dead) {
+		ret = -ENODEV;
+	}
+	else {
+		list_add_tail(&req.list, &conn->pending);
+		ret = hdhomerun_control_post_message(conn, mesg);
+		if(ret != 1) {
+			list_del_init(&req.list);
 		}
 	}
+	/* Still under the lock, once it is dropped a reply may be
+	   written over *mesg */
+	trace_hdhomerun_control_post(mesg, ret);
+	spin_unlock_irqrestore(&control_pending_lock, flags);
+
+	/* The request may move to another connection from here on */
+	kref_put(&conn->ref, hdhomerun_control_conn_free);
+
+	if(ret != 1) {
+		return ret < 0 ? ret : -ENOSPC;
+	}
 
+	/* Now we wait for userspace to return to us. The deadline holds
+	   across a takeover. */
+	if(timeout > 0) {
+		left = wait_event_interruptible_timeout(req.wq, req.done != 0, msecs_to_jiffies(timeout));
+	}
+	else {
+		left = wait_event_interruptible(req.wq, req.done != 0) ? -ERESTARTSYS : 1;
+	}
+
+	/* A reply may still have come in, it counts */
+	spin_lock_irqsave(&control_pending_lock, flags);
+	list_del_init(&req.list);
+	spin_unlock_irqrestore(&control_pending_lock, flags);
+
+	if(req.done == 0 && left < 0) {
+		ret = -ERESTARTSYS;
+	}
+	else if(req.done == 0) {
+		DEBUG_OUT(HDHOMERUN_CONTROL, "%s request %u type %u for tuner %d expired after %d ms\n",
+			  __FUNCTION__, mesg->seq, mesg->type, mesg->id, timeout);
+		if(mesg->type < DVB_HDHOMERUN_NUM_MESG_TYPES) {
+			atomic_inc(&control_expired[mesg->type]);
+		}
+		ret = -ETIMEDOUT;
+	}
+	else if(req.done < 0) {
+		ret = req.done;
+	}
+	else {
+		hdhomerun_control_record_latency(mesg);
+		ret = (mesg->flags & DVB_HDHOMERUN_MESG_BUSY) ? -EBUSY : sizeof(struct dvbhdhomerun_control_mesg);
+	}
+
+	trace_hdhomerun_control_wait(mesg, ret);
 	return ret;
 }
 EXPORT_SYMBOL(hdhomerun_control_post_and_wait);
 
+/* Hand the message to userspace and return right away, no reply will
+   be written back for it. */
+int hdhomerun_control_post_async(struct dvbhdhomerun_control_mesg *mesg) {
+	struct hdhomerun_control_conn *conn;
+	int ret;
+
+	conn = hdhomerun_control_get_owner(mesg);
+	if(conn == NULL) {
+		return -ENODEV;
+	}
+
+	mesg->flags = DVB_HDHOMERUN_MESG_NO_REPLY;
+	mesg->seq = atomic_inc_return(&control_seq);
+	mesg->timeout = 0;
+	mesg->ts_posted = hdhomerun_control_now();
+	mesg->ts_picked = 0;
+	mesg->ts_handled = 0;
+	ret = hdhomerun_control_post_message(conn, mesg);
+	trace_hdhomerun_control_post(mesg, ret);
+
+	kref_put(&conn->ref, hdhomerun_control_conn_free);
+	return ret;
+}
+EXPORT_SYMBOL(hdhomerun_control_post_async);
+
+static int hdhomerun_control_stats_show(struct seq_file *m, void *v)
+{
+	int i;
+
+	seq_printf(m, "%-24s %10s %10s %10s\n", "type", "timeout", "expired", "late");
+	for(i = 0; i < DVB_HDHOMERUN_NUM_MESG_TYPES; ++i) {
+		seq_printf(m, "%-24s %10d %10d %10d\n", control_mesg_names[i],
+			   hdhomerun_control_timeout(i),
+			   atomic_read(&control_expired[i]),
+			   atomic_read(&control_late[i]));
+	}
+
+	return 0;
+}
+
+static int hdhomerun_control_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, hdhomerun_control_stats_show, NULL);
+}
+
+static const struct file_operations hdhomerun_control_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = hdhomerun_control_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int hdhomerun_control_latency_show(struct seq_file *m, void *v)
+{
+	int type, stage, bucket, count;
+
+	seq_printf(m, "# type stage: <upper bound us>:<count> ...\n");
+	for(type = 0; type < DVB_HDHOMERUN_NUM_MESG_TYPES; ++type) {
+		for(stage = 0; stage < CONTROL_NUM_STAGES; ++stage) {
+			int shown = 0;
+			for(bucket = 0; bucket < CONTROL_LATENCY_BUCKETS; ++bucket) {
+				count = atomic_read(&control_latency[type][stage][bucket]);
+				if(count == 0) {
+					continue;
+				}
+				if(!shown) {
+					seq_printf(m, "%s %s:", control_mesg_names[type], control_stage_names[stage]);
+					shown = 1;
+				}
+				seq_printf(m, " %lu:%d", 1UL << bucket, count);
+			}
+			if(shown) {
+				seq_printf(m, "\n");
+			}
+		}
+	}
+
+	return 0;
+}
+
+static int hdhomerun_control_latency_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, hdhomerun_control_latency_show, NULL);
+}
+
+static const struct file_operations hdhomerun_control_latency_fops = {
+	.owner = THIS_MODULE,
+	.open = hdhomerun_control_latency_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int __init dvb_hdhomerun_core_init(void)
+{
+	/* Statistics are nice to have, carry on without debugfs */
+	hdhomerun_debugfs_dir = debugfs_create_dir("dvb_hdhomerun", NULL);
+	if(IS_ERR_OR_NULL(hdhomerun_debugfs_dir)) {
+		hdhomerun_debugfs_dir = NULL;
+		return 0;
+	}
+
+	debugfs_create_file("control", S_IRUGO, hdhomerun_debugfs_dir, NULL,
+			    &hdhomerun_control_stats_fops);
+	debugfs_create_file("latency", S_IRUGO, hdhomerun_debugfs_dir, NULL,
+			    &hdhomerun_control_latency_fops);
+
+	return 0;
+}
+
+static void __exit dvb_hdhomerun_core_exit(void)
+{
+	debugfs_remove_recursive(hdhomerun_debugfs_dir);
+	kfree(control_tuners);
+}
 
+module_init(dvb_hdhomerun_core_init);
+module_exit(dvb_hdhomerun_core_exit);
@@ -23,30 +23,48 @@
 #define __DVB_HDHOMERUN_CORE_H__
 
 #include <linux/kfifo.h>
+#include <linux/kref.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
 #include <linux/wait.h>
 
 #include "dvb_hdhomerun_control_messages.h"
 
 #define HDHOMERUN_VERSION "0.0.16"
 
-#define HDHOMERUN_MAX_TUNERS 8
+/* pid 0x2000 is used by the demux for the full TS */
+#define HDHOMERUN_NUM_PIDS 0x2001
+
+/* One per open of /dev/hdhomerun_control. Every userhdhomerun owns
+   the tuners it registered, requests for a tuner go to its owner and
+   the replies come back the same way. Freed when the last reference
+   is dropped, posters hold one while they use it. */
+struct hdhomerun_control_conn {
+	struct kref ref;
+
+	/* Requests for userspace */
+	struct kfifo fifo;
+	spinlock_t fifo_lock;
+	wait_queue_head_t inq;
+
+	/* Requests waiting for a reply, and whether the file is closed.
+	   Protected by control_pending_lock in dvb_hdhomerun_core.c */
+	struct list_head pending;
+	int dead;
+};
 
-extern struct kfifo control_fifo_user;
-extern struct kfifo control_fifo_kernel;
-extern int wait_for_write;
-extern int userspace_ready;
-extern wait_queue_head_t control_readq;
-extern wait_queue_head_t inq;
-extern wait_queue_head_t outq;
 extern int control_bufsize;
-extern spinlock_t control_spinlock_user;
-extern spinlock_t control_spinlock_kernel;
 
 extern int hdhomerun_debug_mask;
 
-extern int hdhomerun_control_post_message(struct dvbhdhomerun_control_mesg *mesg);
-extern int hdhomerun_control_wait_for_message(struct dvbhdhomerun_control_mesg *mesg);
+extern struct hdhomerun_control_conn *hdhomerun_control_conn_create(void);
+extern void hdhomerun_control_conn_release(struct hdhomerun_control_conn *conn);
+extern int hdhomerun_control_set_owner(int id, struct hdhomerun_control_conn *conn, int standby);
+extern void hdhomerun_control_set_takeover_handler(void (*handler)(int id));
+extern int hdhomerun_control_reply(struct hdhomerun_control_conn *conn, struct dvbhdhomerun_control_mesg *mesg);
+
 extern int hdhomerun_control_post_and_wait(struct dvbhdhomerun_control_mesg *mesg);
+extern int hdhomerun_control_post_async(struct dvbhdhomerun_control_mesg *mesg);
 
 
 #endif /* __DVB_HDHOMERUN_CORE_H__ */
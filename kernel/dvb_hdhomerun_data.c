@@ -29,18 +29,35 @@
 #include <linux/kernel.h>
 #include <linux/kfifo.h>
 #include <linux/kobject.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
 #include <linux/miscdevice.h>
 #include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/percpu.h>
 #include <linux/platform_device.h>
 #include <linux/slab.h>
 #include <linux/spinlock.h>
 #include <linux/wait.h>
 
+#include "dvb_hdhomerun_compat.h"
 #include "dvb_hdhomerun_core.h"
 #include "dvb_hdhomerun_debug.h"
 #include "dvb_hdhomerun_data.h"
-
-struct hdhomerun_data_state *hdhomerun_data_states[HDHOMERUN_MAX_TUNERS];
+#include "dvb_hdhomerun_trace.h"
+
+#define HDHOMERUN_TS_PACKET_SIZE 188
+
+/* Per CPU, summed up when read from sysfs */
+struct hdhomerun_data_stats {
+   u64 bytes;
+   u64 packets;
+   u64 writes;
+   /* Chunks handed to the demux ending in the middle of a packet */
+   u64 carries;
+   /* Time spent in dvb_dmx_swfilter */
+   u64 filter_ns;
+};
 
 struct hdhomerun_data_state {
    struct dvb_demux *dvb_demux;
@@ -49,12 +66,29 @@ struct hdhomerun_data_state {
    struct cdev cdev;
    struct device *device;
    char *write_buffer;
+   /* Bytes of a packet the demux is holding on to, one writer only */
+   int carry;
+   struct hdhomerun_data_stats __percpu *stats;
+   /* The sysfs statistics group was created */
+   int has_stats_group;
 };
 
+/* Minors reserved for the data devices, tuners are numbered from 0
+   up to this. Read when the first tuner is registered. */
+#define HDHOMERUN_DATA_MAX_DEVICES 64
+static int max_devices = HDHOMERUN_DATA_MAX_DEVICES;
+module_param(max_devices, int, S_IRUGO);
+MODULE_PARM_DESC(max_devices, "Max number of tuners (default 64)");
+
 static dev_t hdhomerun_major = -1;
 static struct class *hdhomerun_class;
 static int hdhomerun_num_of_devices = 0;
 
+/* Indexed by tuner id, grown as tuners are registered. Only touched
+   while registering tuners and at module exit. */
+static struct hdhomerun_data_state **hdhomerun_data_states = NULL;
+static int hdhomerun_data_states_size = 0;
+
 MODULE_AUTHOR("Villy Thomsen");
 MODULE_DESCRIPTION("HDHomeRun driver");
 MODULE_LICENSE("GPL");
@@ -64,22 +98,43 @@ static ssize_t hdhomerun_data_write(struct file *f, const char __user *buf,
                                     size_t count, loff_t *offset)
 {
    struct hdhomerun_data_state *state = f->private_data;
+   struct hdhomerun_data_stats *stats;
+   u64 filter_ns = 0;
+   u64 packets = 0;
+   u64 carries = 0;
+   ktime_t start;
    int copied = 0;
 
-   DEBUG_FUNC(1);
-   DEBUG_OUT(HDHOMERUN_DATA, "Count: %Zu, offset %lld\n", count, *offset);
-	
    while (copied < count) {
      int to_copy = min(count - copied, PAGE_SIZE);
      if (copy_from_user(state->write_buffer, buf + copied, to_copy)) {
+       trace_hdhomerun_data_write(state->id, count, -EFAULT);
        return -EFAULT;
      }
 	
      /* Feed stuff to V4l-DVB */
+     start = ktime_get();
      dvb_dmx_swfilter(state->dvb_demux, state->write_buffer, to_copy);
+     filter_ns += ktime_to_ns(ktime_sub(ktime_get(), start));
      copied += to_copy;
+
+     state->carry += to_copy;
+     packets += state->carry / HDHOMERUN_TS_PACKET_SIZE;
+     state->carry %= HDHOMERUN_TS_PACKET_SIZE;
+     if (state->carry != 0) {
+       carries++;
+     }
    }
 
+   stats = per_cpu_ptr(state->stats, get_cpu());
+   stats->bytes += copied;
+   stats->packets += packets;
+   stats->writes++;
+   stats->carries += carries;
+   stats->filter_ns += filter_ns;
+   put_cpu();
+
+   trace_hdhomerun_data_write(state->id, count, copied);
    return copied;
 }
 
@@ -111,6 +166,76 @@ static struct file_operations hdhomerun_data_fops = {
    .release = hdhomerun_data_release,
 };
 
+static void hdhomerun_data_sum_stats(struct hdhomerun_data_state *state,
+                                     struct hdhomerun_data_stats *total)
+{
+   struct hdhomerun_data_stats *stats;
+   int cpu;
+
+   memset(total, 0, sizeof(*total));
+   for_each_possible_cpu(cpu) {
+      stats = per_cpu_ptr(state->stats, cpu);
+      total->bytes += stats->bytes;
+      total->packets += stats->packets;
+      total->writes += stats->writes;
+      total->carries += stats->carries;
+      total->filter_ns += stats->filter_ns;
+   }
+}
+
+#define HDHOMERUN_DATA_STAT_ATTR(_name, _value)                         \
+static ssize_t _name##_show(struct device *dev,                         \
+                            struct device_attribute *attr, char *buf)   \
+{                                                                       \
+   struct hdhomerun_data_state *state = dev_get_drvdata(dev);           \
+   struct hdhomerun_data_stats total;                                   \
+                                                                        \
+   hdhomerun_data_sum_stats(state, &total);                             \
+   return sprintf(buf, "%llu\n", (unsigned long long)(_value));         \
+}                                                                       \
+static DEVICE_ATTR(_name, S_IRUGO, _name##_show, NULL)
+
+HDHOMERUN_DATA_STAT_ATTR(bytes, total.bytes);
+HDHOMERUN_DATA_STAT_ATTR(packets, total.packets);
+HDHOMERUN_DATA_STAT_ATTR(writes, total.writes);
+HDHOMERUN_DATA_STAT_ATTR(avg_write_size, total.writes ? div64_u64(total.bytes, total.writes) : 0);
+HDHOMERUN_DATA_STAT_ATTR(carries, total.carries);
+HDHOMERUN_DATA_STAT_ATTR(filter_us, div_u64(total.filter_ns, NSEC_PER_USEC));
+
+/* Feeds the demux is running, read without the demux lock */
+static ssize_t feeds_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+   struct hdhomerun_data_state *state = dev_get_drvdata(dev);
+   struct dvb_demux *demux = state->dvb_demux;
+   int feeds = 0;
+   int i;
+
+   for(i = 0; i < demux->feednum; ++i) {
+      if(demux->feed[i].state == DMX_STATE_GO) {
+         feeds++;
+      }
+   }
+
+   return sprintf(buf, "%d\n", feeds);
+}
+static DEVICE_ATTR(feeds, S_IRUGO, feeds_show, NULL);
+
+/* /sys/class/hdhomerun/hdhomerun_dataX/ */
+static struct attribute *hdhomerun_data_attrs[] = {
+   &dev_attr_bytes.attr,
+   &dev_attr_packets.attr,
+   &dev_attr_writes.attr,
+   &dev_attr_avg_write_size.attr,
+   &dev_attr_carries.attr,
+   &dev_attr_filter_us.attr,
+   &dev_attr_feeds.attr,
+   NULL
+};
+
+static struct attribute_group hdhomerun_data_attr_group = {
+   .attrs = hdhomerun_data_attrs,
+};
+
 int dvb_hdhomerun_data_init(int num_of_devices) {
    int ret = 0;
 
@@ -122,13 +247,23 @@ int dvb_hdhomerun_data_init(int num_of_devices) {
          goto fail_class_create;
       }
 	
-      /* Create major */
-      ret = alloc_chrdev_region(&hdhomerun_major, 0, num_of_devices, "hdhomerun_data");
+      if(max_devices < 1 || max_devices > MINORMASK + 1) {
+         printk(KERN_WARNING "hdhomerun: max_devices %d out of range, using %d\n", max_devices, HDHOMERUN_DATA_MAX_DEVICES);
+         max_devices = HDHOMERUN_DATA_MAX_DEVICES;
+      }
+
+      /* Create major. Room for all the tuners we can handle,
+         userhdhomerun registers more when an HDHomeRun shows up
+         later on. */
+      ret = alloc_chrdev_region(&hdhomerun_major, 0, max_devices, "hdhomerun_data");
       if(ret < 0) {
-         printk(KERN_WARNING "hdhomerun: Can't get major: %d, num of devices: %d\n", MAJOR(hdhomerun_major), num_of_devices);
+         printk(KERN_WARNING "hdhomerun: Can't get major, num of devices: %d\n", max_devices);
+         hdhomerun_major = -1;
+         class_destroy(hdhomerun_class);
+         return ret;
       }
 
-      hdhomerun_num_of_devices = num_of_devices;
+      hdhomerun_num_of_devices = max_devices;
    }
 
    return ret;
@@ -138,7 +273,40 @@ int dvb_hdhomerun_data_init(int num_of_devices) {
    return ret;
 }
 EXPORT_SYMBOL(dvb_hdhomerun_data_init);
+
+/* Tuner ids from here on have no data device */
+int dvb_hdhomerun_data_max_devices(void) {
+   return max_devices;
+}
+EXPORT_SYMBOL(dvb_hdhomerun_data_max_devices);
   
+static int hdhomerun_data_grow_states(int needed) {
+   struct hdhomerun_data_state **states;
+   int size = hdhomerun_data_states_size ? hdhomerun_data_states_size : 8;
+
+   if(needed <= hdhomerun_data_states_size) {
+      return 0;
+   }
+
+   while(size < needed) {
+      size *= 2;
+   }
+   if(size > hdhomerun_num_of_devices) {
+      size = hdhomerun_num_of_devices;
+   }
+
+   states = krealloc(hdhomerun_data_states, size * sizeof(*states), GFP_KERNEL);
+   if(states == NULL) {
+      return -ENOMEM;
+   }
+   memset(states + hdhomerun_data_states_size, 0,
+          (size - hdhomerun_data_states_size) * sizeof(*states));
+
+   hdhomerun_data_states = states;
+   hdhomerun_data_states_size = size;
+   return 0;
+}
+
 int dvb_hdhomerun_data_create_device(struct dvb_demux *dvb_demux, int id) {
    struct hdhomerun_data_state *state;
    int major;
@@ -152,6 +320,18 @@ int dvb_hdhomerun_data_create_device(struct dvb_demux *dvb_demux, int id) {
       return -1;
    }
 
+   if(id < 0 || id >= hdhomerun_num_of_devices) {
+      printk(KERN_ERR "hdhomerun: no minor for data device %d, max_devices is %d\n", id, hdhomerun_num_of_devices);
+      return -ENOSPC;
+   }
+
+   if(hdhomerun_data_grow_states(id + 1) < 0) {
+      printk(KERN_ERR
+             "HDHomeRun: out of memory for data device %d\n",
+             id);
+      return -ENOMEM;
+   }
+
    /* setup internal structure for storing data */
    state = kzalloc(sizeof(struct hdhomerun_data_state), GFP_KERNEL);
    if (state == NULL) {
@@ -164,12 +344,23 @@ int dvb_hdhomerun_data_create_device(struct dvb_demux *dvb_demux, int id) {
    state->dvb_demux = dvb_demux;
    state->id = id;
 
+   state->stats = alloc_percpu(struct hdhomerun_data_stats);
+   if (state->stats == NULL) {
+      printk(KERN_ERR
+             "HDHomeRun: out of memory for data device %d\n",
+             id);
+      kfree(state);
+      return -ENOMEM;
+   }
+
    /* buffer */
    state->write_buffer = (char *)get_zeroed_page(GFP_KERNEL);
    if (!state->write_buffer) {
       printk(KERN_ERR
              "HDHomeRun: Cannot allocate write buffer for device %d\n",
              id);
+      free_percpu(state->stats);
+      kfree(state);
       return -ENOMEM;
    }
 
@@ -189,11 +380,19 @@ int dvb_hdhomerun_data_create_device(struct dvb_demux *dvb_demux, int id) {
    }
 
    /* Create device file and sysfs entry */
-   state->device = device_create(hdhomerun_class, NULL, state->dev, NULL, "hdhomerun_data%d", id);
+   state->device = device_create(hdhomerun_class, NULL, state->dev, state, "hdhomerun_data%d", id);
    if(IS_ERR(state->device)) {
       ret = PTR_ERR(state->device);
       goto fail_device_create;
    }
+
+   /* Statistics are nice to have, carry on without them */
+   if(sysfs_create_group(&state->device->kobj, &hdhomerun_data_attr_group) < 0) {
+      printk(KERN_WARNING "hdhomerun: no statistics for /dev/hdhomerun_data%d\n", id);
+   }
+   else {
+      state->has_stats_group = 1;
+   }
    printk(KERN_INFO "hdhomerun: device /dev/hdhomerun_data%d created\n", id);
 	
    hdhomerun_data_states[id] = state;
@@ -202,20 +401,38 @@ int dvb_hdhomerun_data_create_device(struct dvb_demux *dvb_demux, int id) {
 
  fail_device_create:
    printk(KERN_ERR "unable to create device /dev/hdhomerun%d\n", id);
+   cdev_del(&state->cdev);
+   free_page((unsigned long)state->write_buffer);
+   free_percpu(state->stats);
+   kfree(state);
    return ret;
 }
 EXPORT_SYMBOL(dvb_hdhomerun_data_create_device);
 
 void dvb_hdhomerun_data_delete_device(int id) {
+   struct hdhomerun_data_state *state;
+
    DEBUG_FUNC(1);
 
+   if(id < 0 || id >= hdhomerun_data_states_size || hdhomerun_data_states[id] == NULL) {
+      return;
+   }
+   state = hdhomerun_data_states[id];
+
    /* free allocated buffer */
-   if(hdhomerun_data_states[id]->write_buffer != NULL) {
-      free_page((unsigned long)hdhomerun_data_states[id]->write_buffer);
-      hdhomerun_data_states[id]->write_buffer = NULL;
+   if(state->write_buffer != NULL) {
+      free_page((unsigned long)state->write_buffer);
+      state->write_buffer = NULL;
    }
-   cdev_del(&hdhomerun_data_states[id]->cdev);
-   device_destroy(hdhomerun_class, hdhomerun_data_states[id]->dev);
+   cdev_del(&state->cdev);
+   if(state->has_stats_group) {
+      sysfs_remove_group(&state->device->kobj, &hdhomerun_data_attr_group);
+   }
+   device_destroy(hdhomerun_class, state->dev);
+   free_percpu(state->stats);
+
+   hdhomerun_data_states[id] = NULL;
+   kfree(state);
 }
 EXPORT_SYMBOL(dvb_hdhomerun_data_delete_device);
 
@@ -228,5 +445,9 @@ void dvb_hdhomerun_data_exit() {
 
       class_destroy(hdhomerun_class);
    }
+
+   kfree(hdhomerun_data_states);
+   hdhomerun_data_states = NULL;
+   hdhomerun_data_states_size = 0;
 }
 EXPORT_SYMBOL(dvb_hdhomerun_data_exit);
@@ -27,6 +27,7 @@
 #include "dvb_hdhomerun_control_messages.h"
 
 extern int dvb_hdhomerun_data_init(int num_of_devices);
+extern int dvb_hdhomerun_data_max_devices(void);
 extern int dvb_hdhomerun_data_create_device(struct dvb_demux *dvb_demux, int id);
 extern void dvb_hdhomerun_data_delete_device(int id);
 extern void dvb_hdhomerun_data_exit(void);
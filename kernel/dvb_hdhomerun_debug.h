@@ -32,6 +32,8 @@ enum enum_hdhomerun_debug_mask {
 	HDHOMERUN_STREAM = 16
 };
 
+/* Not for the per-message and per-write paths, those have the
+   tracepoints in dvb_hdhomerun_trace.h. */
 #define DEBUG_OUT(level, fmt, args...) if( level & hdhomerun_debug_mask )	\
     printk(KERN_DEBUG fmt, ## args);
 
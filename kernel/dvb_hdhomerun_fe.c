@@ -53,12 +53,19 @@ static int dvb_hdhomerun_fe_read_status(struct dvb_frontend* fe, enum fe_status*
 {
 	struct dvbhdhomerun_control_mesg mesg;
 	struct dvb_hdhomerun_fe_state* state = fe->demodulator_priv;
+	int ret;
 
 	DEBUG_FUNC(1);
 
 	mesg.type = DVB_HDHOMERUN_FE_READ_STATUS;
 	mesg.id = state->id;
-	hdhomerun_control_post_and_wait(&mesg);
+	/* No userhdhomerun right now or it didn't answer in time
+	   (-ENODEV, -ETIMEDOUT), no lock */
+	ret = hdhomerun_control_post_and_wait(&mesg);
+	if(ret < 0) {
+		*status = 0;
+		return ret;
+	}
 
 	*status = mesg.u.frontend_status;
 
@@ -77,12 +84,17 @@ static int dvb_hdhomerun_fe_read_signal_strength(struct dvb_frontend* fe, u16* s
 {
 	struct dvbhdhomerun_control_mesg mesg;
 	struct dvb_hdhomerun_fe_state* state = fe->demodulator_priv;
+	int ret;
 
 	DEBUG_FUNC(1);
 
 	mesg.type = DVB_HDHOMERUN_FE_READ_SIGNAL_STRENGTH;
 	mesg.id = state->id;
-	hdhomerun_control_post_and_wait(&mesg);
+	ret = hdhomerun_control_post_and_wait(&mesg);
+	if(ret < 0) {
+		*strength = 0;
+		return ret;
+	}
 
 	*strength = mesg.u.signal_strength;
 
@@ -123,6 +135,7 @@ static int dvb_hdhomerun_fe_set_frontend(struct dvb_frontend* fe, struct dvb_fro
 #endif
 {
 	struct dvb_hdhomerun_fe_state* state = fe->demodulator_priv;
+	int ret;
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3,3,0)
 	struct dtv_frontend_properties *p = &fe->dtv_property_cache;
@@ -148,7 +161,11 @@ static int dvb_hdhomerun_fe_set_frontend(struct dvb_frontend* fe, struct dvb_fro
 		mesg.id = state->id;
 		mesg.u.frequency = p->frequency;
 		
-		hdhomerun_control_post_and_wait(&mesg);
+		/* Without a userhdhomerun the channel is still kept and
+		   tuned once one connects */
+		ret = hdhomerun_control_post_and_wait(&mesg);
+		if(ret == -ETIMEDOUT || ret == -EBUSY)
+			return ret;
 	}
 
 	return 0;
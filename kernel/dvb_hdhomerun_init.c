@@ -24,7 +24,11 @@
 #include <linux/moduleparam.h>
 #include <linux/init.h>
 
+#include <linux/jhash.h>
+#include <linux/mutex.h>
 #include <linux/platform_device.h>
+#include <linux/slab.h>
+#include <linux/string.h>
 
 #include "dvb_demux.h"
 #include "dvb_frontend.h"
@@ -37,6 +41,7 @@
 #include "dvb_hdhomerun_data.h"
 #include "dvb_hdhomerun_debug.h"
 #include "dvb_hdhomerun_fe.h"
+#include "dvb_hdhomerun_trace.h"
 
 #include "dvb_hdhomerun_init.h"
 
@@ -66,49 +71,74 @@ struct dvb_hdhomerun {
 	struct dvb_frontend *fe;
 
 	struct mutex feedlock;
+	/* Number of demux feeds per pid, protected by feedlock */
+	u16 pid_users[HDHOMERUN_NUM_PIDS];
 
 	struct hdhomerun_register_tuner_data tuner_data;
+
+	/* Next tuner in the same hdhomerun_names bucket */
+	struct dvb_hdhomerun *name_next;
 };
 
-struct platform_device *platform_device[HDHOMERUN_MAX_TUNERS];
+/* Only the first part of the name identifies the tuner */
+#define HDHOMERUN_NAME_LEN 10
+#define HDHOMERUN_NAME_HASH_SIZE 64
 
+/* Registered tuners, indexed by id and grown as tuners show up. The
+   name hash lets a restarted userhdhomerun find its old tuners.
+   Everything here is protected by hdhomerun_register_mutex. */
+static struct platform_device **hdhomerun_devices = NULL;
+static int hdhomerun_devices_size = 0;
 static int hdhomerun_num_of_devices = 0;
+static struct dvb_hdhomerun *hdhomerun_names[HDHOMERUN_NAME_HASH_SIZE];
+static DEFINE_MUTEX(hdhomerun_register_mutex);
 
 /*
  * Demux setup
  */
+static int dvb_hdhomerun_post_feed(struct dvb_hdhomerun *hdhomerun,
+				   u16 pid, unsigned int index, unsigned int type)
+{
+	struct dvbhdhomerun_control_mesg mesg;
+	struct hdhomerun_dvb_demux_feed my_feed = {
+		.pid = pid,
+		.index = index,
+	};
+	mesg.type = type;
+	mesg.id = hdhomerun->plat_dev->id;
+	mesg.u.demux_feed = my_feed;
+
+	return hdhomerun_control_post_async(&mesg);
+}
+
+/* Only the first feed on a pid and the last one leaving it are sent
+   to userspace. The demux doesn't wait for userspace to reprogram the
+   HDHomeRun, we return as soon as the message is queued. */
 static int dvb_hdhomerun_start_feed(struct dvb_demux_feed *feed)
 {
 	int ret = 0;
 	struct dvb_demux *demux = feed->demux;
 	struct dvb_hdhomerun *hdhomerun = (struct dvb_hdhomerun *) demux->priv;
 	
-	DEBUG_FUNC(1);
-
 	if (hdhomerun == NULL)
 		return -EINVAL;
 	
-	DEBUG_OUT(HDHOMERUN_STREAM, "hdhomerun%d: Tuner: %s "
-		  "start feed: pid = 0x%x index = %d\n",
-		  hdhomerun->instance, hdhomerun->tuner_data.name, feed->pid, feed->index);
-
-	
-	
 	if (!demux->dmx.frontend)
 		return -EINVAL;
 
+	if (feed->pid >= HDHOMERUN_NUM_PIDS)
+		return -EINVAL;
+
 	mutex_lock(&hdhomerun->feedlock);
-	{
-		struct dvbhdhomerun_control_mesg mesg;
-		struct hdhomerun_dvb_demux_feed my_feed = {
-			.pid = feed->pid,
-			.index = feed->index,
-		};
-		mesg.type = DVB_HDHOMERUN_START_FEED;
-		mesg.id = hdhomerun->plat_dev->id;
-		mesg.u.demux_feed = my_feed;
-		ret = hdhomerun_control_post_and_wait(&mesg);
+
+	if (hdhomerun->pid_users[feed->pid]++ == 0) {
+		if (dvb_hdhomerun_post_feed(hdhomerun, feed->pid, feed->index, DVB_HDHOMERUN_START_FEED) < 0) {
+			hdhomerun->pid_users[feed->pid]--;
+			ret = -EIO;
+		}
 	}
+	trace_hdhomerun_feed(hdhomerun->instance, feed->pid, feed->index, 1,
+			     hdhomerun->pid_users[feed->pid]);
 	
 	mutex_unlock(&hdhomerun->feedlock);
 	return ret;
@@ -116,36 +146,57 @@ static int dvb_hdhomerun_start_feed(struct dvb_demux_feed *feed)
 
 static int dvb_hdhomerun_stop_feed(struct dvb_demux_feed *feed)
 {
-	int ret = 0;
 	struct dvb_demux *demux = feed->demux;
 	struct dvb_hdhomerun *hdhomerun = (struct dvb_hdhomerun *) demux->priv;
 
-	DEBUG_FUNC(1);
-
 	if (hdhomerun == NULL)
 		return -EINVAL;
 
-	DEBUG_OUT(HDHOMERUN_STREAM, "hdhomerun%d: "
-		  "Stop feed: pid = 0x%x index = %d\n",
-		  hdhomerun->instance, feed->pid, feed->index);
+	if (feed->pid >= HDHOMERUN_NUM_PIDS)
+		return -EINVAL;
 	
 	mutex_lock(&hdhomerun->feedlock);
-	{
-		struct dvbhdhomerun_control_mesg mesg;
-		struct hdhomerun_dvb_demux_feed my_feed = {
-			.pid = feed->pid,
-			.index = feed->index,
-		};
-		mesg.type = DVB_HDHOMERUN_STOP_FEED;
-		mesg.id = hdhomerun->plat_dev->id;
-		mesg.u.demux_feed = my_feed;
-		ret = hdhomerun_control_post_and_wait(&mesg);
-	}
 
+	if (hdhomerun->pid_users[feed->pid] > 0 &&
+	    --hdhomerun->pid_users[feed->pid] == 0) {
+		/* If this fails userspace keeps a pid too many in its
+		   filter, the demux drops those packets anyway. */
+		dvb_hdhomerun_post_feed(hdhomerun, feed->pid, feed->index, DVB_HDHOMERUN_STOP_FEED);
+	}
+	trace_hdhomerun_feed(hdhomerun->instance, feed->pid, feed->index, 0,
+			     hdhomerun->pid_users[feed->pid]);
 
 	mutex_unlock(&hdhomerun->feedlock);
 
-	return ret;
+	return 0;
+}
+
+/* The tuner has a new userhdhomerun, after a takeover or a restart.
+   Tell it about every pid the demux still streams. */
+static void dvb_hdhomerun_takeover(int id)
+{
+	struct dvb_hdhomerun *hdhomerun = NULL;
+	int pid;
+
+	DEBUG_FUNC(1);
+
+	/* Tuners stay until the module is unloaded */
+	mutex_lock(&hdhomerun_register_mutex);
+	if(id < hdhomerun_num_of_devices) {
+		hdhomerun = platform_get_drvdata(hdhomerun_devices[id]);
+	}
+	mutex_unlock(&hdhomerun_register_mutex);
+
+	if(hdhomerun == NULL)
+		return;
+
+	mutex_lock(&hdhomerun->feedlock);
+	for(pid = 0; pid < HDHOMERUN_NUM_PIDS; ++pid) {
+		if(hdhomerun->pid_users[pid] > 0) {
+			dvb_hdhomerun_post_feed(hdhomerun, pid, 0, DVB_HDHOMERUN_START_FEED);
+		}
+	}
+	mutex_unlock(&hdhomerun->feedlock);
 }
 
 static int __devinit dvb_hdhomerun_register(struct dvb_hdhomerun *hdhomerun)
@@ -337,55 +388,115 @@ static int dvb_hdhomerun_remove(struct platform_device *plat_dev)
 }
 
 
+static u32 dvb_hdhomerun_name_hash(const char *name)
+{
+	return jhash(name, strnlen(name, HDHOMERUN_NAME_LEN), 0) & (HDHOMERUN_NAME_HASH_SIZE - 1);
+}
+
+static struct dvb_hdhomerun *dvb_hdhomerun_find_name(const char *name)
+{
+	struct dvb_hdhomerun *hdhomerun;
+
+	for(hdhomerun = hdhomerun_names[dvb_hdhomerun_name_hash(name)];
+	    hdhomerun != NULL;
+	    hdhomerun = hdhomerun->name_next) {
+		if(strncmp(name, hdhomerun->tuner_data.name, HDHOMERUN_NAME_LEN) == 0) {
+			return hdhomerun;
+		}
+	}
+
+	return NULL;
+}
+
+static int dvb_hdhomerun_grow_devices(int needed)
+{
+	struct platform_device **devices;
+	int size = hdhomerun_devices_size ? hdhomerun_devices_size : 8;
+
+	if(needed <= hdhomerun_devices_size) {
+		return 0;
+	}
+
+	while(size < needed) {
+		size *= 2;
+	}
+	if(size > dvb_hdhomerun_data_max_devices()) {
+		size = dvb_hdhomerun_data_max_devices();
+	}
+
+	devices = krealloc(hdhomerun_devices, size * sizeof(*devices), GFP_KERNEL);
+	if(devices == NULL) {
+		return -ENOMEM;
+	}
+	memset(devices + hdhomerun_devices_size, 0,
+	       (size - hdhomerun_devices_size) * sizeof(*devices));
+
+	hdhomerun_devices = devices;
+	hdhomerun_devices_size = size;
+	return 0;
+}
+
 int dvb_hdhomerun_register_hdhomerun(struct hdhomerun_register_tuner_data *tuner_data) 
 {
-	int i;
-	int ret;
+	int ret = 0;
+	u32 bucket;
 	struct dvb_hdhomerun *hdhomerun;
-	struct hdhomerun_register_tuner_data *tmp;
+	struct platform_device *plat_dev;
 
 	DEBUG_FUNC(1);
 
+	mutex_lock(&hdhomerun_register_mutex);
+
 	/* Check if we already have this tuner registered, handles the
 	   case where userhdhomerun has been stopped/started. */
-	if(hdhomerun_num_of_devices > 0) {
-		for(i = 0; i < hdhomerun_num_of_devices; ++i) {
-			hdhomerun = platform_get_drvdata(platform_device[i]);
-			tmp = &hdhomerun->tuner_data;
-			if(strncmp(tuner_data->name, tmp->name, 10) == 0) {
-				/* Already have that tuner */
-				printk("hdhomerun: dvb device for this tuner already exists, ignore request %s\n", tuner_data->name);
-				tuner_data->id = tmp->id;
-				return 0;
-			}
-		}
+	hdhomerun = dvb_hdhomerun_find_name(tuner_data->name);
+	if(hdhomerun != NULL) {
+		printk("hdhomerun: dvb device for this tuner already exists, ignore request %s\n", tuner_data->name);
+		tuner_data->id = hdhomerun->tuner_data.id;
+		goto out;
 	}
 
-	if(hdhomerun_num_of_devices < HDHOMERUN_MAX_TUNERS) {
-		platform_device[hdhomerun_num_of_devices] = platform_device_register_simple("HDHomeRun",
-											    hdhomerun_num_of_devices, NULL, 0);
-		if (IS_ERR(platform_device)) {
-			printk(KERN_ERR "HdhomeRun: could not allocate and register instance %d\n", hdhomerun_num_of_devices);
-			return -ENODEV;
-		}
-		tuner_data->id = platform_device[hdhomerun_num_of_devices]->id;
-
-		hdhomerun = platform_get_drvdata(platform_device[hdhomerun_num_of_devices]);
-		hdhomerun->tuner_data = *tuner_data;
+	if(hdhomerun_num_of_devices >= dvb_hdhomerun_data_max_devices()) {
+		printk(KERN_ERR "HdhomeRun: no room for %s, max_devices is %d\n", tuner_data->name, dvb_hdhomerun_data_max_devices());
+		ret = -ENOSPC;
+		goto out;
+	}
 
-		ret = dvb_hdhomerun_register(hdhomerun);
-		if (ret < 0) {
-			platform_set_drvdata(platform_device[hdhomerun_num_of_devices], NULL);
-			kfree(hdhomerun);
-		}
+	ret = dvb_hdhomerun_grow_devices(hdhomerun_num_of_devices + 1);
+	if(ret < 0) {
+		printk(KERN_ERR "HdhomeRun: out of memory for instance %d\n", hdhomerun_num_of_devices);
+		goto out;
+	}
 
-		hdhomerun_num_of_devices++;
+	plat_dev = platform_device_register_simple("HDHomeRun", hdhomerun_num_of_devices, NULL, 0);
+	if (IS_ERR(plat_dev)) {
+		printk(KERN_ERR "HdhomeRun: could not allocate and register instance %d\n", hdhomerun_num_of_devices);
+		ret = -ENODEV;
+		goto out;
 	}
-	else {
-		return -ENODEV;
+	tuner_data->id = plat_dev->id;
+
+	hdhomerun = platform_get_drvdata(plat_dev);
+	hdhomerun->tuner_data = *tuner_data;
+
+	ret = dvb_hdhomerun_register(hdhomerun);
+	if (ret < 0) {
+		/* Give the id back, the next tuner can have it */
+		platform_set_drvdata(plat_dev, NULL);
+		kfree(hdhomerun);
+		platform_device_unregister(plat_dev);
+		goto out;
 	}
 
-	return 0;
+	hdhomerun_devices[hdhomerun_num_of_devices++] = plat_dev;
+
+	bucket = dvb_hdhomerun_name_hash(hdhomerun->tuner_data.name);
+	hdhomerun->name_next = hdhomerun_names[bucket];
+	hdhomerun_names[bucket] = hdhomerun;
+
+ out:
+	mutex_unlock(&hdhomerun_register_mutex);
+	return ret;
 }
 EXPORT_SYMBOL(dvb_hdhomerun_register_hdhomerun);
 
@@ -422,6 +533,8 @@ static int __init dvb_hdhomerun_init(void)
 
 	ret = dvb_hdhomerun_control_init();
 
+	hdhomerun_control_set_takeover_handler(dvb_hdhomerun_takeover);
+
 	printk(KERN_INFO "HDHomeRun: Waiting for userspace to connect\n");
 
 	/* Hmmm, need a bit more error checking in the above */
@@ -439,14 +552,16 @@ static void __exit dvb_hdhomerun_exit(void)
 
 	DEBUG_FUNC(1);
 
+	hdhomerun_control_set_takeover_handler(NULL);
+
 	dvb_hdhomerun_control_exit();
 
-	if(hdhomerun_num_of_devices) {
-		for(i = 0; i < hdhomerun_num_of_devices; ++i) {
-			dvb_hdhomerun_data_delete_device(i);
-			platform_device_unregister(platform_device[i]);
-		}
+	for(i = 0; i < hdhomerun_num_of_devices; ++i) {
+		dvb_hdhomerun_data_delete_device(i);
+		platform_device_unregister(hdhomerun_devices[i]);
 	}
+	kfree(hdhomerun_devices);
+	hdhomerun_devices = NULL;
 
 	dvb_hdhomerun_data_exit();
 
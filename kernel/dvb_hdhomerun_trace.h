@@ -0,0 +1,168 @@
+/*
+ * dvb_hdhomerun_trace.h, skeleton driver for the HDHomeRun devices
+ *
+ * Copyright (C) 2010 Villy Thomsen <tfylliv@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+/* Tracepoints for the control and data paths, under
+   /sys/kernel/debug/tracing/events/dvb_hdhomerun/ for perf and
+   trace-cmd. They are created in dvb_hdhomerun_core, the feed and
+   data write events are exported to dvb_hdhomerun. */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM dvb_hdhomerun
+
+#if !defined(__DVB_HDHOMERUN_TRACE_H__) || defined(TRACE_HEADER_MULTI_READ)
+#define __DVB_HDHOMERUN_TRACE_H__
+
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/tracepoint.h>
+
+#include "dvb_hdhomerun_control_messages.h"
+
+/* A message queued for userspace, ret is what the kfifo took */
+TRACE_EVENT(hdhomerun_control_post,
+	TP_PROTO(struct dvbhdhomerun_control_mesg *mesg, int ret),
+	TP_ARGS(mesg, ret),
+
+	TP_STRUCT__entry(
+		__field(int, id)
+		__field(unsigned int, type)
+		__field(unsigned int, seq)
+		__field(int, async)
+		__field(int, ret)
+	),
+
+	TP_fast_assign(
+		__entry->id = mesg->id;
+		__entry->type = mesg->type;
+		__entry->seq = mesg->seq;
+		__entry->async = (mesg->flags & DVB_HDHOMERUN_MESG_NO_REPLY) != 0;
+		__entry->ret = ret;
+	),
+
+	TP_printk("tuner=%d type=%u seq=%u async=%d ret=%d",
+		  __entry->id, __entry->type, __entry->seq, __entry->async, __entry->ret)
+);
+
+/* The caller of post_and_wait wakes up, with the reply or an error */
+TRACE_EVENT(hdhomerun_control_wait,
+	TP_PROTO(struct dvbhdhomerun_control_mesg *mesg, int ret),
+	TP_ARGS(mesg, ret),
+
+	TP_STRUCT__entry(
+		__field(int, id)
+		__field(unsigned int, type)
+		__field(unsigned int, seq)
+		__field(int, ret)
+		__field(u64, waited_us)
+	),
+
+	TP_fast_assign(
+		__entry->id = mesg->id;
+		__entry->type = mesg->type;
+		__entry->seq = mesg->seq;
+		__entry->ret = ret;
+		__entry->waited_us = div_u64(ktime_to_ns(ktime_get()) - mesg->ts_posted, NSEC_PER_USEC);
+	),
+
+	TP_printk("tuner=%d type=%u seq=%u ret=%d waited_us=%llu",
+		  __entry->id, __entry->type, __entry->seq, __entry->ret,
+		  (unsigned long long)__entry->waited_us)
+);
+
+/* A reply written by userspace, matched is 0 when nobody waits for it */
+TRACE_EVENT(hdhomerun_control_reply,
+	TP_PROTO(struct dvbhdhomerun_control_mesg *mesg, int matched),
+	TP_ARGS(mesg, matched),
+
+	TP_STRUCT__entry(
+		__field(int, id)
+		__field(unsigned int, type)
+		__field(unsigned int, seq)
+		__field(int, matched)
+	),
+
+	TP_fast_assign(
+		__entry->id = mesg->id;
+		__entry->type = mesg->type;
+		__entry->seq = mesg->seq;
+		__entry->matched = matched;
+	),
+
+	TP_printk("tuner=%d type=%u seq=%u matched=%d",
+		  __entry->id, __entry->type, __entry->seq, __entry->matched)
+);
+
+/* The demux starts or stops a feed, users is the count for the pid
+   afterwards. Only the 0 <-> 1 changes are posted to userspace. */
+TRACE_EVENT(hdhomerun_feed,
+	TP_PROTO(int id, int pid, int index, int start, int users),
+	TP_ARGS(id, pid, index, start, users),
+
+	TP_STRUCT__entry(
+		__field(int, id)
+		__field(int, pid)
+		__field(int, index)
+		__field(int, start)
+		__field(int, users)
+	),
+
+	TP_fast_assign(
+		__entry->id = id;
+		__entry->pid = pid;
+		__entry->index = index;
+		__entry->start = start;
+		__entry->users = users;
+	),
+
+	TP_printk("tuner=%d %s pid=0x%x index=%d users=%d",
+		  __entry->id, __entry->start ? "start" : "stop",
+		  __entry->pid, __entry->index, __entry->users)
+);
+
+/* userhdhomerun wrote TS data to /dev/hdhomerun_dataX */
+TRACE_EVENT(hdhomerun_data_write,
+	TP_PROTO(int id, size_t count, ssize_t ret),
+	TP_ARGS(id, count, ret),
+
+	TP_STRUCT__entry(
+		__field(int, id)
+		__field(size_t, count)
+		__field(ssize_t, ret)
+	),
+
+	TP_fast_assign(
+		__entry->id = id;
+		__entry->count = count;
+		__entry->ret = ret;
+	),
+
+	TP_printk("tuner=%d count=%zu ret=%zd",
+		  __entry->id, __entry->count, __entry->ret)
+);
+
+#endif /* __DVB_HDHOMERUN_TRACE_H__ */
+
+/* Outside the guard, define_trace.h reads this file again */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE dvb_hdhomerun_trace
+#include <trace/define_trace.h>
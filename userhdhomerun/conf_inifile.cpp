@@ -51,12 +51,12 @@ bool ConfIniFile::OpenIniFile(const string& _filename)
 }
 
 bool ConfIniFile::GetSecValue(const std::string& _section, const std::string& _key,
-                              std::string& _value)
+                              std::string& _value) const
 {
-   mapSecKeyVal::iterator it = m_sectionKeyValue.find(_section);
+   mapSecKeyVal::const_iterator it = m_sectionKeyValue.find(_section);
    
    if( it != m_sectionKeyValue.end() ) {
-      mapKeyVal::iterator keyValIt = it->second.find(_key);
+      mapKeyVal::const_iterator keyValIt = it->second.find(_key);
 
       if( keyValIt != it->second.end() ) {
          _value = keyValIt->second;
@@ -67,3 +67,14 @@ bool ConfIniFile::GetSecValue(const std::string& _section, const std::string& _k
    return false;
 }
 
+bool ConfIniFile::GetSection(const std::string& _section, mapKeyVal& _keyValues) const
+{
+   mapSecKeyVal::const_iterator it = m_sectionKeyValue.find(_section);
+
+   if( it != m_sectionKeyValue.end() ) {
+      _keyValues = it->second;
+      return true;
+   }
+
+   return false;
+}
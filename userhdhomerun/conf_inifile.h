@@ -12,7 +12,8 @@ class ConfIniFile
 public:
   bool OpenIniFile(const std::string& _fileName);
   bool GetSecValue(const std::string& _section, const std::string& _key,
-		   std::string& _value);
+		   std::string& _value) const;
+  bool GetSection(const std::string& _section, mapKeyVal& _keyValues) const;
 
 private:
 
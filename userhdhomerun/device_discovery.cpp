@@ -0,0 +1,358 @@
+/*
+ * device_discovery.cpp, finds the HDHomeRun devices to use
+ *
+ * Copyright (C) 2010 Villy Thomsen <tfylliv@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include "device_discovery.h"
+
+#include "conf_inifile.h"
+#include "config.h"
+#include "hdhomerun_controller.h"
+#include "log_file.h"
+
+#include <hdhomerun.h>
+
+#include <arpa/inet.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+using namespace std;
+
+// Used when neither the conf file nor libhdhomerun tells us.
+static const int DEFAULT_TUNER_COUNT = 2;
+
+static const int INITIAL_DISCOVER_DEVICES = 16;
+
+static const int DEFAULT_REDISCOVERY_INTERVAL = 60;
+
+static string IPToString(uint32_t _ip)
+{
+   ostringstream str;
+   str << ((_ip >> 24) & 0xff) << "." << ((_ip >> 16) & 0xff) << "."
+       << ((_ip >> 8) & 0xff) << "." << (_ip & 0xff);
+   return str.str();
+}
+
+static HdhomerunDevice* FindDevice(vector<HdhomerunDevice>& _devices, uint32_t _deviceId)
+{
+   vector<HdhomerunDevice>::iterator it;
+   for(it = _devices.begin(); it != _devices.end(); ++it) {
+      if(it->deviceId == _deviceId) {
+         return &(*it);
+      }
+   }
+   return NULL;
+}
+
+DeviceDiscovery::DeviceDiscovery(HdhomerunController* _controller, const ConfIniFile* _conf)
+   : m_controller(_controller), m_cacheFile("/var/cache/dvbhdhomerun/devices"),
+     m_interval(DEFAULT_REDISCOVERY_INTERVAL), m_discovered(false)
+{
+   if(!_conf) {
+      return;
+   }
+
+   string cacheFile;
+   if(_conf->GetSecValue("userhdhomerun", "discovery_cache", cacheFile)) {
+      m_cacheFile = cacheFile;
+   }
+
+   string interval;
+   if(_conf->GetSecValue("userhdhomerun", "rediscovery_interval", interval)) {
+      m_interval = atoi(interval.c_str());
+   }
+
+   string shard;
+   if(_conf->GetSecValue("userhdhomerun", "shard_devices", shard)) {
+      istringstream str(shard);
+      string deviceId;
+      while(str >> deviceId) {
+         uint32_t id = strtoul(deviceId.c_str(), NULL, 16);
+         if(!hdhomerun_discover_validate_device_id(id)) {
+            ERR() << "Invalid device id in shard_devices: " << deviceId << endl;
+            continue;
+         }
+         m_shard.insert(id);
+      }
+      LOG() << "Only using " << m_shard.size() << " devices from shard_devices" << endl;
+   }
+
+   //
+   // [devices]
+   // <device id>=<ip address> [<number of tuners>]
+   //
+   mapKeyVal devices;
+   if(_conf->GetSection("devices", devices)) {
+      mapKeyVal::const_iterator it;
+      for(it = devices.begin(); it != devices.end(); ++it) {
+         HdhomerunDevice device;
+         device.deviceId = strtoul(it->first.c_str(), NULL, 16);
+         device.deviceIP = 0;
+         device.tunerCount = 0;
+
+         if(!hdhomerun_discover_validate_device_id(device.deviceId)) {
+            ERR() << "Invalid device id in conf file: " << it->first << endl;
+            continue;
+         }
+
+         istringstream str(it->second);
+         string ip;
+         if(str >> ip) {
+            struct in_addr addr;
+            if(inet_aton(ip.c_str(), &addr)) {
+               device.deviceIP = ntohl(addr.s_addr);
+            }
+            else {
+               ERR() << "Invalid ip address for device " << it->first << ": " << ip << endl;
+            }
+         }
+         str >> device.tunerCount;
+
+         if(InShard(device.deviceId)) {
+            m_configured.push_back(device);
+         }
+      }
+   }
+}
+
+void DeviceDiscovery::GetKnownDevices(std::vector<HdhomerunDevice>& _devices)
+{
+   vector<HdhomerunDevice> cached;
+   LoadCache(cached);
+
+   // Configured devices take precedence, the cache fills in the blanks.
+   _devices = m_configured;
+   vector<HdhomerunDevice>::iterator it;
+   for(it = _devices.begin(); it != _devices.end(); ++it) {
+      HdhomerunDevice* cachedDevice = FindDevice(cached, it->deviceId);
+      if(cachedDevice) {
+         if(it->deviceIP == 0) {
+            it->deviceIP = cachedDevice->deviceIP;
+         }
+         if(it->tunerCount <= 0) {
+            it->tunerCount = cachedDevice->tunerCount;
+         }
+      }
+      if(it->tunerCount <= 0) {
+         it->tunerCount = DEFAULT_TUNER_COUNT;
+      }
+   }
+
+   for(it = cached.begin(); it != cached.end(); ++it) {
+      if(InShard(it->deviceId) && !FindDevice(_devices, it->deviceId)) {
+         _devices.push_back(*it);
+      }
+   }
+
+   for(it = _devices.begin(); it != _devices.end(); ++it) {
+      LOG() << "Known device " << hex << it->deviceId << dec << " at "
+            << IPToString(it->deviceIP) << " with " << it->tunerCount << " tuners" << endl;
+   }
+
+   m_known = _devices;
+}
+
+bool DeviceDiscovery::Discover(std::vector<HdhomerunDevice>& _devices)
+{
+   _devices.clear();
+
+   // Ask for more until libhdhomerun doesn't fill the whole array.
+   // The vector zeroes the entries, hdhomerun_discover_device_t has
+   // grown in size across versions of libhdhomerun.
+   vector<struct hdhomerun_discover_device_t> found;
+   int maxDevices = INITIAL_DISCOVER_DEVICES;
+   int numOfDevices;
+   while(true) {
+      found.assign(maxDevices, hdhomerun_discover_device_t());
+      numOfDevices = hdhomerun_discover_find_devices_custom_v2(0, HDHOMERUN_DEVICE_TYPE_TUNER, HDHOMERUN_DEVICE_ID_WILDCARD, &found[0], maxDevices);
+      if(numOfDevices < maxDevices) {
+         break;
+      }
+      maxDevices *= 2;
+   }
+
+   if(numOfDevices < 0) {
+      ERR() << "Broadcast discovery failed" << endl;
+      return false;
+   }
+
+   m_discovered = true;
+
+   LOG() << "Num of devices = " << numOfDevices << endl;
+
+   for(int i = 0; i < numOfDevices; ++i) {
+      HdhomerunDevice device;
+      device.deviceId = found[i].device_id;
+      device.deviceIP = found[i].ip_addr;
+#ifdef HAVE_HDHOMERUN_TUNER_COUNT // Only newer hdhomerun's have tuner_count in struct hdhomerun_discover_device_t. First available in 20110317beta1.
+      // sanity check, just in case there's an older version of libhdhomerun installed
+      if (!hdhomerun_discover_validate_device_id(found[i].device_id) || found[i].tuner_count > 10) {
+         ERR() << "Device " << hex << found[i].device_id << dec << " reports invalid information. Is your libhdhomerun up-to-date?" << endl;
+         return false;
+      }
+      device.tunerCount = found[i].tuner_count;
+#else
+      device.tunerCount = DEFAULT_TUNER_COUNT;
+#endif
+      if(!InShard(device.deviceId)) {
+         LOG() << "Device " << hex << device.deviceId << dec << " is not in shard_devices, skipping it" << endl;
+         continue;
+      }
+
+      LOG() << "Device " << hex << device.deviceId << dec
+            << " is type " << found[i].device_type
+            << " and has " << device.tunerCount << " tuners" << endl;
+
+      _devices.push_back(device);
+   }
+
+   return true;
+}
+
+bool DeviceDiscovery::LoadCache(std::vector<HdhomerunDevice>& _devices)
+{
+   ifstream cache(m_cacheFile.c_str());
+   if(!cache) {
+      return false;
+   }
+
+   // <device id> <ip address> <number of tuners>
+   string line;
+   while(getline(cache, line)) {
+      istringstream str(line);
+      string ip;
+      HdhomerunDevice device;
+      struct in_addr addr;
+      if(str >> hex >> device.deviceId >> ip >> dec >> device.tunerCount &&
+         inet_aton(ip.c_str(), &addr) && device.tunerCount > 0) {
+         device.deviceIP = ntohl(addr.s_addr);
+         _devices.push_back(device);
+      }
+   }
+
+   LOG() << "Read " << _devices.size() << " devices from " << m_cacheFile << endl;
+   return true;
+}
+
+bool DeviceDiscovery::SaveCache(const std::vector<HdhomerunDevice>& _devices)
+{
+   // Write to a temporary file and rename, so a crash never leaves
+   // half a cache behind.
+   string dir = m_cacheFile.substr(0, m_cacheFile.rfind('/'));
+   if(!dir.empty()) {
+      mkdir(dir.c_str(), 0755);
+   }
+
+   // Several userhdhomerun's may share the cache directory.
+   ostringstream tmpName;
+   tmpName << m_cacheFile << ".tmp." << getpid();
+   string tmpFile = tmpName.str();
+   ofstream cache(tmpFile.c_str(), ios::out | ios::trunc);
+   if(!cache) {
+      ERR() << "Couldn't write discovery cache: " << tmpFile << endl;
+      return false;
+   }
+
+   vector<HdhomerunDevice>::const_iterator it;
+   for(it = _devices.begin(); it != _devices.end(); ++it) {
+      cache << hex << uppercase << setw(8) << setfill('0') << it->deviceId << " "
+            << IPToString(it->deviceIP) << " " << dec << it->tunerCount << endl;
+   }
+   cache.close();
+
+   if(cache.fail() || rename(tmpFile.c_str(), m_cacheFile.c_str()) != 0) {
+      ERR() << "Couldn't write discovery cache: " << m_cacheFile << endl;
+      unlink(tmpFile.c_str());
+      return false;
+   }
+
+   return true;
+}
+
+bool DeviceDiscovery::InShard(uint32_t _deviceId) const
+{
+   return m_shard.empty() || m_shard.count(_deviceId) > 0;
+}
+
+void DeviceDiscovery::run()
+{
+   // When startup went with the known devices they need confirming
+   // right away, otherwise they were just discovered.
+   bool wait = m_discovered;
+
+   while(!isStopping()) {
+      if(wait && (m_interval <= 0 || !Sleep(m_interval))) {
+         break;
+      }
+      wait = true;
+
+      Rediscover();
+   }
+}
+
+void DeviceDiscovery::Rediscover()
+{
+   // A failed broadcast says nothing about the devices, keep them as
+   // they are until the next round.
+   vector<HdhomerunDevice> found;
+   if(!Discover(found)) {
+      return;
+   }
+
+   vector<HdhomerunDevice>::iterator it;
+   for(it = found.begin(); it != found.end(); ++it) {
+      HdhomerunDevice* known = FindDevice(m_known, it->deviceId);
+      if(!known) {
+         LOG() << "Background discovery found new device " << hex << it->deviceId << dec
+               << " at " << IPToString(it->deviceIP) << endl;
+      }
+      else if(known->deviceIP != it->deviceIP && known->deviceIP != 0) {
+         LOG() << "Device " << hex << it->deviceId << dec << " moved from "
+               << IPToString(known->deviceIP) << " to " << IPToString(it->deviceIP) << endl;
+      }
+   }
+   for(it = m_known.begin(); it != m_known.end(); ++it) {
+      if(!FindDevice(found, it->deviceId)) {
+         LOG() << "Device " << hex << it->deviceId << dec << " was not found by background discovery" << endl;
+      }
+   }
+
+   // Keep the cache when the network is down or the broadcast is lost.
+   if(!found.empty()) {
+      SaveCache(found);
+   }
+   m_known = found;
+
+   // Devices the broadcast doesn't reach (configured ones on another
+   // subnet) are checked on directly by the controller.
+   if(m_controller) {
+      m_controller->UpdateDevices(found);
+   }
+}
+
+bool DeviceDiscovery::Sleep(int _seconds)
+{
+   return waitForStop(_seconds * 1000);
+}
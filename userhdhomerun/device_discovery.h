@@ -0,0 +1,96 @@
+/*
+ * device_discovery.h, finds the HDHomeRun devices to use
+ *
+ * Copyright (C) 2010 Villy Thomsen <tfylliv@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef _device_discovery_h_
+#define _device_discovery_h_
+
+#include "thread_pthread.h"
+
+#include <stdint.h>
+
+#include <set>
+#include <string>
+#include <vector>
+
+class ConfIniFile;
+class HdhomerunController;
+
+struct HdhomerunDevice {
+   uint32_t deviceId;
+   uint32_t deviceIP;  // 0 lets libhdhomerun look the device up by id
+   int tunerCount;
+};
+
+// Devices come from the [devices] section of /etc/dvbhdhomerun, from
+// the result of the last broadcast discovery saved in a cache file,
+// or from a broadcast discovery when we know of none. Once running,
+// a broadcast discovery is repeated every rediscovery_interval
+// seconds and the result handed to HdhomerunController.
+//
+// With shard_devices set only those devices are used, the others are
+// left to the userhdhomerun's started with their own conf file.
+class DeviceDiscovery : public ThreadPthread
+{
+public:
+   DeviceDiscovery(HdhomerunController* _controller, const ConfIniFile* _conf);
+
+   // Configured and cached devices, without touching the network.
+   void GetKnownDevices(std::vector<HdhomerunDevice>& _devices);
+
+   // Broadcast discovery, no limit on the number of devices. Returns
+   // false if the broadcast failed or a device reported invalid
+   // information, _devices is then not to be trusted.
+   bool Discover(std::vector<HdhomerunDevice>& _devices);
+
+   bool SaveCache(const std::vector<HdhomerunDevice>& _devices);
+
+   void run();
+
+private:
+   bool LoadCache(std::vector<HdhomerunDevice>& _devices);
+   bool InShard(uint32_t _deviceId) const;
+   void Rediscover();
+
+   // Returns false if we were stopped while sleeping.
+   bool Sleep(int _seconds);
+
+private:
+   HdhomerunController* m_controller;
+
+   std::string m_cacheFile;
+
+   // Seconds between broadcasts, 0 to only confirm the known devices.
+   int m_interval;
+
+   // Set once a broadcast discovery has been done
+   bool m_discovered;
+
+   // From the [devices] section
+   std::vector<HdhomerunDevice> m_configured;
+
+   // Devices this userhdhomerun handles, empty for all of them
+   std::set<uint32_t> m_shard;
+
+   // What GetKnownDevices returned, then what the last discovery found
+   std::vector<HdhomerunDevice> m_known;
+};
+
+#endif // _device_discovery_h_
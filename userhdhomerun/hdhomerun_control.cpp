@@ -27,33 +27,120 @@
 
 #include "../kernel/dvb_hdhomerun_control_messages.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
 #include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <iostream>
 #include <algorithm>
 
 using namespace std;
 
-Control::Control(HdhomerunController* _hdhomerun) 
-: m_device_name("/dev/hdhomerun_control"), 
-  m_hdhomerun(_hdhomerun), m_fdIoctl(0), m_read(0)
+// Messages read from the kernel in one go
+static const int READ_BATCH = 64;
+
+// Seconds between queue statistics in the log
+static const int STATS_INTERVAL = 300;
+
+// Seconds between the same complaint about a status request
+static const int STATUS_LOG_INTERVAL = 60;
+
+// Same clock as the kernel's timestamps in the messages
+static uint64_t MonotonicNs()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static uint64_t MonotonicUs()
+{
+  return MonotonicNs() / 1000;
+}
+
+const char* Control::GetMessageName(unsigned int _type)
 {
-  m_write.open(m_device_name.c_str(), ios::binary);
-  if(!m_write) {
+  static const char* names[DVB_HDHOMERUN_NUM_MESG_TYPES] = {
+    "read_status", "read_ber", "read_uncorrected_blocks", "set_frontend",
+    "read_signal_strength", "start_feed", "stop_feed", "dmx_set_pes_filter",
+    "register_device"
+  };
+  return _type < DVB_HDHOMERUN_NUM_MESG_TYPES ? names[_type] : "unknown";
+}
+
+const char* Control::GetStageName(int _stage)
+{
+  static const char* names[Control::NUM_STAGES] = { "fifo", "daemon", "total" };
+  return names[_stage];
+}
+
+static Control::MessageClass GetMessageClass(unsigned int _type)
+{
+  switch(_type) {
+  case DVB_HDHOMERUN_FE_READ_STATUS:
+  case DVB_HDHOMERUN_FE_READ_SIGNAL_STRENGTH:
+  case DVB_HDHOMERUN_FE_READ_BER:
+  case DVB_HDHOMERUN_FE_READ_UNCORRECTED_BLOCKS:
+    return Control::CLASS_STATUS;
+  default:
+    return Control::CLASS_CONTROL;
+  }
+}
+
+const char* Control::GetClassName(int _class)
+{
+  return _class == Control::CLASS_CONTROL ? "control" : "status";
+}
+
+// Nobody waits for the answer any more, the kernel drops replies to
+// expired requests. Only reads are skipped, a tune or feed change
+// still has to happen.
+static bool IsExpired(const struct dvbhdhomerun_control_mesg& _mesg, uint64_t _received, uint64_t _now)
+{
+  if(_mesg.timeout == 0 || (_mesg.flags & DVB_HDHOMERUN_MESG_NO_REPLY)) {
+    return false;
+  }
+  if(GetMessageClass(_mesg.type) != Control::CLASS_STATUS) {
+    return false;
+  }
+  return _now - _received > (uint64_t)_mesg.timeout * 1000;
+}
+
+Control::Control(HdhomerunController* _hdhomerun, bool _standby) 
+: m_fd(-1), m_standby(_standby), m_lastStatsLog(MonotonicUs()),
+  m_device_name("/dev/hdhomerun_control"), m_hdhomerun(_hdhomerun)
+{
+  memset(m_stats, 0, sizeof(m_stats));
+  pthread_mutex_init(&m_mutexStats, NULL);
+
+  // The kernel sends the requests for a tuner to the open file that
+  // registered it, so requests, replies and registration all go
+  // through this one descriptor.
+  m_fd = open(m_device_name.c_str(), O_RDWR);
+  if(m_fd < 0) {
      ERR() << "Couldn't open: " << m_device_name << endl;
+    logFile.Flush();
     _exit(-1);
   }
+  // Read everything there is, then pick what goes first.
+  fcntl(m_fd, F_SETFL, fcntl(m_fd, F_GETFL) | O_NONBLOCK);
 
   if (pipe(pfd) == -1) {
      ERR() << "Could not create a pipe" << endl;
+     logFile.Flush();
      _exit(-1);
   }
 }
 
 Control::~Control()
 {
-  m_write.close();
+  close(m_fd);
   close(pfd[0]);
+  pthread_mutex_destroy(&m_mutexStats);
 }
 
 void Control::run()
@@ -61,77 +148,274 @@ void Control::run()
 	fd_set fds;
 	int highfd, r;
 	char buf[8];
-
-	m_read = open(m_device_name.c_str(), O_RDONLY);
-	if (m_read < 0) {
-		ERR() << "Couldn't open: " << m_device_name << endl;
-		_exit(-1);
-	}
+	struct timeval timeout;
 
 	while (1) {
-		struct dvbhdhomerun_control_mesg mesg;
 		FD_ZERO(&fds);
 		FD_SET(pfd[0], &fds);
-		FD_SET(m_read, &fds);
-		highfd = std::max(pfd[0], m_read);
+		FD_SET(m_fd, &fds);
+		highfd = std::max(pfd[0], m_fd);
 
-		r = select(highfd + 1, &fds, NULL, NULL, NULL);
+		// Just look for new messages while there is work queued.
+		timeout.tv_sec = HasMessages() ? 0 : STATS_INTERVAL;
+		timeout.tv_usec = 0;
+
+		r = select(highfd + 1, &fds, NULL, NULL, &timeout);
 
 		if (r == -1 && errno == EINTR)
 			continue;
 
 		if (r == -1) {
 			ERR() << "select() failure" << endl;
+			logFile.Flush();
 			_exit(-1);
 		}
 
-		if (FD_ISSET(pfd[0], &fds)) {
+		if (r > 0 && FD_ISSET(pfd[0], &fds)) {
 			if ( read(pfd[0], buf, sizeof(buf)) == 0) { /* it ain't gonna be anything else... */
 				break;
 			}
 		}
 
-		if (FD_ISSET(m_read, &fds)) {
-			r = read(m_read, (char*)&mesg, sizeof(dvbhdhomerun_control_mesg));
-			if ( r <= 0 ) {
-				ERR() << "read failure - errno: " << r <<  endl;
-				_exit(-1);
-			} else {
-				m_messages.push(mesg);
-			}
+		if (r > 0 && FD_ISSET(m_fd, &fds)) {
+			ReadMessages();
 		}
 
-		if(!m_messages.empty())
-			this->ProcessMessages();
+		// One at a time, a tune arriving meanwhile goes first.
+		if(HasMessages())
+			this->ProcessNextMessage();
 
+		uint64_t now = MonotonicUs();
+		if(now - m_lastStatsLog >= (uint64_t)STATS_INTERVAL * 1000000) {
+			m_lastStatsLog = now;
+			LogStats();
+		}
 	}
+}
+
+void Control::ReadMessages()
+{
+  struct dvbhdhomerun_control_mesg mesgs[READ_BATCH];
+
+  while(true) {
+    ssize_t r = read(m_fd, (char*)mesgs, sizeof(mesgs));
+    if(r < 0 && (errno == EAGAIN || errno == EINTR)) {
+      return;
+    }
+    if(r <= 0) {
+      ERR() << "read failure - errno: " << errno << endl;
+      logFile.Flush();
+      _exit(-1);
+    }
+
+    // The kernel only queues whole messages.
+    if(r % sizeof(dvbhdhomerun_control_mesg) != 0) {
+      ERR() << "Partial message from device driver, " << r << " bytes" << endl;
+    }
+
+    uint64_t now = MonotonicNs();
+    int count = r / sizeof(dvbhdhomerun_control_mesg);
+    for(int i = 0; i < count; ++i) {
+      mesgs[i].ts_picked = now;
+      Enqueue(mesgs[i], now / 1000);
+    }
+
+    if(count < READ_BATCH) {
+      return;
+    }
+  }
+}
+
+void Control::Enqueue(const struct dvbhdhomerun_control_mesg& _mesg, uint64_t _now)
+{
+  MessageClass messageClass = GetMessageClass(_mesg.type);
+  ClassQueue& queue = m_queues[messageClass];
+  std::deque<QueuedMessage>& tunerQueue = queue.tuners[_mesg.id];
+
+  // A read already waiting for the same tuner answers this one too.
+  if(messageClass == CLASS_STATUS && !(_mesg.flags & DVB_HDHOMERUN_MESG_NO_REPLY)) {
+    std::deque<QueuedMessage>::iterator it;
+    for(it = tunerQueue.begin(); it != tunerQueue.end(); ++it) {
+      if(it->mesg.type == _mesg.type) {
+        it->duplicates.push_back(_mesg);
+        it->duplicatesReceived.push_back(_now);
+        MutexLocker lock(&m_mutexStats);
+        m_stats[messageClass].merged++;
+        return;
+      }
+    }
+  }
+
+  if(tunerQueue.empty()) {
+    queue.ready.push_back(_mesg.id);
+  }
+
+  {
+    MutexLocker lock(&m_mutexStats);
+    m_stats[messageClass].depth++;
+  }
 
-	close(m_read);
+  QueuedMessage queued;
+  queued.mesg = _mesg;
+  queued.received = _now;
+  tunerQueue.push_back(queued);
 }
 
+bool Control::HasMessages() const
+{
+  for(int i = 0; i < NUM_CLASSES; ++i) {
+    if(!m_queues[i].ready.empty()) {
+      return true;
+    }
+  }
+  return false;
+}
 
-void Control::WriteToDevice(const struct dvbhdhomerun_control_mesg& _mesg)
+void Control::ProcessNextMessage()
 {
-  m_write.write( (char*)&_mesg, sizeof(dvbhdhomerun_control_mesg));
-  if(m_write.fail() && !m_write.eof()) {
-    ERR() << "Error FAIL writing data to " << m_device_name << endl;
+  int messageClass = 0;
+  while(messageClass < NUM_CLASSES && m_queues[messageClass].ready.empty()) {
+    ++messageClass;
   }
-  if(m_write.bad()) {
-    ERR() << "Error BAD writing data to " << m_device_name << endl;
+  if(messageClass == NUM_CLASSES) {
+    return;
+  }
+
+  // Take the first message of the tuner whose turn it is, and put the
+  // tuner at the back of the line if it has more.
+  ClassQueue& queue = m_queues[messageClass];
+  int id = queue.ready.front();
+  queue.ready.pop_front();
+
+  std::deque<QueuedMessage>& tunerQueue = queue.tuners[id];
+  QueuedMessage queued = tunerQueue.front();
+  tunerQueue.pop_front();
+  if(tunerQueue.empty()) {
+    queue.tuners.erase(id);
+  }
+  else {
+    queue.ready.push_back(id);
+  }
+
+  uint64_t now = MonotonicUs();
+  uint64_t wait = now - queued.received;
+  {
+    MutexLocker lock(&m_mutexStats);
+    QueueStats& stats = m_stats[messageClass];
+    stats.depth--;
+    stats.messages++;
+    stats.totalWait += wait;
+    if(wait > stats.maxWait) {
+      stats.maxWait = wait;
+    }
+  }
+
+  // Every request has its own deadline, a duplicate may still be
+  // waited for when the first one expired. The first live one is
+  // handled and answers the others.
+  std::vector<dvbhdhomerun_control_mesg> live;
+  if(!SkipExpired(messageClass, queued.mesg, queued.received, now)) {
+    live.push_back(queued.mesg);
+  }
+  for(size_t i = 0; i < queued.duplicates.size(); ++i) {
+    if(!SkipExpired(messageClass, queued.duplicates[i], queued.duplicatesReceived[i], now)) {
+      live.push_back(queued.duplicates[i]);
+    }
+  }
+  if(live.empty()) {
+    return;
+  }
+
+  HandleMessage(live[0]);
+
+  std::vector<dvbhdhomerun_control_mesg>::iterator it;
+  for(it = live.begin() + 1; it != live.end(); ++it) {
+    it->u = live[0].u;
+    this->WriteToDevice(*it);
   }
-  
-  m_write.flush();
 }
 
+bool Control::SkipExpired(int _class, const struct dvbhdhomerun_control_mesg& _mesg, uint64_t _received, uint64_t _now)
+{
+  if(!IsExpired(_mesg, _received, _now)) {
+    return false;
+  }
 
-bool Control::Ioctl(int _numOfTuners, const std::string& _name, int& _id, int _type, bool _useFullName) 
+  LOG_EVERY(LogFile::LEVEL_INFO, STATUS_LOG_INTERVAL) << "Skipping expired request " << _mesg.seq << " type " << _mesg.type
+                                                      << " for tuner " << _mesg.id << endl;
+  MutexLocker lock(&m_mutexStats);
+  m_stats[_class].expired++;
+  return true;
+}
+
+Control::QueueStats Control::GetQueueStats(MessageClass _class)
 {
-  m_fdIoctl = open(m_device_name.c_str(), O_RDONLY);
-  if(!m_fdIoctl) {
-    ERR() << "Couldn't open: " << m_device_name << " for IOCTL" << endl;
-    _exit(-1);
+  MutexLocker lock(&m_mutexStats);
+  return m_stats[_class];
+}
+
+LatencyHistogram Control::GetLatency(unsigned int _type, LatencyStage _stage)
+{
+  MutexLocker lock(&m_mutexStats);
+  if(_type >= DVB_HDHOMERUN_NUM_MESG_TYPES) {
+    return LatencyHistogram();
+  }
+  return m_latency[_type][_stage];
+}
+
+void Control::LogStats()
+{
+  for(int i = 0; i < NUM_CLASSES; ++i) {
+    QueueStats stats = GetQueueStats((MessageClass)i);
+    if(stats.messages == 0) {
+      continue;
+    }
+    LOG() << "Control queue " << GetClassName(i) << ": " << stats.messages << " messages, "
+          << stats.merged << " merged, " << stats.expired << " expired, wait avg "
+          << stats.totalWait / stats.messages << " us max " << stats.maxWait << " us" << endl;
+  }
+
+  // Same format as /sys/kernel/debug/dvb_hdhomerun/latency
+  for(unsigned int type = 0; type < DVB_HDHOMERUN_NUM_MESG_TYPES; ++type) {
+    for(int stage = 0; stage < NUM_STAGES; ++stage) {
+      LatencyHistogram latency = GetLatency(type, (LatencyStage)stage);
+      if(latency.Count() > 0) {
+        LOG() << "Latency " << GetMessageName(type) << " " << GetStageName(stage) << ": "
+              << latency.ToString() << endl;
+      }
+    }
   }
+}
 
+
+void Control::WriteToDevice(const struct dvbhdhomerun_control_mesg& _mesg)
+{
+  struct dvbhdhomerun_control_mesg reply = _mesg;
+  reply.ts_handled = MonotonicNs();
+
+  if(reply.type < DVB_HDHOMERUN_NUM_MESG_TYPES) {
+    MutexLocker lock(&m_mutexStats);
+    LatencyHistogram* latency = m_latency[reply.type];
+    latency[STAGE_FIFO].AddNs(reply.ts_posted, reply.ts_picked);
+    latency[STAGE_DAEMON].AddNs(reply.ts_picked, reply.ts_handled);
+    latency[STAGE_TOTAL].AddNs(reply.ts_posted, reply.ts_handled);
+  }
+
+  // The kernel isn't waiting for this one (START_FEED/STOP_FEED).
+  if(reply.flags & DVB_HDHOMERUN_MESG_NO_REPLY) {
+    return;
+  }
+
+  // One write per reply, the kernel wants whole messages.
+  ssize_t ret = write(m_fd, (const char*)&reply, sizeof(dvbhdhomerun_control_mesg));
+  if(ret != sizeof(dvbhdhomerun_control_mesg)) {
+    ERR() << "Error writing data to " << m_device_name << ": " << strerror(errno) << endl;
+  }
+}
+
+
+bool Control::Ioctl(int _numOfTuners, const std::string& _name, int& _id, int _type, bool _useFullName, bool& _standby) 
+{
   struct hdhomerun_register_tuner_data tuner_data;
   memset(&tuner_data, 0, sizeof(tuner_data)); // Just to get around valgrind warning.
   tuner_data.num_of_devices = _numOfTuners;
@@ -139,59 +423,62 @@ bool Control::Ioctl(int _numOfTuners, const std::string& _name, int& _id, int _t
   tuner_data.name[ sizeof(tuner_data.name) - 1 ] = '\0';
   tuner_data.type = _type;
   tuner_data.use_full_name = _useFullName;
-  int ret = ioctl(m_fdIoctl, HDHOMERUN_REGISTER_TUNER, &tuner_data);
+  tuner_data.standby = m_standby;
+  int ret = ioctl(m_fd, HDHOMERUN_REGISTER_TUNER, &tuner_data);
+  if(ret != 0 && errno == EBUSY) {
+    ERR() << "Tuner " << tuner_data.name << " is used by another userhdhomerun, skipping it." << endl;
+    return false;
+  }
+  if(ret != 0 && errno == ENOSPC) {
+    ERR() << "No room for tuner " << tuner_data.name << " in the kernel module, raise its max_devices parameter." << endl;
+    return false;
+  }
   if(ret != 0) {
     ERR() << "Couldn't create tuner! ioctl failed. This means the kernel module is either not loaded or has malfunctioned. Check dmesg." << endl;
     return false;
   }
   else {
-    LOG() << "Registered tuner, id from kernel: " << tuner_data.id << " name: " << tuner_data.name << endl;
+    LOG() << "Registered tuner, id from kernel: " << tuner_data.id << " name: " << tuner_data.name
+          << (tuner_data.standby ? " (standby)" : "") << endl;
   }  
   _id = tuner_data.id;
+  _standby = tuner_data.standby;
 
   return true;
 }
 
 
-void Control::ProcessMessages()
+void Control::HandleMessage(struct dvbhdhomerun_control_mesg& _mesg)
 {
-  //LOG() << "Processing " << m_messages.size() << " messages." << endl;
-
-  while(!m_messages.empty()) {
-    struct dvbhdhomerun_control_mesg mesg = m_messages.front();
-
-    switch (mesg.type) {
-    case DVB_HDHOMERUN_FE_SET_FRONTEND: {
-      FE_SET_Frontend(mesg);
-      break;
-    }
-
-    case DVB_HDHOMERUN_FE_READ_STATUS: {
-      FE_READ_Status(mesg);
-      break;
-    }
+  switch (_mesg.type) {
+  case DVB_HDHOMERUN_FE_SET_FRONTEND: {
+    FE_SET_Frontend(_mesg);
+    break;
+  }
 
-    case DVB_HDHOMERUN_FE_READ_SIGNAL_STRENGTH: {
-      FE_READ_SIGNAL_Strength(mesg);
-      break;
-    }
+  case DVB_HDHOMERUN_FE_READ_STATUS: {
+    FE_READ_Status(_mesg);
+    break;
+  }
 
-    case DVB_HDHOMERUN_START_FEED: {
-      StartFeed(mesg);
-      break;
-    }
+  case DVB_HDHOMERUN_FE_READ_SIGNAL_STRENGTH: {
+    FE_READ_SIGNAL_Strength(_mesg);
+    break;
+  }
 
-    case DVB_HDHOMERUN_STOP_FEED: {
-      StopFeed(mesg);
-      break;
-    }
+  case DVB_HDHOMERUN_START_FEED: {
+    StartFeed(_mesg);
+    break;
+  }
 
-    default:
-      ERR() << "Unknown message from device driver! " << mesg.type << endl;
-      break;
-    }
+  case DVB_HDHOMERUN_STOP_FEED: {
+    StopFeed(_mesg);
+    break;
+  }
 
-    m_messages.pop();
+  default:
+    ERR() << "Unknown message from device driver! " << _mesg.type << endl;
+    break;
   }
 }
 
@@ -200,22 +487,27 @@ void Control::FE_SET_Frontend(const struct dvbhdhomerun_control_mesg& _mesg)
   printf("FE_SET_FRONTEND, freq: %d\n",
          _mesg.u.frequency);
   
+  struct dvbhdhomerun_control_mesg reply = _mesg;
+
   // Need to send stuff to HDHOMERUN
   HdhomerunTuner* tuner = m_hdhomerun->GetTuner(_mesg.id);
   if(tuner) {
-     int ret = tuner->Tune(_mesg.u.frequency);
+     // Streaming over HTTP at another frequency
+     if(tuner->Tune(_mesg.u.frequency, HdhomerunTuner::USER_DVB) == HdhomerunTuner::TUNE_BUSY) {
+        reply.flags |= DVB_HDHOMERUN_MESG_BUSY;
+     }
   }
   else {
      ERR() << "Tuner id does not exist!" << _mesg.id << endl;
   }
 
-  this->WriteToDevice(_mesg);
+  this->WriteToDevice(reply);
 }
 
 
 void Control::FE_READ_Status(struct dvbhdhomerun_control_mesg& _mesg)
 {
-  LOG() << "FE_READ_STATUS" << endl;
+  DBG() << "FE_READ_STATUS" << endl;
 
   HdhomerunTuner* tuner = m_hdhomerun->GetTuner(_mesg.id);
   if(tuner) {
@@ -224,7 +516,7 @@ void Control::FE_READ_Status(struct dvbhdhomerun_control_mesg& _mesg)
      _mesg.u.frontend_status = status;
   }
   else {
-     ERR() << "Tuner id does not exist!" << _mesg.id << endl;
+     LOG_EVERY(LogFile::LEVEL_ERROR, STATUS_LOG_INTERVAL) << "Tuner id does not exist!" << _mesg.id << endl;
   }
   
   this->WriteToDevice(_mesg);
@@ -232,7 +524,7 @@ void Control::FE_READ_Status(struct dvbhdhomerun_control_mesg& _mesg)
 
 void Control::FE_READ_SIGNAL_Strength(struct dvbhdhomerun_control_mesg& _mesg)
 {
-  LOG() << "FE_READ_SIGNAL_STRENGTH" << endl;
+  DBG() << "FE_READ_SIGNAL_STRENGTH" << endl;
 
   HdhomerunTuner* tuner = m_hdhomerun->GetTuner(_mesg.id);
   if(tuner) {
@@ -241,7 +533,7 @@ void Control::FE_READ_SIGNAL_Strength(struct dvbhdhomerun_control_mesg& _mesg)
      _mesg.u.signal_strength = strength;
   }
   else {
-     ERR() << "Tuner id does not exist!" << _mesg.id << endl;
+     LOG_EVERY(LogFile::LEVEL_ERROR, STATUS_LOG_INTERVAL) << "Tuner id does not exist!" << _mesg.id << endl;
   }
 
   this->WriteToDevice(_mesg);
@@ -280,7 +572,7 @@ void Control::StartFeed(const struct dvbhdhomerun_control_mesg& _mesg)
 
   HdhomerunTuner* tuner = m_hdhomerun->GetTuner(_mesg.id);
   if(tuner) {
-     tuner->StartStreaming(feed.pid);
+     tuner->StartStreaming(feed.pid, HdhomerunTuner::USER_DVB);
   }
   else {
      ERR() << "Tuner id does not exist!" << _mesg.id << endl;
@@ -297,7 +589,7 @@ void Control::StopFeed(const struct dvbhdhomerun_control_mesg& _mesg)
 
   HdhomerunTuner* tuner = m_hdhomerun->GetTuner(_mesg.id);
   if(tuner) {
-     tuner->StopStreaming(feed.pid);
+     tuner->StopStreaming(feed.pid, HdhomerunTuner::USER_DVB);
   }
   else {
      ERR() << "Tuner id does not exist!" << _mesg.id << endl;
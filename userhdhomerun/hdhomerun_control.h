@@ -22,26 +22,96 @@
 #ifndef _hdhomerun_control_h_
 #define _hdhomerun_control_h_
 
+#include "latency_histogram.h"
 #include "thread_pthread.h"
 
-#include <fstream>
-#include <queue>
+#include "../kernel/dvb_hdhomerun_control_messages.h"
+
+#include <stdint.h>
+
+#include <deque>
+#include <map>
 #include <string>
+#include <vector>
 
 class HdhomerunController;
 
+// Requests from the kernel are queued per class and per tuner. Tune
+// and feed changes go before status reads, the tuners take turns
+// within a class, and the messages for one tuner keep their order
+// within a class.
 class Control : public ThreadPthread
 {
  public:
-  Control(HdhomerunController* _hdhomerun);
+  enum MessageClass {
+    CLASS_CONTROL = 0, // FE_SET_FRONTEND, START_FEED, STOP_FEED
+    CLASS_STATUS,      // FE_READ_STATUS, FE_READ_SIGNAL_STRENGTH
+    NUM_CLASSES
+  };
+
+  // Stages of a request's latency seen from here: kernel post to
+  // read by us, read to reply written, and both.
+  enum LatencyStage {
+    STAGE_FIFO = 0,
+    STAGE_DAEMON,
+    STAGE_TOTAL,
+    NUM_STAGES
+  };
+
+  struct QueueStats {
+    // Queued right now
+    unsigned long depth;
+    unsigned long messages;
+    // Status reads answered together with an earlier one
+    unsigned long merged;
+    unsigned long expired;
+    // Time from read from the kernel to handled, in us
+    uint64_t totalWait;
+    uint64_t maxWait;
+  };
+
+  Control(HdhomerunController* _hdhomerun, bool _standby);
   ~Control();
   
   void run();
   void pre_stop();
-   bool Ioctl(int _numOfTuners, const std::string& _name, int& _id, int type, bool _useFullName);
+   // _standby is set when another userhdhomerun has the tuner for now
+   bool Ioctl(int _numOfTuners, const std::string& _name, int& _id, int type, bool _useFullName, bool& _standby);
+
+  QueueStats GetQueueStats(MessageClass _class);
+  LatencyHistogram GetLatency(unsigned int _type, LatencyStage _stage);
+
+  // Queue statistics and latency histograms to the log
+  void LogStats();
+
+  static const char* GetClassName(int _class);
+  static const char* GetMessageName(unsigned int _type);
+  static const char* GetStageName(int _stage);
 
  private:
-  void ProcessMessages();
+  struct QueuedMessage {
+    dvbhdhomerun_control_mesg mesg;
+    // Monotonic us when read from the kernel
+    uint64_t received;
+    // Same read for the same tuner, answered by the one fetch
+    std::vector<dvbhdhomerun_control_mesg> duplicates;
+    // When each of them was read, they expire on their own
+    std::vector<uint64_t> duplicatesReceived;
+  };
+
+  struct ClassQueue {
+    std::map<int, std::deque<QueuedMessage> > tuners;
+    // Tuners with messages queued, in turn
+    std::deque<int> ready;
+  };
+
+  void ReadMessages();
+  void Enqueue(const struct dvbhdhomerun_control_mesg& _mesg, uint64_t _now);
+  bool HasMessages() const;
+  void ProcessNextMessage();
+  // Counts and logs an expired request
+  bool SkipExpired(int _class, const struct dvbhdhomerun_control_mesg& _mesg, uint64_t _received, uint64_t _now);
+  void HandleMessage(struct dvbhdhomerun_control_mesg& _mesg);
 
   // Forwarded IOCTL's from the device driver.
   void FE_SET_Frontend(const struct dvbhdhomerun_control_mesg& _mesg);
@@ -58,12 +128,18 @@ class Control : public ThreadPthread
   void WriteToDevice(const struct dvbhdhomerun_control_mesg& mesg);
 
  private:
-  std::ofstream m_write;
-  int m_read;
+  // Our connection to the kernel, owns the tuners we register
+  int m_fd;
+  // Register tuners as standby for the ones in use
+  bool m_standby;
   int pfd[2];
-  int m_fdIoctl;
 
-  std::queue<dvbhdhomerun_control_mesg> m_messages;
+  ClassQueue m_queues[NUM_CLASSES];
+
+  QueueStats m_stats[NUM_CLASSES];
+  LatencyHistogram m_latency[DVB_HDHOMERUN_NUM_MESG_TYPES][NUM_STAGES];
+  pthread_mutex_t m_mutexStats;
+  uint64_t m_lastStatsLog;
 
   std::string m_device_name;
 
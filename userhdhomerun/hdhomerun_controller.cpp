@@ -22,31 +22,46 @@
 #include "hdhomerun_controller.h"
 
 #include "conf_inifile.h"
-#include "config.h"
+#include "device_discovery.h"
 #include "hdhomerun_control.h"
 #include "hdhomerun_tuner.h"
+#include "http_streamer.h"
 #include "log_file.h"
+#include "metrics_server.h"
+#include "thread_pthread.h"
+#include "tuner_init_pool.h"
 
 #include <algorithm>
+#include <cstdlib>
 #include <iostream>
 #include <sstream>
 
 using namespace std;
 
-HdhomerunController::HdhomerunController(int _maxDevices) 
-   : m_maxDevices(_maxDevices), m_dbg(0)
+// Tuners are set up by this many threads at the same time, each
+// getting this many seconds before we give up on it.
+static const int DEFAULT_INIT_THREADS = 4;
+static const int DEFAULT_INIT_TIMEOUT = 15;
+
+HdhomerunController::HdhomerunController(const std::string& _confFile, bool _standby) 
+   : m_initPool(0), m_discovery(0), m_metrics(0), m_http(0), m_haveConf(false), m_dbg(0)
 {
+   pthread_mutex_init(&m_mutexTuners, NULL);
+
+   int initThreads = DEFAULT_INIT_THREADS;
+   int initTimeout = DEFAULT_INIT_TIMEOUT;
+
    //
    // Enable libhdhomerun debugging based on conf file
    //
-   ConfIniFile conf;
+   if(m_conf.OpenIniFile(_confFile)) {
+      m_haveConf = true;
 
-   if(conf.OpenIniFile("/etc/dvbhdhomerun")) {
       string libhdhomerunDebugEnable;
-      if(conf.GetSecValue("libhdhomerun", "enable", libhdhomerunDebugEnable)) {
+      if(m_conf.GetSecValue("libhdhomerun", "enable", libhdhomerunDebugEnable)) {
          if (libhdhomerunDebugEnable == "true") {
 	    string libhdhomerunLogFile("/var/log/dvbhdhomerun_libhdhomerun.log");
-	    if(conf.GetSecValue("libhdhomerun", "logfile", libhdhomerunLogFile)) {
+	    if(m_conf.GetSecValue("libhdhomerun", "logfile", libhdhomerunLogFile)) {
 	       LOG() << "Custom log location for libhdhomerun: " << libhdhomerunLogFile << endl;
 	    }
 
@@ -58,97 +73,124 @@ HdhomerunController::HdhomerunController(int _maxDevices)
 	    hdhomerun_debug_printf(m_dbg, "Debug enabled\n");
          } 
       }
+
+      string value;
+      if(m_conf.GetSecValue("userhdhomerun", "log_level", value) && !logFile.SetLevel(value)) {
+         ERR() << "Invalid log_level: " << value << endl;
+      }
+      if(m_conf.GetSecValue("userhdhomerun", "init_threads", value) && atoi(value.c_str()) > 0) {
+         initThreads = atoi(value.c_str());
+      }
+      if(m_conf.GetSecValue("userhdhomerun", "init_timeout", value) && atoi(value.c_str()) > 0) {
+         initTimeout = atoi(value.c_str());
+      }
    }
 
   //
-  // Discover HDHomeRun's 
+  // Find HDHomeRun's. Use the configured and cached devices when we
+  // have them and let a broadcast discovery confirm them in the
+  // background (see UpdateDevices), otherwise wait for the broadcast.
   //
-  struct hdhomerun_discover_device_t devices[m_maxDevices];
-  
-  // 'devices' is alloc'd on stack, so zero it as a precaution.
-  // hdhomerun_discover_device_t has grown in size across versions of libhdhomerun
-  // and I don't see a way to programmatically check libhdhomerun's API version.
-  // ...really fragile API design...
-  memset(devices, 0, sizeof(devices));
+  m_discovery = new DeviceDiscovery(this, m_haveConf ? &m_conf : NULL);
 
-  int numOfDevices = hdhomerun_discover_find_devices_custom_v2(0, HDHOMERUN_DEVICE_TYPE_TUNER, HDHOMERUN_DEVICE_ID_WILDCARD, devices, m_maxDevices);
-  LOG() << "Num of devices = " << numOfDevices << endl;
+  vector<HdhomerunDevice> devices;
+  m_discovery->GetKnownDevices(devices);
+  if(devices.empty()) {
+    if(!m_discovery->Discover(devices)) {
+      logFile.Flush();
+      _exit(-1);
+    }
+    if(!devices.empty()) {
+      m_discovery->SaveCache(devices);
+    }
+  }
 
-  if(numOfDevices == 0) {
+  if(devices.empty()) {
     ERR() << "No HDHomeRun devices found! Exiting" << endl;
+    logFile.Flush();
     _exit(-1);
   }
 
-  
   //
   // Create an object for each tuner to handle data streaming/filtering/etc.
   //
-#ifdef HAVE_HDHOMERUN_TUNER_COUNT // Only newer hdhomerun's have tuner_count in struct hdhomerun_discover_device_t. First available in 20110317beta1.
-  for (int i = 0; i < numOfDevices; ++i) {
-     // sanity check, just in case there's an older version of libhdhomerun installed
-     if (hdhomerun_discover_validate_device_id(devices[i].device_id) && devices[i].tuner_count <= 10) {
-        LOG() << endl << "Device " << hex << devices[i].device_id
-              << " is type " << devices[i].device_type
-              << " and has " << (unsigned int)devices[i].tuner_count << " tuners" << endl;
-
-        for (int j = 0; j < devices[i].tuner_count; ++j) {
-           HdhomerunTuner* tuner = new HdhomerunTuner(devices[i].device_id, devices[i].ip_addr, j, m_dbg);
-           if(tuner->IsDisabled()) {
-              delete tuner;
-           }
-           else {
-              m_tuners.push_back(tuner);
-           }
-        }
-     } 
-     else {
-        ERR() << "Device " << hex << devices[i].device_id << " reports invalid information. Is your libhdhomerun up-to-date?" << endl;
-        _exit(-1);
-     } 
-  }
-#else
-  const int MAX_TUNERS = 2; 
-  for(int i = 0; i < numOfDevices; ++i) {
-     for(int j = 0; j < MAX_TUNERS; ++j) {
-        HdhomerunTuner* tuner = new HdhomerunTuner(devices[i].device_id, devices[i].ip_addr, j, m_dbg);
-        if(tuner->IsDisabled()) {
-           delete tuner;
-        }
-        else {
-           m_tuners.push_back(tuner);
-        }
+  vector<TunerInitPool::TunerAddress> addresses;
+  vector<HdhomerunDevice>::iterator deviceIt;
+  for(deviceIt = devices.begin(); deviceIt != devices.end(); ++deviceIt) {
+     for(int j = 0; j < deviceIt->tunerCount; ++j) {
+        TunerInitPool::TunerAddress address = { deviceIt->deviceId, deviceIt->deviceIP, j };
+        addresses.push_back(address);
      }
   }
-#endif
+
+  m_initPool = new TunerInitPool(initThreads, initTimeout, m_haveConf ? &m_conf : NULL, m_dbg);
+
+  vector<HdhomerunTuner*> tuners;
+  m_initPool->CreateTuners(addresses, tuners);
   
   LOG() << endl;
 
   //
   // Create DVB devices 
   //
-  m_control = new Control(this);
+  m_control = new Control(this, _standby);
 
-  std::sort(m_tuners.begin(), m_tuners.end(), CompareHdhomerunTuner);
-  
-  vector<HdhomerunTuner*>::iterator it;
-  for(it = m_tuners.begin(); it != m_tuners.end(); ++it) {
-    int kernelId = 0;
+  if(m_haveConf) {
+    ThreadSched sched;
+    sched.Read(m_conf, "userhdhomerun", "control");
+    m_control->setSched(sched, "control");
 
-    if(m_control->Ioctl(m_tuners.size(), (*it)->GetName(), kernelId, (*it)->GetType(), (*it)->GetUseFullName() )) {
-      ostringstream stream;
-      stream << "/dev/hdhomerun_data" << kernelId;
-      (*it)->SetDataDeviceName(stream.str());
-      (*it)->SetKernelId(kernelId);
+    ThreadSched writerSched;
+    writerSched.Read(m_conf, "userhdhomerun", "writer");
+    pid_t writerTid = logFile.GetWriterTid();
+    if(writerSched.IsSet() && writerTid) {
+      writerSched.Apply(writerTid, "writer");
     }
   }
 
+  AddTuners(tuners);
+
   // Begin receiving request from the /dev/dvb/xx/yy devices.
   m_control->start();
+
+  // Keep looking for devices coming, going and changing address.
+  m_discovery->start();
+
+  m_metrics = new MetricsServer(this, m_haveConf ? &m_conf : NULL);
+  if(m_metrics->Listen()) {
+    m_metrics->start();
+  }
+  else {
+    delete m_metrics;
+    m_metrics = 0;
+  }
+
+  m_http = new HttpStreamer(this, m_haveConf ? &m_conf : NULL);
+  if(m_http->Listen()) {
+    m_http->start();
+  }
+  else {
+    delete m_http;
+    m_http = 0;
+  }
 }
  
 HdhomerunController::~HdhomerunController()
 {
-  // Need to stop threads!
+  // Need to stop threads! The HTTP clients first, they use the tuners.
+  if(m_http) {
+    m_http->stop();
+    delete m_http;
+  }
+
+  if(m_metrics) {
+    m_metrics->stop();
+    delete m_metrics;
+  }
+
+  m_discovery->stop();
+  delete m_discovery;
+
   m_control->stop();
   delete m_control;
 
@@ -160,22 +202,136 @@ HdhomerunController::~HdhomerunController()
     delete tuner;
   }
 
+  delete m_initPool;
+
+  pthread_mutex_destroy(&m_mutexTuners);
+
   hdhomerun_debug_close(m_dbg,1000);
   hdhomerun_debug_destroy(m_dbg);
 }
 
 
-HdhomerunTuner* HdhomerunController::GetTuner(int _id)
+void HdhomerunController::AddTuners(std::vector<HdhomerunTuner*>& _tuners)
 {
-  HdhomerunTuner* tuner = 0;
+  std::sort(_tuners.begin(), _tuners.end(), CompareHdhomerunTuner);
+  
+  vector<HdhomerunTuner*>::iterator it;
+  for(it = _tuners.begin(); it != _tuners.end(); ++it) {
+    if((*it)->IsDisabled()) {
+      MutexLocker lock(&m_mutexTuners);
+      m_knownTuners.insert(make_pair((*it)->GetDeviceId(), (*it)->GetTunerIndex()));
+      delete *it;
+      continue;
+    }
+
+    int kernelId = 0;
+    bool registered = false;
+    bool standby = false;
+
+    // Another userhdhomerun has it, or the kernel module failed. Either
+    // way rediscovery and the metrics must not touch it.
+    if(!m_control->Ioctl(_tuners.size(), (*it)->GetName(), kernelId, (*it)->GetType(), (*it)->GetUseFullName(), standby)) {
+      delete *it;
+      continue;
+    }
+
+    ostringstream stream;
+    stream << "/dev/hdhomerun_data" << kernelId;
+    (*it)->SetDataDeviceName(stream.str());
+    (*it)->SetKernelId(kernelId);
+    (*it)->SetStandby(standby);
+    registered = kernelId >= 0;
+
+    MutexLocker lock(&m_mutexTuners);
+    m_tuners.push_back(*it);
+    m_knownTuners.insert(make_pair((*it)->GetDeviceId(), (*it)->GetTunerIndex()));
+    if(registered) {
+      if(kernelId >= (int)m_tunersByKernelId.size()) {
+        m_tunersByKernelId.resize(kernelId + 1, NULL);
+      }
+      m_tunersByKernelId[kernelId] = *it;
+    }
+  }
+}
+
+void HdhomerunController::UpdateDevices(const std::vector<HdhomerunDevice>& _devices)
+{
+  // Tuners are never removed while we run, so the copy stays valid
+  // and the control thread isn't held up by the network calls below.
+  vector<HdhomerunTuner*> tuners;
+  set<pair<uint32_t, int> > knownTuners;
+  {
+    MutexLocker lock(&m_mutexTuners);
+    tuners = m_tuners;
+    knownTuners = m_knownTuners;
+  }
+
+  // New devices, and the tuners that timed out, failed or were taken
+  // by another userhdhomerun last time
+  vector<TunerInitPool::TunerAddress> addresses;
+  vector<HdhomerunDevice>::const_iterator deviceIt;
+  for(deviceIt = _devices.begin(); deviceIt != _devices.end(); ++deviceIt) {
+    for(int j = 0; j < deviceIt->tunerCount; ++j) {
+      if(knownTuners.count(make_pair(deviceIt->deviceId, j)) == 0) {
+        LOG() << "Setting up tuner " << j << " of device " << hex << deviceIt->deviceId << dec << endl;
+        TunerInitPool::TunerAddress address = { deviceIt->deviceId, deviceIt->deviceIP, j };
+        addresses.push_back(address);
+      }
+    }
+  }
 
   vector<HdhomerunTuner*>::iterator it;
-  for(it = m_tuners.begin(); it != m_tuners.end(); ++it) {
-    if((*it)->GetKernelId() == _id) {
-      tuner = (*it);
-      break;
+  for(it = tuners.begin(); it != tuners.end(); ++it) {
+    HdhomerunTuner* tuner = *it;
+
+    const HdhomerunDevice* device = NULL;
+    for(deviceIt = _devices.begin(); deviceIt != _devices.end(); ++deviceIt) {
+      if(deviceIt->deviceId == tuner->GetDeviceId()) {
+        device = &(*deviceIt);
+        break;
+      }
     }
+
+    if(device && device->deviceIP != tuner->GetDeviceIP()) {
+      tuner->SetDeviceIP(device->deviceIP);
+    }
+    else if(device) {
+      tuner->SetOnline();
+    }
+    else if(tuner->Probe()) {
+      // Not answering broadcasts (other subnet?) but still there.
+      tuner->SetOnline();
+    }
+    else {
+      tuner->SetOffline();
+    }
+  }
+
+  if(!addresses.empty()) {
+    vector<HdhomerunTuner*> newTuners;
+    m_initPool->CreateTuners(addresses, newTuners);
+    AddTuners(newTuners);
+  }
+}
+
+void HdhomerunController::LogStats()
+{
+  m_control->LogStats();
+}
+
+void HdhomerunController::GetTuners(std::vector<HdhomerunTuner*>& _tuners)
+{
+  MutexLocker lock(&m_mutexTuners);
+  _tuners = m_tuners;
+}
+
+HdhomerunTuner* HdhomerunController::GetTuner(int _id)
+{
+  MutexLocker lock(&m_mutexTuners);
+
+  if(_id < 0 || _id >= (int)m_tunersByKernelId.size()) {
+    return 0;
   }
 
-  return tuner;
+  return m_tunersByKernelId[_id];
 }
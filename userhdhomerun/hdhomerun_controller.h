@@ -22,28 +22,81 @@
 #ifndef _hdhomerun_controller_h_
 #define _hdhomerun_controller_h_
 
+#include "conf_inifile.h"
+#include "device_discovery.h"
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <set>
 #include <string>
+#include <utility>
 #include <vector>
 
 class HdhomerunTuner;
 class Control;
+class HttpStreamer;
+class MetricsServer;
+class TunerInitPool;
 struct hdhomerun_debug_t;
 
 class HdhomerunController
 {
  public:
-  HdhomerunController(int _maxDevices);
+  // With _standby the tuners another userhdhomerun has are taken
+  // over when it exits.
+  HdhomerunController(const std::string& _confFile, bool _standby);
   ~HdhomerunController();
 
   HdhomerunTuner* GetTuner(int id);
+
+  // Called by DeviceDiscovery with the devices currently on the
+  // network. Adds tuners for new devices, follows devices to a new
+  // address and takes tuners on devices that are gone offline.
+  void UpdateDevices(const std::vector<HdhomerunDevice>& _devices);
+
+  // Control queue and latency statistics to the log, on SIGUSR1
+  void LogStats();
+
+  // Tuners are never removed while we run, the pointers stay valid
+  void GetTuners(std::vector<HdhomerunTuner*>& _tuners);
+  Control* GetControl() {
+    return m_control;
+  }
+  // NULL unless http_port is set
+  HttpStreamer* GetHttpStreamer() {
+    return m_http;
+  }
   
+ private:
+  void AddTuners(std::vector<HdhomerunTuner*>& _tuners);
+
  private:
   std::vector<HdhomerunTuner*> m_tuners;
+  // Same tuners indexed by their kernel id, NULL where there is none
+  std::vector<HdhomerunTuner*> m_tunersByKernelId;
+  pthread_mutex_t m_mutexTuners;
 
-  int m_maxDevices;
+  // Device id and tuner number of the tuners created or disabled,
+  // UpdateDevices() retries the others. Under m_mutexTuners.
+  std::set<std::pair<uint32_t, int> > m_knownTuners;
 
   Control* m_control;
 
+  TunerInitPool* m_initPool;
+
+  DeviceDiscovery* m_discovery;
+
+  // NULL unless metrics_port or metrics_socket is set
+  MetricsServer* m_metrics;
+
+  // NULL unless http_port is set
+  HttpStreamer* m_http;
+
+  // /etc/dvbhdhomerun (or -c), read once and shared by all tuners
+  ConfIniFile m_conf;
+  bool m_haveConf;
+
   struct hdhomerun_debug_t* m_dbg;
 };
 
@@ -22,33 +22,141 @@
 #include "hdhomerun_tuner.h"
 
 #include "conf_inifile.h"
+#include "config.h"
 #include "log_file.h"
 
 #include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <sstream>
+#include <vector>
 
 #include <linux/dvb/dmx.h>
 #include <linux/dvb/frontend.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
 
 using namespace std;
 
-HdhomerunTuner::HdhomerunTuner(int _device_id, int _device_ip, int _tuner, struct hdhomerun_debug_t* _dbg) 
-  : m_device(0), m_dbg(_dbg), m_stream(false), m_prevFreq(0),
+// Number of PID ranges we hand to the HDHomeRun before widening the
+// filter and doing the rest of the filtering ourselves.
+static const int DEFAULT_MAX_FILTER_RANGES = 16;
+
+// Status is polled all the time, log it this often at most
+static const int STATUS_LOG_INTERVAL = 60;
+
+// run() sleeps until about targetBytes have come in at the measured
+// mux bitrate, within the interval limits, and asks libhdhomerun for
+// twice that so a burst doesn't wait for the next round. With less
+// than a packet's worth of bitrate the shortest interval would do.
+struct RecvProfile {
+   const char* name;
+   uint32_t targetBytes;
+   int minIntervalMs;
+   int maxIntervalMs;
+};
+
+static const RecvProfile RECV_PROFILES[] = {
+   // An SD mux is passed on every 40 ms at the latest
+   { "latency", 32 * VIDEO_DATA_PACKET_SIZE, 5, 40 },
+   // About what the fixed 64 ms sleep did for a full mux
+   { "balanced", 128 * VIDEO_DATA_PACKET_SIZE, 20, 100 },
+   // Fewer and bigger writes to the data device
+   { "throughput", 512 * VIDEO_DATA_PACKET_SIZE, 100, 250 }
+};
+static const int NUM_RECV_PROFILES = sizeof(RECV_PROFILES) / sizeof(RECV_PROFILES[0]);
+static const int DEFAULT_RECV_PROFILE = 1;
+
+// stream_protocol=rtp: a gap in the sequence numbers is waited for
+// this many datagrams (~20 ms of a full mux) or ms
+static const int DEFAULT_RTP_WINDOW = 32;
+static const int DEFAULT_RTP_HOLD_MS = 20;
+
+// fanout: multicast stays on the local network, a /wait destination
+// holds up the ingest for at most this many ms per batch
+static const int DEFAULT_FANOUT_TTL = 1;
+static const int DEFAULT_FANOUT_WAIT_MS = 5;
+
+// http_port: the clients' ring. It has to hold what they have in
+// flight plus the biggest batch, VIDEO_DATA_BUFFER_SIZE_1S.
+static const size_t DEFAULT_HTTP_RING = 16 * 1024 * 1024;
+static const size_t MIN_HTTP_RING = 8 * 1024 * 1024;
+
+// The bitrate is measured over this many us
+static const uint64_t RECV_RATE_WINDOW = 250000;
+
+static int FindRecvProfile(const string& _name)
+{
+   for(int i = 0; i < NUM_RECV_PROFILES; ++i) {
+      if(_name == RECV_PROFILES[i].name) {
+         return i;
+      }
+   }
+   return -1;
+}
+
+// A key from [userhdhomerun], overridden by the tuner's own section
+static bool GetTunerValue(const ConfIniFile& _conf, const string& _tuner, const string& _key, string& _value)
+{
+   bool found = _conf.GetSecValue("userhdhomerun", _key, _value);
+   return _conf.GetSecValue(_tuner, _key, _value) || found;
+}
+
+static uint64_t MonotonicUs()
+{
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// Between two polls while busy polling
+static inline void CpuRelax()
+{
+#if defined(__i386__) || defined(__x86_64__)
+   __asm__ __volatile__("pause");
+#elif defined(__aarch64__) || defined(__arm__)
+   __asm__ __volatile__("yield");
+#endif
+}
+
+HdhomerunTuner::HdhomerunTuner(int _device_id, int _device_ip, int _tuner, const ConfIniFile* _conf, struct hdhomerun_debug_t* _dbg) 
+  : m_device(0), m_dbg(_dbg), m_stream(false), m_passAll(false),
+    m_maxFilterRanges(DEFAULT_MAX_FILTER_RANGES),
+    m_localFilter(false), m_localFilterChanged(false), m_prevFreq(0),
     m_deviceId(_device_id), m_deviceIP(_device_ip), m_tuner(_tuner),
-    m_kernelId(-1), m_useFullName(false), m_isDisabled(false),
-    m_type(HdhomerunTuner::NOT_SET)
+    m_offline(false), m_standby(false), m_kernelId(-1), m_useFullName(false), m_isDisabled(false),
+    m_initFailed(false), m_type(HdhomerunTuner::NOT_SET), m_recvProfile(DEFAULT_RECV_PROFILE), m_busyPollUs(0),
+    m_batchLogLimit(STATUS_LOG_INTERVAL), m_statusLogLimit(STATUS_LOG_INTERVAL), m_strengthLogLimit(STATUS_LOG_INTERVAL),
+    m_useRtp(false), m_rtpPort(0), m_rtpWindow(DEFAULT_RTP_WINDOW), m_rtpHoldMs(DEFAULT_RTP_HOLD_MS), m_rtp(NULL),
+    m_fanout(NULL), m_ring(NULL), m_ringSize(0), m_httpRing(NULL),
+    m_rcvBuf(0), m_videoPort(0),
+    m_socketDropsSampled(0), m_socketPeak(0), m_socketDropsStart(0), m_socketPeakStream(0)
 {
+   memset(m_userPids, 0, sizeof(m_userPids));
+   pthread_mutex_init(&m_mutexLocalFilter, NULL);
+   pthread_mutex_init(&m_mutexStats, NULL);
+   m_streamStats = StreamStats();
+   memset(&m_rtpStart, 0, sizeof(m_rtpStart));
+   memset(&m_stats_sampled, 0, sizeof(m_stats_sampled));
+
+   pthread_mutexattr_t attr;
+   pthread_mutexattr_init(&attr);
+   pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+   pthread_mutex_init(&m_mutexDevice, &attr);
+   pthread_mutexattr_destroy(&attr);
+
    m_device = hdhomerun_device_create(m_deviceId, m_deviceIP, m_tuner, m_dbg);
    
    m_name = hdhomerun_device_get_name(m_device);
    LOG() << endl << "Name of device: " << m_name << endl;
   
-   ConfIniFile conf;
-   if(conf.OpenIniFile("/etc/dvbhdhomerun")) {
+   if(_conf) {
+      const ConfIniFile& conf = *_conf;
       string tunerType;
       if(conf.GetSecValue(m_name, "tuner_type", tunerType)) {
          if (tunerType == "DVB-C") {
@@ -85,10 +193,111 @@ HdhomerunTuner::HdhomerunTuner(int _device_id, int _device_ip, int _tuner, struc
             LOG() << "Tuner disabled according to conf file" << endl;
          }
       }
+
+      string maxFilterRanges;
+      if(conf.GetSecValue(m_name, "pid_filter_max_ranges", maxFilterRanges)) {
+         int ranges = atoi(maxFilterRanges.c_str());
+         if(ranges > 0) {
+            m_maxFilterRanges = ranges;
+            LOG() << "PID filter limited to " << m_maxFilterRanges << " ranges" << endl;
+         }
+         else {
+            ERR() << "Invalid pid_filter_max_ranges: " << maxFilterRanges << endl;
+         }
+      }
+
+      string value;
+      if(GetTunerValue(conf, m_name, "busy_poll", value)) {
+         m_busyPollUs = atoi(value.c_str());
+      }
+      if(m_busyPollUs > 0) {
+         LOG() << "Busy polling for " << m_busyPollUs << " us" << endl;
+      }
+
+      if(GetTunerValue(conf, m_name, "udp_rcvbuf", value)) {
+         m_rcvBuf = atoi(value.c_str());
+      }
+
+      if(GetTunerValue(conf, m_name, "stream_protocol", value)) {
+         if(value == "rtp") {
+            m_useRtp = true;
+            LOG() << "Streaming RTP" << endl;
+         }
+         else if(value != "udp") {
+            ERR() << "Invalid stream_protocol: " << value << endl;
+         }
+      }
+      if(conf.GetSecValue(m_name, "rtp_port", value)) {
+         m_rtpPort = atoi(value.c_str());
+      }
+      if(GetTunerValue(conf, m_name, "rtp_reorder_window", value)) {
+         m_rtpWindow = atoi(value.c_str());
+      }
+      if(GetTunerValue(conf, m_name, "rtp_reorder_ms", value)) {
+         m_rtpHoldMs = atoi(value.c_str());
+      }
+
+      if(GetTunerValue(conf, m_name, "fanout", value)) {
+         int ttl = DEFAULT_FANOUT_TTL;
+         int waitMs = DEFAULT_FANOUT_WAIT_MS;
+         string tmp;
+         if(GetTunerValue(conf, m_name, "fanout_ttl", tmp)) {
+            ttl = atoi(tmp.c_str());
+         }
+         if(GetTunerValue(conf, m_name, "fanout_wait_ms", tmp)) {
+            waitMs = atoi(tmp.c_str());
+         }
+         m_fanout = new StreamFanout(value, ttl, waitMs);
+         if(m_fanout->Empty()) {
+            delete m_fanout;
+            m_fanout = NULL;
+         }
+      }
+
+      if(GetTunerValue(conf, m_name, "shm_ring", value) && !m_isDisabled) {
+         m_ringSize = strtoul(value.c_str(), NULL, 10);
+      }
+
+      if(GetTunerValue(conf, m_name, "http_port", value) && atoi(value.c_str()) > 0 && !m_isDisabled) {
+         size_t size = DEFAULT_HTTP_RING;
+         if(GetTunerValue(conf, m_name, "http_ring", value)) {
+            size = strtoul(value.c_str(), NULL, 10);
+            if(size < MIN_HTTP_RING) {
+               ERR() << "http_ring below " << MIN_HTTP_RING << ": " << value << endl;
+               size = MIN_HTTP_RING;
+            }
+         }
+         m_httpRing = new StreamRing();
+         if(!m_httpRing->Create(size)) {
+            delete m_httpRing;
+            m_httpRing = NULL;
+         }
+      }
+
+      string profile(RECV_PROFILES[DEFAULT_RECV_PROFILE].name);
+      GetTunerValue(conf, m_name, "recv_profile", profile);
+      int found = FindRecvProfile(profile);
+      if(found >= 0) {
+         m_recvProfile = found;
+      }
+      else {
+         ERR() << "Invalid recv_profile: " << profile << endl;
+      }
+
+      // The [userhdhomerun] ingest settings, overridden per tuner
+      ThreadSched sched;
+      sched.Read(conf, "userhdhomerun", "ingest");
+      sched.Read(conf, m_name, "ingest");
+      setSched(sched, m_name);
    }
    else {
       ERR() << "No ini file found, using default values" << endl;
    }
+
+   // No need to talk to the HDHomeRun about a tuner we won't use.
+   if(m_isDisabled) {
+      return;
+   }
    
    if(m_type == HdhomerunTuner::NOT_SET) {
       LOG() << "Auto detecting tuner type" << endl;
@@ -106,21 +315,127 @@ HdhomerunTuner::HdhomerunTuner(int _device_id, int _device_ip, int _tuner, struc
       }
       else {
          ERR() << "get_model_str from HDHomeRun failed!" << endl;
-         exit(-1);
+         m_initFailed = true;
+         return;
       }
    }
    
    int tuner = hdhomerun_device_get_tuner(m_device);
    LOG() << "Tuner: " << tuner << endl;
-   
-   int ret = hdhomerun_device_set_tuner_filter(m_device, "0x0000-0x1FFF");
+
+   // The initial filter waits for SetStandby(), the tuner may be
+   // streaming for another userhdhomerun
+}
+
+void HdhomerunTuner::SetStandby(bool _standby)
+{
+   MutexLocker lock(&m_mutexDevice);
+
+   m_standby = _standby;
+   if(m_standby) {
+      LOG() << "Tuner " << m_name << " is standby, leaving the HDHomeRun alone" << endl;
+   }
+   else {
+      SetInitialFilter();
+      OpenRing();
+   }
+}
+
+bool HdhomerunTuner::HeldByOther(User _user) const
+{
+   for(int user = 0; user < NUM_USERS; ++user) {
+      if(user != _user && m_userPids[user] > 0) {
+         return true;
+      }
+   }
+   return false;
+}
+
+void HdhomerunTuner::TakeOver()
+{
+   if(!m_standby) {
+      return;
+   }
+
+   LOG() << "Tuner " << m_name << " taken over" << endl;
+   m_standby = false;
+   // Reconnect() sets it when the HDHomeRun is back
+   if(!m_offline) {
+      SetInitialFilter();
+   }
+   OpenRing();
+}
+
+void HdhomerunTuner::OpenRing()
+{
+   if(m_ringSize == 0 || m_ring) {
+      return;
+   }
+
+   TsRingPublisher* ring = new TsRingPublisher();
+   if(!ring->Open(m_name, m_ringSize)) {
+      delete ring;
+      return;
+   }
+   m_ring = ring;
+}
+
+void HdhomerunTuner::SetInitialFilter()
+{
+   m_devicePidFilter.Fill();
+   int ret = hdhomerun_device_set_tuner_filter(m_device, m_devicePidFilter.ToString().c_str());
    LOG() << "Set initial pass-all filter for tuner: " << ret << endl;  
 }
 
 HdhomerunTuner::~HdhomerunTuner()
 {
-   this->StopStreaming(0x2000);
+   this->StopStreaming(PidFilter::PASS_ALL, USER_DVB);
+   delete m_rtp;
+   delete m_fanout;
+   delete m_ring;
+   delete m_httpRing;
    hdhomerun_device_destroy(m_device);
+   pthread_mutex_destroy(&m_mutexLocalFilter);
+   pthread_mutex_destroy(&m_mutexDevice);
+   pthread_mutex_destroy(&m_mutexStats);
+}
+
+// The socket's line in /proc/net/udp. rx_queue is what waits in its
+// receive buffer, drops is the counter SO_RXQ_OVFL would report.
+// libhdhomerun does the recv(), so we can't get that from a cmsg.
+static bool ReadUdpSocket(int _port, uint32_t& _queued, uint64_t& _drops)
+{
+   ifstream udp("/proc/net/udp");
+   string line;
+   getline(udp, line);  // Header
+
+   while(getline(udp, line)) {
+      // sl local_address rem_address st tx_queue:rx_queue tr:tm->when
+      // retrnsmt uid timeout inode ref pointer drops
+      istringstream str(line);
+      vector<string> fields;
+      string field;
+      while(str >> field) {
+         fields.push_back(field);
+      }
+      if(fields.size() < 13) {
+         continue;
+      }
+
+      size_t colon = fields[1].find(':');
+      if(colon == string::npos || strtol(fields[1].c_str() + colon + 1, NULL, 16) != _port) {
+         continue;
+      }
+
+      colon = fields[4].find(':');
+      if(colon == string::npos) {
+         return false;
+      }
+      _queued = strtoul(fields[4].c_str() + colon + 1, NULL, 16);
+      _drops = strtoull(fields[12].c_str(), NULL, 10);
+      return true;
+   }
+   return false;
 }
 
 void HdhomerunTuner::run()
@@ -128,131 +443,349 @@ void HdhomerunTuner::run()
    uint8_t *data;
    size_t dataSize;
    ofstream ofs;
+   PidFilter localPidFilter;
+   bool localFilter = false;
 
    ofs.open(m_nameDataDevice.c_str(), ios::out | ios::binary);
    if(!ofs) {
       ERR() << "Couldn't open: " << m_nameDataDevice << endl;
+      logFile.Flush();
       _exit(-1);
    }
    LOG() << "Open data device: " << m_nameDataDevice << endl;
    
-   const int VIDEO_FOR_1_SEC = 20000000 / 8;  // Same number is used on hdhomerun_config. Don't know where they get that from.
-   while(m_stream && !m_stop) {
-      data = hdhomerun_device_stream_recv(m_device, VIDEO_FOR_1_SEC, &dataSize);
+   const RecvProfile& profile = RECV_PROFILES[m_recvProfile];
+   // Bytes per second, a full mux until measured
+   uint64_t rate = VIDEO_DATA_BUFFER_SIZE_1S;
+   uint64_t windowStart = MonotonicUs();
+   uint64_t windowBytes = 0;
+   size_t batch = VIDEO_DATA_BUFFER_SIZE_1S;
+   int intervalMs = profile.minIntervalMs;
+
+   // When a receive last emptied libhdhomerun's buffer, 0 when it
+   // didn't. Whatever comes next arrived after that.
+   uint64_t drained = 0;
+   uint64_t lastData = windowStart;
+
+   // Readers that registered while the tuner was idle get woken up
+   // from the first batch on
+   if(m_ring) {
+      m_ring->Service();
+      m_ring->SetStreaming(true);
+   }
+
+   uint64_t lastSample = 0;
+   while(m_stream && !isStopping()) {
+      uint64_t polled = MonotonicUs();
+      if(m_rtp) {
+         data = m_rtp->Receive(batch, &dataSize);
+      }
+      else {
+         data = hdhomerun_device_stream_recv(m_device, batch, &dataSize);
+      }
+      size_t received = dataSize;
+      // More is waiting, go again without sleeping
+      bool full = (received == batch);
+
+      if(dataSize > 0 && m_fanout) {
+         m_fanout->Send(data, dataSize);
+      }
+      if(dataSize > 0 && m_ring) {
+         m_ring->Publish(data, dataSize);
+      }
+      if(dataSize > 0 && m_httpRing) {
+         m_httpRing->Write(data, dataSize);
+      }
+
+      if(dataSize > 0) {
+         pthread_mutex_lock(&m_mutexLocalFilter);
+         if(m_localFilterChanged) {
+            localPidFilter = m_localPidFilter;
+            localFilter = m_localFilter;
+            m_localFilterChanged = false;
+         }
+         pthread_mutex_unlock(&m_mutexLocalFilter);
+
+         if(localFilter) {
+            dataSize = localPidFilter.FilterPackets(data, dataSize);
+         }
+      }
 
       if(dataSize > 0) {
          ofs.write((const char*)data, dataSize);
-         //ofs.flush();
+         // Nothing waits in the ofstream for the next batch
+         ofs.flush();
+
+         MutexLocker lock(&m_mutexStats);
+         m_streamStats.bytes += dataSize;
       }
 
-      usleep(64000);
+      uint64_t now = MonotonicUs();
+      if(received > 0) {
+         // No packet in the batch is older than this when the demux
+         // gets it
+         if(drained) {
+            MutexLocker lock(&m_mutexStats);
+            m_streamStats.ingestLatency.Add(now - drained);
+         }
+         lastData = now;
+      }
+      drained = full ? 0 : polled;
+
+      windowBytes += received;
+      if(now - windowStart >= RECV_RATE_WINDOW) {
+         rate = (rate * 3 + windowBytes * 1000000 / (now - windowStart)) / 4;
+         windowStart = now;
+         windowBytes = 0;
+
+         // Busy polling takes everything there is every time
+         if(m_busyPollUs == 0) {
+            intervalMs = rate > 0 ? profile.targetBytes * 1000 / rate : profile.maxIntervalMs;
+            intervalMs = std::max(profile.minIntervalMs, std::min(profile.maxIntervalMs, intervalMs));
+
+            batch = rate * intervalMs * 2 / 1000;
+            batch = (batch / VIDEO_DATA_PACKET_SIZE + 1) * VIDEO_DATA_PACKET_SIZE;
+            batch = std::max((size_t)profile.targetBytes, std::min((size_t)VIDEO_DATA_BUFFER_SIZE_1S, batch));
+
+            LOG_LIMITED(LogFile::LEVEL_DEBUG, m_batchLogLimit) << m_name << " " << rate * 8 / 1000
+               << " kbit/s, " << profile.name << " receives " << batch << " bytes every " << intervalMs << " ms" << endl;
+         }
+      }
+
+      if(now - lastSample >= 1000000) {
+         if(m_rtp) {
+            MutexLocker lock(&m_mutexStats);
+            m_streamStats.rtp = m_rtp->GetStats();
+         }
+         if(m_ring) {
+            m_ring->Service();
+         }
+         lastSample = now;
+      }
+
+      // stop() cuts the sleeps short
+      if(full) {
+         continue;
+      }
+      if(m_busyPollUs > 0) {
+         // Spin for a while after the last data, then a quiet mux
+         // goes back to sleeping
+         if(now - lastData < (uint64_t)m_busyPollUs) {
+            CpuRelax();
+         }
+         else {
+            waitForStop(1);
+         }
+      }
+      else {
+         waitForStop(intervalMs);
+      }
    }
    
+   if(m_ring) {
+      m_ring->SetStreaming(false);
+   }
    ofs.close();  
 }
 
 void HdhomerunTuner::AddPidToFilter(int _pid)
 {
-   if(_pid == 0x2000) {  // Means pass-all TS ?
-      m_pidFilters.clear(); // When empty, GetStrFromPidFilter will return 0x0000-0x1FFF which = pass-all.    
+   if(_pid == PidFilter::PASS_ALL) {
+      m_passAll = true;
    }
-   else
-   {
-      vector<int>::iterator result;
-      result = find(m_pidFilters.begin(), m_pidFilters.end(), _pid);
-      
-      if(result == m_pidFilters.end()) {
-         m_pidFilters.push_back(_pid);
-      }
+   else {
+      m_pidFilter.Add(_pid);
    }
 }
  
 void HdhomerunTuner::RemovePidFromFilter(int _pid)
 {
-   vector<int>::iterator result;
-   result = find(m_pidFilters.begin(), m_pidFilters.end(), _pid);
-
-   if(result != m_pidFilters.end()) {
-      m_pidFilters.erase(result);
+   if(_pid == PidFilter::PASS_ALL) {
+      m_passAll = false;
+   }
+   else {
+      m_pidFilter.Remove(_pid);
    }
 }
 
-std::string HdhomerunTuner::GetStrFromPidFilter()
+void HdhomerunTuner::UpdateDeviceFilter()
 {
-   string PidFilter;
+   PidFilter wanted;
+   if(m_passAll) {
+      wanted.Fill();
+   }
+   else {
+      wanted = m_pidFilter;
+   }
+
+   if(wanted.Empty()) {
+      return;
+   }
+
+   PidFilter device = wanted.Widen(m_maxFilterRanges);
 
-   if(m_pidFilters.empty()) {
-      PidFilter = "0x0000-0x1FFF";
+   pthread_mutex_lock(&m_mutexLocalFilter);
+   m_localPidFilter = wanted;
+   m_localFilter = (device != wanted);
+   m_localFilterChanged = true;
+   pthread_mutex_unlock(&m_mutexLocalFilter);
+
+   if(device == m_devicePidFilter || m_offline) {
+      return;
+   }
+
+   PidFilter added;
+   PidFilter removed;
+   PidFilter::Diff(m_devicePidFilter, device, added, removed);
+
+   string strPidFilter = device.ToString();
+   LOG() << "PidFilter: " << strPidFilter << endl;
+   if(!added.Empty()) {
+      LOG() << "PidFilter added: " << added.ToString() << endl;
+   }
+   if(!removed.Empty()) {
+      LOG() << "PidFilter removed: " << removed.ToString() << endl;
+   }
+   if(device != wanted) {
+      LOG() << "PidFilter widened to " << m_maxFilterRanges << " ranges, "
+            << device.Count() - wanted.Count() << " PIDs filtered locally" << endl;
+   }
+
+   int ret = hdhomerun_device_set_tuner_filter(m_device, strPidFilter.c_str());
+   if(ret > 0) {
+      m_devicePidFilter = device;
    }
    else {
-      ostringstream str;
+      ERR() << "hdhomerun_device_set_tuner_filter failed: " << ret << endl;
+   }
+}
 
-      vector<int>::iterator it;
-      for(it = m_pidFilters.begin(); it != m_pidFilters.end(); ++it)  {
-         str << "0x" << hex << uppercase << *it << " ";
-      }
-    
-      PidFilter = str.str();
+int HdhomerunTuner::TuneAndStream(int _freq, const std::vector<int>& _pids, User _user)
+{
+   // Recursive, nothing retunes between the two
+   MutexLocker lock(&m_mutexDevice);
+
+   int ret = Tune(_freq, _user);
+   if(ret <= 0) {
+      return ret;
    }
-   
-   LOG() << "PidFilter: " << PidFilter << endl;
-   return PidFilter;
+
+   vector<int>::const_iterator pid;
+   for(pid = _pids.begin(); pid != _pids.end(); ++pid) {
+      StartStreaming(*pid, _user);
+   }
+   return ret;
 }
 
-void HdhomerunTuner::StartStreaming(int _pid)
+void HdhomerunTuner::StartStreaming(int _pid, User _user)
 {
+   MutexLocker lock(&m_mutexDevice);
+
+   // The kernel only sends requests for a standby tuner once it is ours
+   TakeOver();
+
+   unsigned int& users = m_pidUsers[_pid];
+   if(!(users & (1 << _user))) {
+      users |= 1 << _user;
+      m_userPids[_user]++;
+   }
+
    AddPidToFilter(_pid);
    
    // Setup PID filtering
-   string StrPidFilter = GetStrFromPidFilter();
-
-   int ret = hdhomerun_device_set_tuner_filter(m_device, StrPidFilter.c_str());
+   UpdateDeviceFilter();
 
-   // Need locking here too!
+   // Reconnect() starts the stream when we are back online.
+   if(m_offline) {
+      return;
+   }
 
    // Start stream
    if(!m_stream) {
-      int ret = hdhomerun_device_stream_start(m_device);
-      LOG() << "hdhomerun_device_stream_start: " << ret << endl;
-      hdhomerun_device_stream_flush(m_device); 
+      StreamStart();
+      if(!m_rtp) {
+         hdhomerun_device_stream_flush(m_device); 
+      }
       
       m_stream = true;
       this->start();
    }
 
-   hdhomerun_device_get_video_stats(m_device, &m_stats_old);
+   GetVideoStats(&m_stats_old);
 }
  
-void HdhomerunTuner::StopStreaming(int _pid)
+void HdhomerunTuner::StopStreaming(int _pid, User _user)
 {
+   MutexLocker lock(&m_mutexDevice);
+
+   map<int, unsigned int>::iterator it = m_pidUsers.find(_pid);
+   if(it != m_pidUsers.end()) {
+      if(it->second & (1 << _user)) {
+         it->second &= ~(1 << _user);
+         m_userPids[_user]--;
+      }
+      // The other user still wants it
+      if(it->second != 0) {
+         return;
+      }
+      m_pidUsers.erase(it);
+   }
+
    RemovePidFromFilter(_pid);
 
-   if(!m_pidFilters.empty()) {
+   if(m_passAll || !m_pidFilter.Empty()) {
+      UpdateDeviceFilter();
       return;
    }
 
    if(m_stream) {
       LOG() << "Stop writing to dvr0" << endl;
       m_stream = false;
-      while(!this->isFinished()) {
-         usleep(100);
-      }
+      this->stop();
 
-      LOG() << "hdhomerun_device_stream_stop" << endl;
-      hdhomerun_device_stream_stop(m_device);
-      LOG() << "hdhomerun_device_stream_stop, stopped" << endl;
+      // The last look at the socket before it goes
+      SampleSocket();
+      if(!m_offline) {
+         StreamStop();
+      }
 
-      hdhomerun_device_get_video_stats(m_device, &m_stats_cur);
+      GetVideoStats(&m_stats_cur);
+      if(m_rtp) {
+         MutexLocker lock(&m_mutexStats);
+         m_streamStats.rtp = m_rtp->GetStats();
+      }
       LogNetworkStat();
    }
 }
 
 
-int HdhomerunTuner::Tune(int _freq)
+int HdhomerunTuner::Tune(int _freq, User _user)
 {
+   MutexLocker lock(&m_mutexDevice);
+
+   TakeOver();
+
+   // Sharing the frequency is fine, moving it from under the other
+   // user isn't
+   if(_freq != m_prevFreq && HeldByOther(_user)) {
+      LOG() << "Tuner " << m_name << " is streaming at " << m_prevFreq << " for "
+            << (_user == USER_DVB ? "HTTP" : "/dev/dvb") << ", not tuning to " << _freq << endl;
+      return TUNE_BUSY;
+   }
+   // Even when not fully locked, a retune would cut the other user off
+   if(_freq == m_prevFreq && HeldByOther(_user)) {
+      return 1;
+   }
+
+   if(m_offline) {
+      // Tuned to this one when the HDHomeRun is back.
+      m_prevFreq = _freq;
+      return -1;
+   }
+
    int status = ReadStatus();
    if(m_prevFreq == _freq && status == (FE_HAS_SIGNAL | FE_HAS_CARRIER | FE_HAS_VITERBI | FE_HAS_SYNC | FE_HAS_LOCK) ) {
-      return 0;
+      return 1;
    }
 
    ostringstream is;
@@ -276,8 +809,14 @@ int HdhomerunTuner::Tune(int _freq)
 
 int HdhomerunTuner::ReadStatus()
 {
+   MutexLocker lock(&m_mutexDevice);
+
    int status = 0;
 
+   if(m_offline) {
+      return status;
+   }
+
    struct hdhomerun_tuner_status_t hdhomerun_status;
    int ret = hdhomerun_device_get_tuner_status(m_device, NULL, &hdhomerun_status);
    if (ret > 0) {
@@ -290,18 +829,24 @@ int HdhomerunTuner::ReadStatus()
       }
    }
 
-   LOG() << "sym qual: " << dec << hdhomerun_status.symbol_error_quality << endl;
+   LOG_LIMITED(LogFile::LEVEL_INFO, m_statusLogLimit) << m_name << " sym qual: " << dec << hdhomerun_status.symbol_error_quality << endl;
    
    return status;
 }
 
 int HdhomerunTuner::ReadSignalStrength()
 {
+   MutexLocker lock(&m_mutexDevice);
+
    int status = 0x0000;
+
+   if(m_offline) {
+      return status;
+   }
   
    struct hdhomerun_tuner_status_t hdhomerun_status;
    int ret = hdhomerun_device_get_tuner_status(m_device, NULL, &hdhomerun_status);
-   LOG() << "strength: " << dec << hdhomerun_status.signal_strength << " sym qual: " <<  hdhomerun_status.symbol_error_quality << " sig to noise:" << hdhomerun_status.signal_to_noise_quality << endl;
+   LOG_LIMITED(LogFile::LEVEL_INFO, m_strengthLogLimit) << m_name << " strength: " << dec << hdhomerun_status.signal_strength << " sym qual: " <<  hdhomerun_status.symbol_error_quality << " sig to noise:" << hdhomerun_status.signal_to_noise_quality << endl;
 
    status = (0xffff *  hdhomerun_status.signal_strength) / 100;
 
@@ -347,12 +892,329 @@ void HdhomerunTuner::SetDataDeviceName(const std::string& _name)
    m_nameDataDevice = _name;
 }
 
-void HdhomerunTuner::LogNetworkStat() const
+void HdhomerunTuner::SetDeviceIP(uint32_t _ip)
+{
+   MutexLocker lock(&m_mutexDevice);
+
+   LOG() << "Tuner " << m_name << " moved to a new address, reconnecting" << endl;
+
+   m_deviceIP = _ip;
+   hdhomerun_device_set_device(m_device, m_deviceId, m_deviceIP);
+   m_offline = false;
+   Reconnect();
+}
+
+bool HdhomerunTuner::Probe()
+{
+   MutexLocker lock(&m_mutexDevice);
+
+   struct hdhomerun_tuner_status_t hdhomerun_status;
+   return hdhomerun_device_get_tuner_status(m_device, NULL, &hdhomerun_status) > 0;
+}
+
+void HdhomerunTuner::SetOffline()
+{
+   MutexLocker lock(&m_mutexDevice);
+
+   if(!m_offline) {
+      ERR() << "Tuner " << m_name << " is offline" << endl;
+      m_offline = true;
+   }
+}
+
+void HdhomerunTuner::SetOnline()
+{
+   MutexLocker lock(&m_mutexDevice);
+
+   if(m_offline) {
+      LOG() << "Tuner " << m_name << " is back online" << endl;
+      m_offline = false;
+      Reconnect();
+   }
+}
+
+void HdhomerunTuner::Reconnect()
+{
+   // Still the other userhdhomerun's
+   if(m_standby) {
+      return;
+   }
+
+   if(m_prevFreq != 0) {
+      ostringstream is;
+      is << "auto:" << m_prevFreq;
+      int ret = hdhomerun_device_set_tuner_channel(m_device, is.str().c_str());
+      LOG() << "hdhomerun_device_set_tuner_channel: " << ret << endl;
+   }
+
+   // The HDHomeRun may have rebooted, so don't trust what we think
+   // its filter is.
+   bool wanted = m_passAll || !m_pidFilter.Empty();
+   if(wanted) {
+      m_devicePidFilter.Clear();
+      UpdateDeviceFilter();
+   }
+   else {
+      m_devicePidFilter.Fill();
+      hdhomerun_device_set_tuner_filter(m_device, m_devicePidFilter.ToString().c_str());
+   }
+
+   if(wanted) {
+      StreamStart();
+
+      if(!m_stream) {
+         m_stream = true;
+         this->start();
+      }
+   }
+}
+
+void HdhomerunTuner::StreamStart()
+{
+   if(m_useRtp && !m_rtp) {
+      RtpReceiver* rtp = new RtpReceiver(m_rtpWindow, m_rtpHoldMs);
+      if(rtp->Open(m_rtpPort)) {
+         m_rtp = rtp;
+      }
+      else {
+         ERR() << "Falling back to UDP for " << m_name << endl;
+         delete rtp;
+         m_useRtp = false;
+      }
+   }
+
+   if(!m_rtp) {
+      SetupVideoSocket();
+      int ret = hdhomerun_device_stream_start(m_device);
+      LOG() << "hdhomerun_device_stream_start: " << ret << endl;
+      return;
+   }
+
+   // Reconnect() comes here with run() going
+   if(!m_stream) {
+      m_rtp->Reset();
+   }
+   SetupVideoSocket();
+
+   uint32_t ip = hdhomerun_device_get_local_machine_addr(m_device);
+   ostringstream target;
+   target << "rtp://" << (ip >> 24) << "." << ((ip >> 16) & 0xff) << "." << ((ip >> 8) & 0xff)
+          << "." << (ip & 0xff) << ":" << m_rtp->GetPort();
+   int ret = hdhomerun_device_set_tuner_target(m_device, target.str().c_str());
+   LOG() << "hdhomerun_device_set_tuner_target " << target.str() << ": " << ret << endl;
+
+   MutexLocker lock(&m_mutexStats);
+   m_rtpStart = m_streamStats.rtp = m_rtp->GetStats();
+}
+
+void HdhomerunTuner::StreamStop()
+{
+   if(m_rtp) {
+      int ret = hdhomerun_device_set_tuner_target(m_device, "none");
+      LOG() << "hdhomerun_device_set_tuner_target none: " << ret << endl;
+      return;
+   }
+
+   LOG() << "hdhomerun_device_stream_stop" << endl;
+   hdhomerun_device_stream_stop(m_device);
+   LOG() << "hdhomerun_device_stream_stop, stopped" << endl;
+}
+
+void HdhomerunTuner::GetVideoStats(struct hdhomerun_video_stats_t* _stats)
+{
+   // Asking would set up a video socket that isn't used
+   if(m_rtp) {
+      memset(_stats, 0, sizeof(*_stats));
+      return;
+   }
+   hdhomerun_device_get_video_stats(m_device, _stats);
+}
+
+void HdhomerunTuner::SetupVideoSocket()
+{
+   int fd = -1;
+   int port = 0;
+   if(m_rtp) {
+      fd = m_rtp->GetFd();
+      port = m_rtp->GetPort();
+   }
+   else {
+      struct hdhomerun_video_sock_t* vs = hdhomerun_device_get_video_sock(m_device);
+      if(!vs) {
+         ERR() << "hdhomerun_device_get_video_sock failed" << endl;
+         return;
+      }
+#ifdef HAVE_HDHOMERUN_VIDEO_GET_SOCK
+      fd = hdhomerun_video_get_sock(vs);
+#endif
+      port = hdhomerun_video_get_local_port(vs);
+   }
+
+   int buffer = 0;
+   if(fd >= 0) {
+      socklen_t len = sizeof(buffer);
+      if(m_rcvBuf > 0) {
+         // Linux doubles what it's asked for and caps it at
+         // net.core.rmem_max, SO_RCVBUFFORCE goes past that with
+         // CAP_NET_ADMIN.
+         setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &m_rcvBuf, sizeof(m_rcvBuf));
+         getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buffer, &len);
+         if(buffer / 2 < m_rcvBuf &&
+            setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &m_rcvBuf, sizeof(m_rcvBuf)) != 0) {
+            ERR() << "udp_rcvbuf " << m_rcvBuf << " capped to " << buffer / 2
+                  << ", raise net.core.rmem_max or give CAP_NET_ADMIN" << endl;
+         }
+      }
+      len = sizeof(buffer);
+      getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buffer, &len);
+
+#ifdef SO_BUSY_POLL
+      // The receive (libhdhomerun's thread, or run() for RTP) polls
+      // the NIC instead of waiting for its interrupt. Above
+      // net.core.busy_read needs CAP_NET_ADMIN.
+      if(m_busyPollUs > 0 &&
+         setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &m_busyPollUs, sizeof(m_busyPollUs)) != 0) {
+         ERR() << "Couldn't set SO_BUSY_POLL: " << strerror(errno) << endl;
+      }
+#else
+      if(m_busyPollUs > 0) {
+         ERR() << "busy_poll can't set SO_BUSY_POLL, not built with it, only the receive spins" << endl;
+      }
+#endif
+   }
+   else {
+      if(m_rcvBuf > 0) {
+         ERR() << "udp_rcvbuf needs hdhomerun_video_get_sock(), not in this libhdhomerun" << endl;
+      }
+      if(m_busyPollUs > 0) {
+         ERR() << "busy_poll can't set SO_BUSY_POLL without hdhomerun_video_get_sock(), not in this libhdhomerun, "
+               << "only the receive spins" << endl;
+      }
+   }
+
+   LOG() << "Video socket on port " << port << ", receive buffer " << buffer << " bytes" << endl;
+
+   MutexLocker lock(&m_mutexStats);
+   m_videoPort = port;
+   m_streamStats.socketBuffer = buffer;
+   m_socketDropsStart = m_streamStats.socketDrops;
+   m_socketPeakStream = 0;
+}
+
+void HdhomerunTuner::SampleSocket()
+{
+   int port;
+   {
+      MutexLocker lock(&m_mutexStats);
+      port = m_videoPort;
+   }
+
+   uint32_t queued;
+   uint64_t drops;
+   if(port == 0 || !ReadUdpSocket(port, queued, drops)) {
+      return;
+   }
+
+   MutexLocker lock(&m_mutexStats);
+
+   // A new socket, the counter started over
+   if(drops < m_socketDropsSampled) {
+      m_socketDropsSampled = 0;
+   }
+   m_streamStats.socketDrops += drops - m_socketDropsSampled;
+   m_socketDropsSampled = drops;
+
+   m_streamStats.socketQueued = queued;
+   m_socketPeak = max(m_socketPeak, queued);
+   m_socketPeakStream = max(m_socketPeakStream, queued);
+}
+
+void HdhomerunTuner::LogNetworkStat()
 {
    LOG() << "Network error count   : " << m_stats_cur.network_error_count - m_stats_old.network_error_count << endl;
    LOG() << "Overflow error count  : " << m_stats_cur.overflow_error_count - m_stats_old.overflow_error_count << endl;
    LOG() << "Transport error count : " << m_stats_cur.transport_error_count - m_stats_old.transport_error_count << endl;
    LOG() << "Sequence error count  : " << m_stats_cur.sequence_error_count - m_stats_old.sequence_error_count << endl;
+
+   MutexLocker lock(&m_mutexStats);
+   if(m_rtp) {
+      const RtpReceiver::Stats& rtp = m_streamStats.rtp;
+      LOG() << "RTP lost count        : " << rtp.lost - m_rtpStart.lost << endl;
+      LOG() << "RTP reordered count   : " << rtp.reordered - m_rtpStart.reordered << endl;
+      LOG() << "RTP duplicate count   : " << rtp.duplicates - m_rtpStart.duplicates << endl;
+      LOG() << "RTP late count        : " << rtp.late - m_rtpStart.late << endl;
+      LOG() << "RTP invalid count     : " << rtp.invalid - m_rtpStart.invalid << endl;
+      LOG() << "RTP jitter us         : " << rtp.jitter << endl;
+   }
+   LOG() << "Ingest latency us     : " << m_streamStats.ingestLatency.ToString() << endl;
+   LOG() << "Socket drop count     : " << m_streamStats.socketDrops - m_socketDropsStart << endl;
+   if(m_streamStats.socketBuffer > 0) {
+      LOG() << "Socket buffer peak    : " << m_socketPeakStream << " of " << m_streamStats.socketBuffer
+            << " bytes (" << (uint64_t)m_socketPeakStream * 100 / m_streamStats.socketBuffer << "%)" << endl;
+   }
+}
+
+void HdhomerunTuner::SampleStreamStats()
+{
+   // Reads /proc/net/udp, here rather than on the ingest thread
+   SampleSocket();
+   {
+      MutexLocker lock(&m_mutexStats);
+      m_streamStats.socketQueuedPeak = m_socketPeak;
+      m_socketPeak = m_streamStats.socketQueued;
+   }
+
+   // libhdhomerun sets up a video socket for the asking, only look
+   // while streaming and not with RTP.
+   if(!m_stream || m_rtp || pthread_mutex_trylock(&m_mutexDevice) != 0) {
+      return;
+   }
+
+   struct hdhomerun_video_stats_t cur;
+   hdhomerun_device_get_video_stats(m_device, &cur);
+   pthread_mutex_unlock(&m_mutexDevice);
+
+   MutexLocker lock(&m_mutexStats);
+
+   // A new stream, the counters started over
+   if(cur.packet_count < m_stats_sampled.packet_count) {
+      memset(&m_stats_sampled, 0, sizeof(m_stats_sampled));
+   }
+
+   m_streamStats.packets += cur.packet_count - m_stats_sampled.packet_count;
+   m_streamStats.networkErrors += cur.network_error_count - m_stats_sampled.network_error_count;
+   m_streamStats.transportErrors += cur.transport_error_count - m_stats_sampled.transport_error_count;
+   m_streamStats.sequenceErrors += cur.sequence_error_count - m_stats_sampled.sequence_error_count;
+   m_streamStats.overflowErrors += cur.overflow_error_count - m_stats_sampled.overflow_error_count;
+   m_stats_sampled = cur;
+}
+
+HdhomerunTuner::StreamStats HdhomerunTuner::GetStreamStats()
+{
+   MutexLocker lock(&m_mutexStats);
+   StreamStats stats = m_streamStats;
+   stats.streaming = m_stream;
+   return stats;
+}
+
+void HdhomerunTuner::GetFanoutStats(std::vector<StreamFanout::Stats>& _stats)
+{
+   if(m_fanout) {
+      m_fanout->GetStats(_stats);
+   }
+   else {
+      _stats.clear();
+   }
+}
+
+void HdhomerunTuner::GetRingStats(std::vector<TsRingPublisher::ReaderStats>& _stats)
+{
+   if(m_ring) {
+      m_ring->GetStats(_stats);
+   }
+   else {
+      _stats.clear();
+   }
 }
 
 bool CompareHdhomerunTuner(HdhomerunTuner* _tuner1, HdhomerunTuner* _tuner2)
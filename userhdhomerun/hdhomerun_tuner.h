@@ -22,14 +22,25 @@
 #ifndef _hdhomerun_tuner_h_
 #define _hdhomerun_tuner_h_
 
+#include "latency_histogram.h"
+#include "log_file.h"
+#include "pid_filter.h"
+#include "rtp_receiver.h"
+#include "stream_fanout.h"
+#include "stream_ring.h"
 #include "thread_pthread.h"
+#include "ts_ring_publisher.h"
 
 #include <hdhomerun.h>
+#include <pthread.h>
 
+#include <map>
 #include <string>
 #include <vector>
 #include <iostream>
 
+class ConfIniFile;
+
 class HdhomerunTuner : public ThreadPthread
 {
 public:
@@ -41,13 +52,59 @@ public:
          ATSC
       };
 
+   // Who asks for a tune or a PID. Each PID counts its users, the
+   // filter keeps it until the last one stops it.
+   enum User {
+      USER_DVB = 0,
+      USER_HTTP,
+      NUM_USERS
+   };
+
+   // Tune() while the other user streams from another frequency
+   enum {
+      TUNE_BUSY = -2
+   };
+
+   // Totals since the tuner was created, for MetricsServer
+   struct StreamStats {
+      bool streaming;
+      // Written to the data device
+      uint64_t bytes;
+      // From libhdhomerun's hdhomerun_video_stats_t, as of the last
+      // SampleStreamStats()
+      uint64_t packets;
+      uint64_t networkErrors;
+      uint64_t transportErrors;
+      uint64_t sequenceErrors;
+      uint64_t overflowErrors;
+      // The video socket, from /proc/net/udp as of the last
+      // SampleStreamStats(). Drops are the datagrams that didn't fit in
+      // its receive buffer.
+      uint64_t socketDrops;
+      uint32_t socketBuffer;
+      uint32_t socketQueued;
+      // Highest socketQueued seen by the last two SampleStreamStats()
+      uint32_t socketQueuedPeak;
+      // Upper bound of how long the packets of a batch waited in
+      // libhdhomerun and run() before reaching the data device
+      LatencyHistogram ingestLatency;
+      // stream_protocol=rtp, as of the last second
+      RtpReceiver::Stats rtp;
+   };
+
 public:
-   HdhomerunTuner(int _device_id, int _device_ip, int _tuner, struct hdhomerun_debug_t* _dbg);
+   // _conf is NULL when there is no ini file.
+   HdhomerunTuner(int _device_id, int _device_ip, int _tuner, const ConfIniFile* _conf, struct hdhomerun_debug_t* _dbg);
    ~HdhomerunTuner();
   
    void run();
 
-   int Tune(int _freq);
+   // As hdhomerun_device_set_tuner_channel(), 1 when tuned (or already
+   // there), 0 when rejected, -1 on errors and TUNE_BUSY
+   int Tune(int _freq, User _user);
+   // Tune() and StartStreaming() for each of _pids under one lock, the
+   // PIDs only when the tune succeeded
+   int TuneAndStream(int _freq, const std::vector<int>& _pids, User _user);
 
    int ReadStatus();
 
@@ -55,11 +112,53 @@ public:
 
    int SetPesFilter(int _pid, int _output, int _pes_type);
 
-   void StartStreaming(int _pid);
-   void StopStreaming(int _pid);
+   void StartStreaming(int _pid, User _user);
+   void StopStreaming(int _pid, User _user);
 
    const std::string& GetName();
 
+   uint32_t GetDeviceId() {
+      return m_deviceId;
+   }
+   uint32_t GetDeviceIP() {
+      return m_deviceIP;
+   }
+   int GetTunerIndex() {
+      return m_tuner;
+   }
+
+   // Point the tuner at the HDHomeRun's new address and restore the
+   // channel, filter and stream on it.
+   void SetDeviceIP(uint32_t _ip);
+
+   // Is the HDHomeRun still answering?
+   bool Probe();
+
+   // While offline every request is answered right away without
+   // talking to the HDHomeRun. The channel and PIDs asked for are
+   // kept and applied when the tuner comes back online.
+   void SetOffline();
+   void SetOnline();
+   bool IsOffline() {
+      return m_offline;
+   }
+
+   // Streaming for /dev/dvb or HTTP
+   bool IsStreaming() {
+      return m_stream;
+   }
+
+   // NULL unless http_port is set
+   StreamRing* GetStreamRing() {
+      return m_httpRing;
+   }
+
+   // Called once the kernel registered the tuner. A standby tuner is
+   // streaming for another userhdhomerun and is left alone until the
+   // kernel hands it over with its first request, the others get the
+   // initial pass-all filter now.
+   void SetStandby(bool _standby);
+
    void SetDataDeviceName(const std::string& _name);
 
    void SetKernelId(int _id) {
@@ -77,16 +176,50 @@ public:
       return m_isDisabled;
    }
 
+   // The HDHomeRun didn't answer while setting up the tuner.
+   bool InitFailed() {
+      return m_initFailed;
+   }
+
    Type GetType() {
       return m_type;
    }
 
+   // Adds what libhdhomerun counted since the last call, skipped while
+   // the device is busy, never waits for a tune. Samples the video
+   // socket too.
+   void SampleStreamStats();
+   StreamStats GetStreamStats();
+
+   // Empty without fanout
+   void GetFanoutStats(std::vector<StreamFanout::Stats>& _stats);
+   // Empty without shm_ring
+   void GetRingStats(std::vector<TsRingPublisher::ReaderStats>& _stats);
+
 private:
    void AddPidToFilter(int _pid);
    void RemovePidFromFilter(int _pid);
-   std::string GetStrFromPidFilter();
+   void UpdateDeviceFilter();
+   void Reconnect();
+   // First request after a standby tuner was handed over to us
+   void TakeOver();
+   // Another User than _user has PIDs
+   bool HeldByOther(User _user) const;
+   void SetInitialFilter();
+   // Creates the shm_ring once the kernel gave us the tuner, a standby
+   // one would replace the ring of the userhdhomerun that has it
+   void OpenRing();
+   // Sends the stream to libhdhomerun's video socket, or to m_rtp.
+   void StreamStart();
+   void StreamStop();
+   // libhdhomerun's counters, zeros with RTP
+   void GetVideoStats(struct hdhomerun_video_stats_t* _stats);
+   // Creates libhdhomerun's video socket if needed, sizes the receive
+   // buffer of the socket in use and notes its port for SampleSocket().
+   void SetupVideoSocket();
+   void SampleSocket();
 
-   void LogNetworkStat() const;
+   void LogNetworkStat();
 
 private:
    struct hdhomerun_device_t* m_device;
@@ -95,18 +228,45 @@ private:
   
    std::string m_pes_filter;
 
-   std::vector<int> m_pidFilters;
+   // PIDs requested by the demux and HTTP
+   PidFilter m_pidFilter;
+   bool m_passAll;
+   // Per PID a bit for each User that wants it, and the number of
+   // PIDs each User has. Guarded by m_mutexDevice.
+   std::map<int, unsigned int> m_pidUsers;
+   int m_userPids[NUM_USERS];
+
+   // What the HDHomeRun has been told to send. A superset of
+   // m_pidFilter when it needs more ranges than m_maxFilterRanges.
+   PidFilter m_devicePidFilter;
+   int m_maxFilterRanges;
+
+   // When the device filter is widened, run() drops the extra PIDs
+   // before they reach the data device.
+   PidFilter m_localPidFilter;
+   bool m_localFilter;
+   bool m_localFilterChanged;
+   pthread_mutex_t m_mutexLocalFilter;
 
    int m_prevFreq;
 
-   int m_deviceId;
-   int m_deviceIP;
+   uint32_t m_deviceId;
+   uint32_t m_deviceIP;
    int m_tuner;
 
+   bool m_offline;
+   // See SetStandby(), guarded by m_mutexDevice
+   bool m_standby;
+
+   // Serializes the calls on m_device between the control thread and
+   // the rediscovery thread. Recursive, Tune() calls ReadStatus().
+   pthread_mutex_t m_mutexDevice;
+
    int m_kernelId;
 
    bool m_useFullName;
    bool m_isDisabled;
+   bool m_initFailed;
 
    Type m_type;
 
@@ -119,6 +279,54 @@ private:
    // For network statistic. Is UDP packets dropped?
    struct hdhomerun_video_stats_t m_stats_old;
    struct hdhomerun_video_stats_t m_stats_cur;
+
+   StreamStats m_streamStats;
+   // libhdhomerun's counters at the last sample, they start over with
+   // every stream
+   struct hdhomerun_video_stats_t m_stats_sampled;
+   pthread_mutex_t m_mutexStats;
+
+   // recv_profile, an index into RECV_PROFILES
+   int m_recvProfile;
+
+   // busy_poll, us to spin after the last data, 0 sleeps instead
+   int m_busyPollUs;
+
+   // Each tuner logs its batch size and status now and then
+   LogRateLimit m_batchLogLimit;
+   LogRateLimit m_statusLogLimit;
+   LogRateLimit m_strengthLogLimit;
+
+   // stream_protocol=rtp. m_rtp is created on the first stream, run()
+   // reads it. m_rtpStart has its counters as of the stream start.
+   bool m_useRtp;
+   int m_rtpPort;
+   int m_rtpWindow;
+   int m_rtpHoldMs;
+   RtpReceiver* m_rtp;
+   RtpReceiver::Stats m_rtpStart;
+
+   // fanout, NULL when not set. Gets each batch before the local PID
+   // filter.
+   StreamFanout* m_fanout;
+
+   // shm_ring, NULL when not set or until the tuner is ours, see
+   // OpenRing(). Gets the same as m_fanout.
+   TsRingPublisher* m_ring;
+   size_t m_ringSize;
+
+   // For HttpStreamer, created with the tuner when http_port is set
+   StreamRing* m_httpRing;
+
+   // udp_rcvbuf, 0 leaves libhdhomerun's size
+   int m_rcvBuf;
+   // Below guarded by m_mutexStats
+   int m_videoPort;
+   uint64_t m_socketDropsSampled;
+   uint32_t m_socketPeak;
+   // For LogNetworkStat(), since the stream started
+   uint64_t m_socketDropsStart;
+   uint32_t m_socketPeakStream;
 };
 
 bool CompareHdhomerunTuner(HdhomerunTuner* _tuner1, HdhomerunTuner* _tuner2);
@@ -0,0 +1,693 @@
+/*
+ * http_streamer.cpp, tunes and streams TS over HTTP
+ *
+ * Copyright (C) 2010 Villy Thomsen <tfylliv@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include "http_streamer.h"
+
+#include "conf_inifile.h"
+#include "hdhomerun_controller.h"
+#include "hdhomerun_tuner.h"
+#include "log_file.h"
+#include "pid_filter.h"
+#include "stream_ring.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <sstream>
+
+using namespace std;
+
+static const int DEFAULT_MAX_CLIENTS = 8;
+
+// A client gets this long to send its request
+static const int REQUEST_TIMEOUT = 2;
+
+// What a client can have in flight beyond its position in the ring.
+// The pages in the pipe and the socket's send buffer are the ring's
+// own, not copies, so the client is cut off well before the tuner
+// gets around to them.
+static const int CLIENT_PIPE_SIZE = 512 * 1024;
+static const int CLIENT_SNDBUF = 256 * 1024;
+
+// How long the sending loop sleeps at most before looking at the lag
+static const int CLIENT_WAIT_MS = 100;
+
+// True for a client on this host. Its connection goes over loopback,
+// where what we send lands in the client's receive queue as is.
+static bool IsSameHost(int _fd)
+{
+   struct sockaddr_in local;
+   struct sockaddr_in peer;
+   socklen_t localLen = sizeof(local);
+   socklen_t peerLen = sizeof(peer);
+   if(getsockname(_fd, (struct sockaddr*)&local, &localLen) != 0 ||
+      getpeername(_fd, (struct sockaddr*)&peer, &peerLen) != 0) {
+      return false;
+   }
+   return peer.sin_addr.s_addr == local.sin_addr.s_addr ||
+          (ntohl(peer.sin_addr.s_addr) >> 24) == IN_LOOPBACKNET;
+}
+
+static uint64_t MonotonicUs()
+{
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+//
+// A client, from reading its request to the end of the stream
+//
+class HttpStreamer::Client : public ThreadPthread
+{
+public:
+   Client(HttpStreamer* _streamer, int _fd, const std::string& _peer)
+      : m_streamer(_streamer), m_fd(_fd), m_peer(_peer), m_tuner(-1),
+        m_started(time(NULL)), m_bytes(0), m_lag(0)
+   {
+   }
+   ~Client() {
+      if(m_fd >= 0) {
+         close(m_fd);
+      }
+   }
+
+   void run();
+
+   ClientStats GetStats() const {
+      ClientStats stats;
+      stats.peer = m_peer;
+      stats.tuner = m_tuner;
+      stats.tunerName = m_tunerName;
+      stats.started = m_started;
+      stats.bytes = m_bytes;
+      stats.lag = m_lag;
+      return stats;
+   }
+
+private:
+   void Serve();
+   bool ReadRequest(std::string& _request);
+   // 0 or the HTTP status to answer with
+   int ParseRequest(const std::string& _request, int& _freq, std::vector<int>& _pids);
+   bool SendAll(const std::string& _data);
+   void SendStatus(int _status);
+   // Until the client goes away, falls behind or we stop. True when
+   // it fell behind.
+   bool Stream(StreamRing* _ring);
+
+private:
+   HttpStreamer* m_streamer;
+   int m_fd;
+   std::string m_peer;
+
+   // Set once, before the client is streaming. m_tunerName under
+   // m_streamer->m_mutexClients, GetStats() is called with it held.
+   volatile int m_tuner;
+   std::string m_tunerName;
+   time_t m_started;
+
+   volatile uint64_t m_bytes;
+   volatile uint64_t m_lag;
+};
+
+static const char* StatusText(int _status)
+{
+   switch(_status) {
+   case 200: return "OK";
+   case 400: return "Bad Request";
+   case 404: return "Not Found";
+   case 503: return "Service Unavailable";
+   default: return "Error";
+   }
+}
+
+void HttpStreamer::Client::run()
+{
+   Serve();
+
+   // The client sees the end now, not when HttpStreamer gets around
+   // to joining us
+   close(m_fd);
+   m_fd = -1;
+}
+
+void HttpStreamer::Client::Serve()
+{
+   string request;
+   if(!ReadRequest(request)) {
+      return;
+   }
+
+   int freq = 0;
+   vector<int> pids;
+   int status = ParseRequest(request, freq, pids);
+
+   HdhomerunTuner* tuner = NULL;
+   if(status == 0) {
+      tuner = m_streamer->m_controller->GetTuner(m_tuner);
+      if(!tuner) {
+         status = 404;
+      }
+      else if(!tuner->GetStreamRing()) {
+         status = 503;
+      }
+   }
+   if(status == 0) {
+      {
+         MutexLocker lock(&m_streamer->m_mutexClients);
+         m_tunerName = tuner->GetName();
+      }
+      status = m_streamer->Acquire(tuner, freq, pids);
+   }
+   if(status != 0) {
+      LOG() << "HTTP " << m_peer << ": " << status << " " << StatusText(status) << endl;
+      SendStatus(status);
+      return;
+   }
+
+   LOG() << "HTTP " << m_peer << " streaming " << m_tunerName << " at " << freq << endl;
+
+   bool slow = false;
+   ostringstream headers;
+   headers << "HTTP/1.0 200 OK\r\n"
+           << "Content-Type: video/mp2t\r\n"
+           << "Cache-Control: no-cache\r\n"
+           << "Connection: close\r\n\r\n";
+   if(SendAll(headers.str())) {
+      slow = Stream(tuner->GetStreamRing());
+   }
+
+   m_streamer->Release(tuner, pids);
+
+   if(slow) {
+      __sync_fetch_and_add(&m_streamer->m_slowDisconnects, 1);
+   }
+   LOG() << "HTTP " << m_peer << " done with " << m_tunerName << (slow ? ", too slow" : "")
+         << ", " << m_bytes << " bytes in " << time(NULL) - m_started << " s" << endl;
+}
+
+bool HttpStreamer::Client::ReadRequest(std::string& _request)
+{
+   struct timeval timeout;
+   timeout.tv_sec = REQUEST_TIMEOUT;
+   timeout.tv_usec = 0;
+   setsockopt(m_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+   setsockopt(m_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+   char buf[1024];
+   while(_request.find("\r\n\r\n") == string::npos && _request.find("\n\n") == string::npos) {
+      if(_request.size() >= 8192) {
+         return false;
+      }
+      ssize_t r = recv(m_fd, buf, sizeof(buf), 0);
+      if(r <= 0) {
+         return false;
+      }
+      _request.append(buf, r);
+   }
+   return true;
+}
+
+int HttpStreamer::Client::ParseRequest(const std::string& _request, int& _freq, std::vector<int>& _pids)
+{
+   istringstream line(_request.substr(0, _request.find('\n')));
+   string method;
+   string target;
+   line >> method >> target;
+   if(method != "GET") {
+      return 400;
+   }
+
+   static const string prefix("/tuner/");
+   if(target.compare(0, prefix.size(), prefix) != 0) {
+      return 404;
+   }
+   char* end;
+   const char* id = target.c_str() + prefix.size();
+   long tuner = strtol(id, &end, 10);
+   if(end == id || (*end != '\0' && *end != '?') || tuner < 0) {
+      return 404;
+   }
+   m_tuner = tuner;
+
+   // The whole TS unless asked otherwise
+   bool havePids = false;
+   istringstream query(*end == '?' ? end + 1 : "");
+   string param;
+   while(getline(query, param, '&')) {
+      size_t equals = param.find('=');
+      string key = param.substr(0, equals);
+      string value = equals == string::npos ? "" : param.substr(equals + 1);
+
+      if(key == "freq") {
+         _freq = strtol(value.c_str(), &end, 10);
+         if(*end != '\0' || _freq <= 0) {
+            return 400;
+         }
+      }
+      else if(key == "pids") {
+         havePids = true;
+         // Commas might come percent-encoded
+         size_t encoded;
+         while((encoded = value.find("%2C")) != string::npos || (encoded = value.find("%2c")) != string::npos) {
+            value.replace(encoded, 3, ",");
+         }
+         istringstream list(value);
+         string pid;
+         while(getline(list, pid, ',')) {
+            if(pid == "all") {
+               _pids.push_back(PidFilter::PASS_ALL);
+               continue;
+            }
+            long p = strtol(pid.c_str(), &end, 0);
+            if(pid.empty() || *end != '\0' || p < 0 || p >= PidFilter::NUM_PIDS) {
+               return 400;
+            }
+            _pids.push_back(p);
+         }
+      }
+   }
+
+   if(_freq <= 0) {
+      return 400;
+   }
+   if(!havePids || _pids.empty()) {
+      _pids.assign(1, PidFilter::PASS_ALL);
+   }
+
+   // A PID asked for twice is still one reference
+   sort(_pids.begin(), _pids.end());
+   _pids.erase(unique(_pids.begin(), _pids.end()), _pids.end());
+   return 0;
+}
+
+bool HttpStreamer::Client::SendAll(const std::string& _data)
+{
+   size_t sent = 0;
+   while(sent < _data.size()) {
+      ssize_t r = send(m_fd, _data.data() + sent, _data.size() - sent, MSG_NOSIGNAL);
+      if(r <= 0) {
+         return false;
+      }
+      sent += r;
+   }
+   return true;
+}
+
+void HttpStreamer::Client::SendStatus(int _status)
+{
+   ostringstream response;
+   response << "HTTP/1.0 " << _status << " " << StatusText(_status) << "\r\n"
+            << "Content-Type: text/plain\r\n"
+            << "Connection: close\r\n\r\n"
+            << _status << " " << StatusText(_status) << "\n";
+   SendAll(response.str());
+}
+
+bool HttpStreamer::Client::Stream(StreamRing* _ring)
+{
+   int pipeFds[2];
+   if(pipe2(pipeFds, O_NONBLOCK | O_CLOEXEC) != 0) {
+      ERR() << "HTTP " << m_peer << ": couldn't create a pipe: " << strerror(errno) << endl;
+      return false;
+   }
+   fcntl(pipeFds[1], F_SETPIPE_SZ, CLIENT_PIPE_SIZE);
+   int pipeSize = fcntl(pipeFds[1], F_GETPIPE_SZ);
+
+   int sndBuf = CLIENT_SNDBUF;
+   setsockopt(m_fd, SOL_SOCKET, SO_SNDBUF, &sndBuf, sizeof(sndBuf));
+   fcntl(m_fd, F_SETFL, fcntl(m_fd, F_GETFL) | O_NONBLOCK);
+
+   // The client's receive queue would hold on to the ring's pages as
+   // well, as much as its receive buffer takes. That isn't ours to
+   // bound, so a client on this host gets copies instead.
+   bool copy = IsSameHost(m_fd);
+
+   // Start with the newest data
+   uint64_t pos = _ring->GetHead();
+   size_t inPipe = 0;
+   bool slow = false;
+   // The tuner's rate, measured over a second at a time, in bytes per
+   // CLIENT_WAIT_MS
+   uint64_t rateHead = pos;
+   uint64_t rateTime = MonotonicUs();
+   int64_t waitBytes = 0;
+   while(!isStopping()) {
+      //
+      // The oldest byte the pipe or the socket may still point at has
+      // to stay clear of the next write to the ring, and of whatever
+      // the tuner writes while we sleep before looking again. The
+      // kernel doubles SO_SNDBUF.
+      //
+      uint64_t head = _ring->GetHead();
+      uint64_t now = MonotonicUs();
+      if(now - rateTime >= 1000000) {
+         waitBytes = (int64_t)((head - rateHead) * CLIENT_WAIT_MS * 1000 / (now - rateTime));
+         rateHead = head;
+         rateTime = now;
+      }
+      int64_t safeLag = (int64_t)_ring->GetSize() - pipeSize - 2 * CLIENT_SNDBUF - (int64_t)_ring->GetMaxWrite() - waitBytes;
+      m_lag = head - pos;
+      if((int64_t)(head - (pos - inPipe)) > safeLag) {
+         slow = true;
+         break;
+      }
+
+      bool waitSocket = false;
+      if(copy) {
+         if(pos < head) {
+            struct iovec iov[2];
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = _ring->GetIov(pos, min((uint64_t)CLIENT_SNDBUF, head - pos), iov);
+            ssize_t r = sendmsg(m_fd, &msg, MSG_NOSIGNAL);
+            if(r > 0) {
+               pos += r;
+               __sync_fetch_and_add(&m_bytes, r);
+               continue;
+            }
+            if(r < 0 && errno != EAGAIN) {
+               // The client went away
+               break;
+            }
+            waitSocket = true;
+         }
+      }
+      else {
+         if(pos < head && inPipe < (size_t)pipeSize) {
+            struct iovec iov[2];
+            size_t size = min((uint64_t)(pipeSize - inPipe), head - pos);
+            int count = _ring->GetIov(pos, size, iov);
+            ssize_t r = vmsplice(pipeFds[1], iov, count, SPLICE_F_NONBLOCK);
+            if(r > 0) {
+               pos += r;
+               inPipe += r;
+            }
+            else if(r < 0 && errno != EAGAIN) {
+               ERR() << "HTTP " << m_peer << ": vmsplice failed: " << strerror(errno) << endl;
+               break;
+            }
+         }
+
+         if(inPipe > 0) {
+            ssize_t r = splice(pipeFds[0], NULL, m_fd, NULL, inPipe, SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE);
+            if(r > 0) {
+               inPipe -= r;
+               __sync_fetch_and_add(&m_bytes, r);
+               continue;
+            }
+            if(r < 0 && errno != EAGAIN) {
+               // The client went away
+               break;
+            }
+            waitSocket = true;
+         }
+      }
+
+      if(waitSocket) {
+         struct pollfd pfd;
+         pfd.fd = m_fd;
+         pfd.events = POLLOUT;
+         poll(&pfd, 1, CLIENT_WAIT_MS);
+         if(pfd.revents & (POLLERR | POLLHUP)) {
+            break;
+         }
+      }
+      else {
+         _ring->WaitForData(pos, CLIENT_WAIT_MS);
+      }
+   }
+
+   close(pipeFds[0]);
+   close(pipeFds[1]);
+   return slow;
+}
+
+//
+// HttpStreamer
+//
+HttpStreamer::HttpStreamer(HdhomerunController* _controller, const ConfIniFile* _conf)
+   : m_controller(_controller), m_address("127.0.0.1"), m_port(0), m_maxClients(DEFAULT_MAX_CLIENTS),
+     m_listenFd(-1), m_slowDisconnects(0)
+{
+   pfd[0] = pfd[1] = -1;
+   pthread_mutex_init(&m_mutexClients, NULL);
+   pthread_mutex_init(&m_mutexSessions, NULL);
+
+   if(!_conf) {
+      return;
+   }
+
+   string value;
+   if(_conf->GetSecValue("userhdhomerun", "http_port", value)) {
+      m_port = atoi(value.c_str());
+   }
+   _conf->GetSecValue("userhdhomerun", "http_address", m_address);
+   if(_conf->GetSecValue("userhdhomerun", "http_max_clients", value) && atoi(value.c_str()) > 0) {
+      m_maxClients = atoi(value.c_str());
+   }
+}
+
+HttpStreamer::~HttpStreamer()
+{
+   Reap(true);
+   if(m_listenFd >= 0) {
+      close(m_listenFd);
+   }
+   if(pfd[0] >= 0) {
+      close(pfd[0]);
+   }
+   pthread_mutex_destroy(&m_mutexClients);
+   pthread_mutex_destroy(&m_mutexSessions);
+}
+
+bool HttpStreamer::Listen()
+{
+   if(m_port <= 0) {
+      return false;
+   }
+
+   struct sockaddr_in addr;
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_port = htons(m_port);
+   if(inet_pton(AF_INET, m_address.c_str(), &addr.sin_addr) != 1) {
+      ERR() << "Invalid http_address: " << m_address << endl;
+      return false;
+   }
+
+   m_listenFd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+   int on = 1;
+   setsockopt(m_listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+   if(m_listenFd < 0 || bind(m_listenFd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(m_listenFd, 8) < 0) {
+      ERR() << "Couldn't stream HTTP on " << m_address << ":" << m_port << ": " << strerror(errno) << endl;
+      if(m_listenFd >= 0) {
+         close(m_listenFd);
+         m_listenFd = -1;
+      }
+      return false;
+   }
+
+   if(pipe(pfd) == -1) {
+      ERR() << "Could not create a pipe" << endl;
+      return false;
+   }
+
+   LOG() << "Streaming HTTP on " << m_address << ":" << m_port << endl;
+   return true;
+}
+
+void HttpStreamer::run()
+{
+   char buf[8];
+
+   while(!isStopping()) {
+      struct pollfd fds[2];
+      fds[0].fd = pfd[0];
+      fds[0].events = POLLIN;
+      fds[1].fd = m_listenFd;
+      fds[1].events = POLLIN;
+
+      // Wakes up now and then to join the clients that are done
+      int r = poll(fds, 2, 1000);
+      if(r == -1 && errno != EINTR) {
+         ERR() << "poll() failure in HTTP streamer" << endl;
+         break;
+      }
+
+      Reap(false);
+
+      if(r > 0 && (fds[0].revents & POLLIN) && read(pfd[0], buf, sizeof(buf)) == 0) {
+         break;
+      }
+      if(r <= 0 || !(fds[1].revents & POLLIN)) {
+         continue;
+      }
+
+      struct sockaddr_in addr;
+      socklen_t addrLen = sizeof(addr);
+      int fd = accept4(m_listenFd, (struct sockaddr*)&addr, &addrLen, SOCK_CLOEXEC);
+      if(fd < 0) {
+         continue;
+      }
+
+      char ip[INET_ADDRSTRLEN];
+      inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
+      ostringstream peer;
+      peer << ip << ":" << ntohs(addr.sin_port);
+
+      MutexLocker lock(&m_mutexClients);
+      if((int)m_clients.size() >= m_maxClients) {
+         ERR() << "HTTP " << peer.str() << ": already " << m_clients.size() << " clients" << endl;
+         static const char busy[] = "HTTP/1.0 503 Service Unavailable\r\nConnection: close\r\n\r\n";
+         send(fd, busy, sizeof(busy) - 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+         close(fd);
+         continue;
+      }
+
+      Client* client = new Client(this, fd, peer.str());
+      m_clients.push_back(client);
+      client->start();
+   }
+}
+
+void HttpStreamer::pre_stop()
+{
+   if(pfd[1] >= 0) {
+      close(pfd[1]);
+      pfd[1] = -1;
+   }
+}
+
+void HttpStreamer::Reap(bool _all)
+{
+   list<Client*> done;
+   {
+      MutexLocker lock(&m_mutexClients);
+      list<Client*>::iterator it = m_clients.begin();
+      while(it != m_clients.end()) {
+         if(_all || (*it)->isFinished()) {
+            done.push_back(*it);
+            it = m_clients.erase(it);
+         }
+         else {
+            ++it;
+         }
+      }
+   }
+
+   // Stopping a client waits for it to leave its tuner
+   list<Client*>::iterator it;
+   for(it = done.begin(); it != done.end(); ++it) {
+      (*it)->stop();
+      delete *it;
+   }
+}
+
+int HttpStreamer::Acquire(HdhomerunTuner* _tuner, int _freq, const std::vector<int>& _pids)
+{
+   MutexLocker lock(&m_mutexSessions);
+
+   if(_tuner->IsDisabled() || _tuner->IsOffline()) {
+      return 503;
+   }
+
+   map<HdhomerunTuner*, Session>::iterator it = m_sessions.find(_tuner);
+   if(it == m_sessions.end()) {
+      // Fails with TUNE_BUSY while /dev/dvb streams from another
+      // frequency, at the same one we share its stream. /dev/dvb can't
+      // retune before the PIDs are in.
+      if(_tuner->TuneAndStream(_freq, _pids, HdhomerunTuner::USER_HTTP) <= 0) {
+         return 503;
+      }
+      Session session;
+      session.freq = _freq;
+      session.clients = 1;
+      vector<int>::const_iterator pid;
+      for(pid = _pids.begin(); pid != _pids.end(); ++pid) {
+         session.pids[*pid]++;
+      }
+      m_sessions.insert(make_pair(_tuner, session));
+      return 0;
+   }
+   if(it->second.freq != _freq) {
+      return 503;
+   }
+
+   // Our PIDs keep /dev/dvb from retuning
+   Session& session = it->second;
+   session.clients++;
+   vector<int>::const_iterator pid;
+   for(pid = _pids.begin(); pid != _pids.end(); ++pid) {
+      if(session.pids[*pid]++ == 0) {
+         _tuner->StartStreaming(*pid, HdhomerunTuner::USER_HTTP);
+      }
+   }
+   return 0;
+}
+
+void HttpStreamer::Release(HdhomerunTuner* _tuner, const std::vector<int>& _pids)
+{
+   MutexLocker lock(&m_mutexSessions);
+
+   map<HdhomerunTuner*, Session>::iterator it = m_sessions.find(_tuner);
+   if(it == m_sessions.end()) {
+      return;
+   }
+
+   Session& session = it->second;
+   vector<int>::const_iterator pid;
+   for(pid = _pids.begin(); pid != _pids.end(); ++pid) {
+      if(--session.pids[*pid] == 0) {
+         session.pids.erase(*pid);
+         _tuner->StopStreaming(*pid, HdhomerunTuner::USER_HTTP);
+      }
+   }
+   if(--session.clients == 0) {
+      m_sessions.erase(it);
+   }
+}
+
+void HttpStreamer::GetClientStats(std::vector<ClientStats>& _stats)
+{
+   _stats.clear();
+   MutexLocker lock(&m_mutexClients);
+   list<Client*>::iterator it;
+   for(it = m_clients.begin(); it != m_clients.end(); ++it) {
+      // Still reading its request
+      if((*it)->GetStats().tunerName.empty()) {
+         continue;
+      }
+      _stats.push_back((*it)->GetStats());
+   }
+}
@@ -0,0 +1,111 @@
+/*
+ * http_streamer.h, tunes and streams TS over HTTP
+ *
+ * Copyright (C) 2010 Villy Thomsen <tfylliv@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef _http_streamer_h_
+#define _http_streamer_h_
+
+#include "thread_pthread.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+class ConfIniFile;
+class HdhomerunController;
+class HdhomerunTuner;
+
+// Answers GET /tuner/<kernel id>?freq=<Hz>&pids=<pid,pid,...|all> on
+// http_address:http_port with the TS of that tuner. The request is
+// read, the tuner tuned and the stream sent on a thread per client,
+// this thread only accepts. Clients asking for the same frequency
+// share the tuner and get all PIDs any of them asked for, with
+// /dev/dvb too; a tuner streaming at another frequency answers 503.
+class HttpStreamer : public ThreadPthread
+{
+public:
+   struct ClientStats {
+      std::string peer;
+      int tuner;
+      std::string tunerName;
+      time_t started;
+      uint64_t bytes;
+      // Bytes behind the tuner
+      uint64_t lag;
+   };
+
+   HttpStreamer(HdhomerunController* _controller, const ConfIniFile* _conf);
+   ~HttpStreamer();
+
+   // False when http_port isn't set or can't be listened on
+   bool Listen();
+
+   void run();
+   void pre_stop();
+
+   void GetClientStats(std::vector<ClientStats>& _stats);
+   uint64_t GetSlowDisconnects() const {
+      return m_slowDisconnects;
+   }
+
+private:
+   class Client;
+
+   // The frequency and PIDs the clients of a tuner asked for, a PID
+   // stays in the tuner's filter until its last client leaves
+   struct Session {
+      int freq;
+      int clients;
+      std::map<int, int> pids;
+   };
+
+   // 0 or the HTTP status to answer with
+   int Acquire(HdhomerunTuner* _tuner, int _freq, const std::vector<int>& _pids);
+   void Release(HdhomerunTuner* _tuner, const std::vector<int>& _pids);
+
+   // Joins the clients that are done, all of them with _all
+   void Reap(bool _all);
+
+private:
+   HdhomerunController* m_controller;
+
+   std::string m_address;
+   int m_port;
+   int m_maxClients;
+
+   int m_listenFd;
+   int pfd[2];
+
+   pthread_mutex_t m_mutexClients;
+   std::list<Client*> m_clients;
+   // Held while tuning, apart from m_mutexClients so the metrics
+   // don't wait for a tune
+   pthread_mutex_t m_mutexSessions;
+   std::map<HdhomerunTuner*, Session> m_sessions;
+
+   volatile uint64_t m_slowDisconnects;
+};
+
+#endif // _http_streamer_h_
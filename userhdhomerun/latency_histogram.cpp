@@ -0,0 +1,71 @@
+/*
+ * latency_histogram.cpp, log2 latency histogram for the statistics
+ *
+ * Copyright (C) 2010 Villy Thomsen <tfylliv@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include "latency_histogram.h"
+
+#include <cstring>
+#include <sstream>
+
+using namespace std;
+
+LatencyHistogram::LatencyHistogram()
+   : m_count(0), m_sum(0)
+{
+   memset(m_buckets, 0, sizeof(m_buckets));
+}
+
+void LatencyHistogram::Add(uint64_t _us)
+{
+   m_sum += _us;
+
+   // Number of significant bits, like fls64() in the kernel
+   int bucket = 0;
+   while(_us != 0 && bucket < NUM_BUCKETS - 1) {
+      _us >>= 1;
+      ++bucket;
+   }
+
+   m_buckets[bucket]++;
+   m_count++;
+}
+
+void LatencyHistogram::AddNs(uint64_t _from, uint64_t _to)
+{
+   if(_from == 0 || _to < _from) {
+      return;
+   }
+   Add((_to - _from) / 1000);
+}
+
+string LatencyHistogram::ToString() const
+{
+   ostringstream str;
+   for(int i = 0; i < NUM_BUCKETS; ++i) {
+      if(m_buckets[i] == 0) {
+         continue;
+      }
+      if(str.tellp() > 0) {
+         str << " ";
+      }
+      str << (1UL << i) << ":" << m_buckets[i];
+   }
+   return str.str();
+}
@@ -0,0 +1,58 @@
+/*
+ * latency_histogram.h, log2 latency histogram for the statistics
+ *
+ * Copyright (C) 2010 Villy Thomsen <tfylliv@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef _latency_histogram_h_
+#define _latency_histogram_h_
+
+#include <stdint.h>
+
+#include <string>
+
+// Bucket n counts the samples below 2^n us, the same buckets as
+// /sys/kernel/debug/dvb_hdhomerun/latency. Not thread safe.
+class LatencyHistogram
+{
+public:
+   enum {
+      NUM_BUCKETS = 32
+   };
+
+   LatencyHistogram();
+
+   void Add(uint64_t _us);
+   // From two CLOCK_MONOTONIC ns timestamps, skipped if one is missing
+   void AddNs(uint64_t _from, uint64_t _to);
+
+   unsigned long Count() const { return m_count; }
+   uint64_t Sum() const { return m_sum; }
+   unsigned long Bucket(int _bucket) const { return m_buckets[_bucket]; }
+
+   // "<upper bound us>:<count> ..." for the buckets in use
+   std::string ToString() const;
+
+private:
+   unsigned long m_buckets[NUM_BUCKETS];
+   unsigned long m_count;
+   // Of the samples, in us
+   uint64_t m_sum;
+};
+
+#endif // _latency_histogram_h_
@@ -20,30 +20,76 @@
  */
 
 #include "log_file.h"
+#include "thread_sched.h"
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <cstdlib>
+#include <cstring>
 #include <ctime>
 #include <iostream>
+#include <sstream>
 
 using namespace std;
 
 LogFile logFile;
 
 LogFile::LogFile()
-   : ostream(this), m_logTo(LogFile::NONE), m_disabled(false)
+   : ostream(this), m_logTo(LogFile::NONE), m_fd(-1), m_fileDev(0), m_fileIno(0),
+     m_lastRotateCheck(0), m_disabled(false), m_level(LEVEL_INFO), m_async(false), m_writerTid(0),
+     m_stopWriter(false), m_reopen(0), m_writerSleeping(0), m_writing(0), m_rings(NULL),
+     m_droppedOrphaned(0), m_droppedReported(0)
 {
    // Initialize the mutex
-   if(pthread_mutex_init(&m_mutexLogFile, NULL))
+   if(pthread_mutex_init(&m_mutexLogFile, NULL) ||
+      pthread_mutex_init(&m_mutexRings, NULL) ||
+      pthread_cond_init(&m_condWriter, NULL))
    {
       cerr << "Can't initialize mutex" << endl;
       exit(-1);
    }
+
+   if(pthread_key_create(&m_keyBuffer, &LogFile::DeleteThreadBuffer))
+   {
+      cerr << "Can't create thread key" << endl;
+      exit(-1);
+   }
 }
 
 LogFile::~LogFile()
 {
-   m_logFile.close();
+   StopWriter();
+   if(m_fd >= 0) {
+      close(m_fd);
+   }
+}
+
+LogFile::ThreadBuffer& LogFile::GetThreadBuffer()
+{
+   ThreadBuffer* buffer = static_cast<ThreadBuffer*>(pthread_getspecific(m_keyBuffer));
+   if(buffer == NULL) {
+      buffer = new ThreadBuffer;
+      buffer->ring = NULL;
+      buffer->stampTime = 0;
+      buffer->stamp[0] = '\0';
+      pthread_setspecific(m_keyBuffer, buffer);
+   }
+   return *buffer;
+}
+
+void LogFile::DeleteThreadBuffer(void* _buffer)
+{
+   ThreadBuffer* buffer = static_cast<ThreadBuffer*>(_buffer);
+   if(buffer->ring != NULL) {
+      // The lines pushed so far before the flag
+      __sync_synchronize();
+      buffer->ring->orphaned = true;
+   }
+   delete buffer;
 }
 
 void LogFile::SetLogType(LogFile::LogType _type)
@@ -56,17 +102,311 @@ void LogFile::DisableLogging()
    m_disabled = true;
 }
 
+void LogFile::SetLevel(LogFile::LogLevel _level)
+{
+   m_level = _level;
+}
+
+bool LogFile::SetLevel(const std::string& _level)
+{
+   if(_level == "error") {
+      SetLevel(LEVEL_ERROR);
+   }
+   else if(_level == "info") {
+      SetLevel(LEVEL_INFO);
+   }
+   else if(_level == "debug") {
+      SetLevel(LEVEL_DEBUG);
+   }
+   else {
+      return false;
+   }
+   return true;
+}
+
 bool LogFile::SetAndOpenLogFile(const std::string& _fileName)
 {
+   pthread_mutex_lock(&m_mutexLogFile);
    m_logFileName = _fileName;
+   OpenLogFile();
+   bool ret = m_fd >= 0;
+   pthread_mutex_unlock(&m_mutexLogFile);
+   return ret;
+}
 
-   bool ret = false;
-   m_logFile.open(m_logFileName.c_str(), ios::out | ios::app);
-   if(m_logFile.is_open())
-   {
-      ret = true;
+void LogFile::OpenLogFile()
+{
+   if(m_fd >= 0) {
+      close(m_fd);
    }
-   return ret;
+
+   m_fd = open(m_logFileName.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0666);
+   if(m_fd < 0) {
+      cerr << "Can't reopen log file!! " << m_logFileName << endl;
+      return;
+   }
+
+   struct stat st;
+   if(fstat(m_fd, &st) == 0) {
+      m_fileDev = st.st_dev;
+      m_fileIno = st.st_ino;
+   }
+   m_lastRotateCheck = time(NULL);
+}
+
+void LogFile::CheckRotated()
+{
+   // Logrotate moves files at xx:yy (unlink actually), we keep
+   // writing to the old one until we notice. Once a second is enough.
+   time_t now = time(NULL);
+   if(m_fd >= 0 && now == m_lastRotateCheck) {
+      return;
+   }
+   m_lastRotateCheck = now;
+
+   struct stat st;
+   if(m_fd < 0 || stat(m_logFileName.c_str(), &st) != 0 ||
+      st.st_dev != m_fileDev || st.st_ino != m_fileIno) {
+      OpenLogFile();
+   }
+}
+
+void LogFile::Write(const std::string& _lines)
+{
+   pthread_mutex_lock(&m_mutexLogFile);
+   if (m_logTo & LogFile::COUT) {
+      cout << _lines;
+   }
+
+   if (m_logTo & LogFile::FILE) {
+      CheckRotated();
+
+      size_t written = 0;
+      while(m_fd >= 0 && written < _lines.size()) {
+         ssize_t ret = ::write(m_fd, _lines.data() + written, _lines.size() - written);
+         if(ret < 0 && errno == EINTR) {
+            continue;
+         }
+         if(ret <= 0) {
+            break;
+         }
+         written += ret;
+      }
+   }
+   pthread_mutex_unlock(&m_mutexLogFile);
+}
+
+void LogFile::Reopen()
+{
+   if(m_async) {
+      m_reopen = 1;
+      WakeWriter();
+      return;
+   }
+
+   pthread_mutex_lock(&m_mutexLogFile);
+   if(!m_logFileName.empty()) {
+      OpenLogFile();
+   }
+   pthread_mutex_unlock(&m_mutexLogFile);
+}
+
+bool LogFile::StartWriter()
+{
+   if(m_async) {
+      return true;
+   }
+
+   m_stopWriter = false;
+   if(pthread_create(&m_writer, NULL, &LogFile::WriterEntry, this)) {
+      cerr << "Can't start the log writer" << endl;
+      return false;
+   }
+   m_async = true;
+   return true;
+}
+
+void LogFile::StopWriter()
+{
+   if(!m_async) {
+      return;
+   }
+
+   // New lines are written right away from here on
+   m_async = false;
+   __sync_synchronize();
+
+   pthread_mutex_lock(&m_mutexRings);
+   m_stopWriter = true;
+   pthread_cond_signal(&m_condWriter);
+   pthread_mutex_unlock(&m_mutexRings);
+   pthread_join(m_writer, NULL);
+   m_writerTid = 0;
+
+   // Pushed while we were stopping
+   string batch;
+   Drain(batch);
+   if(!batch.empty()) {
+      Write(batch);
+   }
+}
+
+void LogFile::Flush()
+{
+   for(int i = 0; i < 1000 && m_async; ++i) {
+      pthread_mutex_lock(&m_mutexRings);
+      bool empty = RingsEmpty();
+      pthread_mutex_unlock(&m_mutexRings);
+      if(empty && !m_writing) {
+         return;
+      }
+      WakeWriter();
+      usleep(1000);
+   }
+}
+
+unsigned long LogFile::GetDroppedLines()
+{
+   pthread_mutex_lock(&m_mutexRings);
+   unsigned long dropped = m_droppedOrphaned;
+   for(LineRing* ring = m_rings; ring != NULL; ring = ring->next) {
+      dropped += ring->dropped;
+   }
+   pthread_mutex_unlock(&m_mutexRings);
+   return dropped;
+}
+
+pid_t LogFile::GetWriterTid()
+{
+   // Set by the writer once it runs
+   for(int i = 0; i < 1000 && m_async && !m_writerTid; ++i) {
+      usleep(1000);
+   }
+   return m_async ? m_writerTid : 0;
+}
+
+void LogFile::WakeWriter()
+{
+   // Only the first line after the writer went to sleep takes the lock
+   if(m_writerSleeping && __sync_bool_compare_and_swap(&m_writerSleeping, 1, 0)) {
+      pthread_mutex_lock(&m_mutexRings);
+      pthread_cond_signal(&m_condWriter);
+      pthread_mutex_unlock(&m_mutexRings);
+   }
+}
+
+void* LogFile::WriterEntry(void* _ptr)
+{
+   LogFile* log = static_cast<LogFile*>(_ptr);
+   log->m_writerTid = ThreadSched::GetTid();
+   log->WriterLoop();
+   return NULL;
+}
+
+void LogFile::WriterLoop()
+{
+   string batch;
+
+   while(true) {
+      bool stopping = m_stopWriter;
+
+      m_writing = 1;
+      __sync_synchronize();
+      Drain(batch);
+
+      unsigned long dropped = GetDroppedLines();
+      if(dropped != m_droppedReported) {
+         time_t now = time(NULL);
+         char stamp[26];
+         ctime_r(&now, stamp);
+         ostringstream line;
+         line << string(stamp, strlen(stamp) - 1) << " Log buffer full, dropped "
+              << dropped - m_droppedReported << " lines" << "\n";
+         batch += line.str();
+         m_droppedReported = dropped;
+      }
+
+      if(m_reopen) {
+         m_reopen = 0;
+         pthread_mutex_lock(&m_mutexLogFile);
+         if(!m_logFileName.empty()) {
+            OpenLogFile();
+         }
+         pthread_mutex_unlock(&m_mutexLogFile);
+      }
+
+      if(!batch.empty()) {
+         Write(batch);
+         batch.clear();
+      }
+      m_writing = 0;
+
+      if(stopping) {
+         break;
+      }
+
+      // Sleep until a thread pushes a line into an empty ring. The
+      // timeout picks up a rotated log file when nothing is logged.
+      pthread_mutex_lock(&m_mutexRings);
+      m_writerSleeping = 1;
+      __sync_synchronize();
+      if(RingsEmpty() && !m_stopWriter && !m_reopen) {
+         struct timespec deadline;
+         clock_gettime(CLOCK_REALTIME, &deadline);
+         deadline.tv_sec += 1;
+         pthread_cond_timedwait(&m_condWriter, &m_mutexRings, &deadline);
+      }
+      m_writerSleeping = 0;
+      pthread_mutex_unlock(&m_mutexRings);
+   }
+}
+
+bool LogFile::Drain(std::string& _batch)
+{
+   bool found = false;
+
+   pthread_mutex_lock(&m_mutexRings);
+   LineRing** link = &m_rings;
+   while(*link != NULL) {
+      LineRing* ring = *link;
+
+      // Orphaned before head, the last lines are in when it's set
+      bool orphaned = ring->orphaned;
+      __sync_synchronize();
+      unsigned int head = ring->head;
+      __sync_synchronize();
+
+      while(ring->tail != head) {
+         string& line = ring->lines[ring->tail % RING_SIZE];
+         _batch += line;
+         line.clear();
+         __sync_synchronize();
+         ring->tail = ring->tail + 1;
+         found = true;
+      }
+
+      if(orphaned) {
+         m_droppedOrphaned += ring->dropped;
+         *link = ring->next;
+         delete ring;
+      }
+      else {
+         link = &ring->next;
+      }
+   }
+   pthread_mutex_unlock(&m_mutexRings);
+
+   return found;
+}
+
+bool LogFile::RingsEmpty()
+{
+   for(LineRing* ring = m_rings; ring != NULL; ring = ring->next) {
+      if(ring->head != ring->tail) {
+         return false;
+      }
+   }
+   return true;
 }
 
 int LogFile::overflow(int _i)
@@ -75,43 +415,60 @@ int LogFile::overflow(int _i)
       return _i;
    }
 
-   if(m_buffer.empty()) {
+   ThreadBuffer& threadBuffer = GetThreadBuffer();
+   string& buffer = threadBuffer.line;
+
+   if(buffer.empty()) {
       time_t rawtime;
       time(&rawtime);
-      string timestamp(ctime(&rawtime));
-      m_buffer += timestamp.substr(0, timestamp.length() - 1);
-      m_buffer += " ";
+      if(rawtime != threadBuffer.stampTime) {
+         ctime_r(&rawtime, threadBuffer.stamp);
+         threadBuffer.stamp[strlen(threadBuffer.stamp) - 1] = '\0';
+         threadBuffer.stampTime = rawtime;
+      }
+      buffer += threadBuffer.stamp;
+      buffer += " ";
    }
      
-   m_buffer += _i;
+   buffer += _i;
    
    if(_i == '\n')  {
       assert(m_logTo != LogFile::NONE);
-   
-      if (m_logTo & LogFile::COUT) {
-         cout << m_buffer;
+
+      if(!m_async) {
+         Write(buffer);
+         buffer.clear();
+         return _i;
       }
 
-      if (m_logTo & LogFile::FILE) {
-         // Logrotate moves files at xx:yy (unlink actually).
-         // bad(), is_fail() on so forth can't detect that,
-         // So we need to open/close on each write.
-         // (or use inotify, but that is another story).
-         pthread_mutex_lock(&m_mutexLogFile);
-         m_logFile.open(m_logFileName.c_str(), ios::out | ios::app);
-         if(m_logFile.is_open())
-         {
-            m_logFile.write(m_buffer.c_str(), m_buffer.size());
-            m_logFile.close();
-         }
-         else
-         {
-            cerr << "Can't reopen log file!! " << m_logFileName << endl;
-         }
-         pthread_mutex_unlock(&m_mutexLogFile);
+      LineRing* ring = threadBuffer.ring;
+      if(ring == NULL) {
+         ring = new LineRing;
+         ring->head = 0;
+         ring->tail = 0;
+         ring->dropped = 0;
+         ring->orphaned = false;
+
+         pthread_mutex_lock(&m_mutexRings);
+         ring->next = m_rings;
+         m_rings = ring;
+         pthread_mutex_unlock(&m_mutexRings);
+         threadBuffer.ring = ring;
       }
 
-      m_buffer.clear();
+      unsigned int head = ring->head;
+      if(head - ring->tail >= (unsigned int)RING_SIZE) {
+         ring->dropped = ring->dropped + 1;
+      }
+      else {
+         // Swapped, the line keeps the capacity of the one the
+         // writer emptied.
+         ring->lines[head % RING_SIZE].swap(buffer);
+         __sync_synchronize();
+         ring->head = head + 1;
+         WakeWriter();
+      }
+      buffer.clear();
    }
    
    return _i;
@@ -128,3 +485,27 @@ int LogFile::sync()
 {
    return 0;
 }
+
+LogRateLimit::LogRateLimit(int _seconds)
+   : m_seconds(_seconds), m_next(0), m_skipped(0)
+{
+}
+
+bool LogRateLimit::Allow(const char* _file, int _line)
+{
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+
+   // Several threads may get here at once, one of them wins
+   time_t next = m_next;
+   if(now.tv_sec < next || !__sync_bool_compare_and_swap(&m_next, next, now.tv_sec + m_seconds)) {
+      __sync_fetch_and_add(&m_skipped, 1);
+      return false;
+   }
+
+   unsigned long skipped = __sync_lock_test_and_set(&m_skipped, 0);
+   if(skipped > 0) {
+      LOG() << "Skipped " << skipped << " lines from " << _file << ":" << _line << endl;
+   }
+   return true;
+}
@@ -23,14 +23,47 @@
 #define _log_file_h
 
 #include <pthread.h>
+#include <sys/types.h>
+#include <time.h>
 
-#include <fstream>
 #include <ostream>
 #include <string>
 
-#define LOG() logFile
-#define ERR() logFile
+// Levels above LOG_MAX_LEVEL are compiled out, -DLOG_MAX_LEVEL=1
+// drops DBG(). The others are filtered at runtime (SetLevel()) before
+// anything is formatted.
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL 2
+#endif
 
+#define LOG_AT(_level) \
+   !((_level) <= LOG_MAX_LEVEL && logFile.IsEnabled(_level)) ? (void)0 : LogVoidify() & logFile
+
+#define ERR() LOG_AT(LogFile::LEVEL_ERROR)
+#define LOG() LOG_AT(LogFile::LEVEL_INFO)
+#define DBG() LOG_AT(LogFile::LEVEL_DEBUG)
+
+// At most one line every _seconds from this call site, for the paths
+// polled all the time. The next line logged tells how many were
+// skipped.
+#define LOG_EVERY(_level, _seconds) \
+   !((_level) <= LOG_MAX_LEVEL && logFile.IsEnabled(_level) && \
+     ({ static LogRateLimit _limit(_seconds); _limit.Allow(__FILE__, __LINE__); })) ? \
+   (void)0 : LogVoidify() & logFile
+
+// The same with a limiter of the caller's, e.g. one per tuner where the
+// call site is shared by all of them
+#define LOG_LIMITED(_level, _limit) \
+   !((_level) <= LOG_MAX_LEVEL && logFile.IsEnabled(_level) && \
+     (_limit).Allow(__FILE__, __LINE__)) ? \
+   (void)0 : LogVoidify() & logFile
+
+// Lines are built per thread. Until StartWriter() they are written
+// right away under a mutex. After it each thread hands its lines to a
+// background writer through its own ring, without taking a lock; when
+// the ring is full the line is dropped and counted. The writer batches
+// the lines into one write, and reopens the log file on SIGHUP
+// (Reopen()) or when logrotate has moved it.
 class LogFile : public std::streambuf, public std::ostream
 {
 public:
@@ -40,6 +73,13 @@ public:
       COUT = 0x1,
       FILE = 0x2
    };
+
+   enum LogLevel
+   {
+      LEVEL_ERROR = 0,
+      LEVEL_INFO = 1,
+      LEVEL_DEBUG = 2
+   };
    
 public:
    LogFile();
@@ -48,6 +88,29 @@ public:
    void SetLogType(LogFile::LogType _type);
    bool SetAndOpenLogFile(const std::string& _fileName);
    void DisableLogging();
+
+   void SetLevel(LogLevel _level);
+   // "error", "info" or "debug"
+   bool SetLevel(const std::string& _level);
+   bool IsEnabled(int _level) const {
+      return !m_disabled && _level <= m_level;
+   }
+
+   // After daemonizing, the writer thread doesn't survive a fork.
+   bool StartWriter();
+   void StopWriter();
+
+   // Wait (a second at most) for the lines logged so far to be
+   // written, before _exit().
+   void Flush();
+
+   // Open the log file again on the writer thread, for SIGHUP.
+   void Reopen();
+
+   unsigned long GetDroppedLines();
+
+   // The writer thread, 0 when lines are written right away
+   pid_t GetWriterTid();
    
 protected:
    int overflow(int _i);
@@ -55,17 +118,101 @@ protected:
    int sync();
 
 private:
-   std::string m_buffer;
+   enum {
+      // Lines per thread waiting for the writer
+      RING_SIZE = 256
+   };
+
+   // Single producer (its thread), single consumer (the writer). The
+   // strings are swapped in and out, so they keep their capacity.
+   struct LineRing {
+      std::string lines[RING_SIZE];
+      volatile unsigned int head;
+      volatile unsigned int tail;
+      volatile unsigned long dropped;
+      // The thread is gone, freed by the writer once empty
+      volatile bool orphaned;
+      LineRing* next;
+   };
+
+   struct ThreadBuffer {
+      std::string line;
+      LineRing* ring;
+      // ctime_r() once a second, not once a line
+      time_t stampTime;
+      char stamp[26];
+   };
+
+   ThreadBuffer& GetThreadBuffer();
+   static void DeleteThreadBuffer(void* _buffer);
+
+   void Write(const std::string& _lines);
+   void OpenLogFile();
+   void CheckRotated();
+
+   static void* WriterEntry(void* _ptr);
+   void WriterLoop();
+   // Moves what the rings have into _batch, frees orphaned rings
+   bool Drain(std::string& _batch);
+   bool RingsEmpty();
+   void WakeWriter();
+
+private:
+   pthread_key_t m_keyBuffer;
 
    LogType m_logTo;
    std::string m_logFileName;
-   std::ofstream m_logFile;
+   int m_fd;
+   dev_t m_fileDev;
+   ino_t m_fileIno;
+   time_t m_lastRotateCheck;
 
+   // Serializes the writes to the log
    pthread_mutex_t m_mutexLogFile;
 
    bool m_disabled;
+   int m_level;
+
+   // Async writer
+   bool m_async;
+   pthread_t m_writer;
+   volatile pid_t m_writerTid;
+   volatile bool m_stopWriter;
+   volatile int m_reopen;
+   // Set while the writer waits for m_condWriter
+   volatile int m_writerSleeping;
+   // Set while the writer has lines out of the rings not yet written
+   volatile int m_writing;
+   LineRing* m_rings;
+   pthread_mutex_t m_mutexRings;
+   pthread_cond_t m_condWriter;
+   // Lines dropped by threads that are gone, and reported so far
+   unsigned long m_droppedOrphaned;
+   unsigned long m_droppedReported;
 };
 
 extern LogFile logFile;
 
+// Turns the stream in LOG_AT() into void, for the ?: there
+class LogVoidify
+{
+public:
+   void operator&(std::ostream&) {}
+};
+
+class LogRateLimit
+{
+public:
+   LogRateLimit(int _seconds);
+
+   // True when the call site may log again
+   bool Allow(const char* _file, int _line);
+
+private:
+   int m_seconds;
+   // Monotonic seconds
+   volatile time_t m_next;
+   volatile unsigned long m_skipped;
+};
+
 #endif // _log_file_h
@@ -54,6 +54,8 @@ static void usage(const char* argv0)
    printf(" -g <groupname>  Run as group <groupname>. Requires -f\n");
    printf(" -l <log file>   Default is /var/log/dvbhdhomerun.log. Requires -f\n");
    printf(" -d disable logging\n");
+   printf(" -c <conf file>  Default is /etc/dvbhdhomerun\n");
+   printf(" -s standby, take the tuners over when the running userhdhomerun exits\n");
    printf("\n");
    exit(0);
 }
@@ -68,15 +70,17 @@ int main(int argc, char** argv)
    const char* userName = NULL;
    const char* groupName = NULL;
    std::string logFileName;
+   std::string confFileName("/etc/dvbhdhomerun");
    bool forkChild = false;
    bool disableLogging = false;
+   bool standby = false;
    int c;
 
    sigset_t signal_set;
    sigfillset( &signal_set );
    pthread_sigmask( SIG_BLOCK, &signal_set, NULL );
 
-   while((c = getopt(argc, argv, "u:g:fdl:")) != -1)
+   while((c = getopt(argc, argv, "u:g:fdl:c:s")) != -1)
    {
       switch(c)
       {
@@ -95,6 +99,12 @@ int main(int argc, char** argv)
       case 'd':
          disableLogging = true;
          break;
+      case 'c':
+         confFileName = optarg;
+         break;
+      case 's':
+         standby = true;
+         break;
       default:
          usage(argv[0]);
          break;
@@ -165,10 +175,14 @@ int main(int argc, char** argv)
       }
    }
 
+   // Hand the lines to a background thread from here on, it has to be
+   // started after daemon().
+   logFile.StartWriter();
+
    // 
    // We are good to go - connect to HDHomeRun's and kernel driver.
    //
-   HdhomerunController hdhomerun(4);
+   HdhomerunController hdhomerun(confFileName, standby);
 
 
    //
@@ -187,6 +201,15 @@ int main(int argc, char** argv)
          g_stop = true;
          break;
 
+      case SIGUSR1:
+         hdhomerun.LogStats();
+         break;
+
+      case SIGHUP:
+         // logrotate's postrotate
+         logFile.Reopen();
+         break;
+
       default:
          break;
       }
@@ -0,0 +1,599 @@
+/*
+ * metrics_server.cpp, serves statistics in the Prometheus text format
+ *
+ * Copyright (C) 2010 Villy Thomsen <tfylliv@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include "metrics_server.h"
+
+#include "conf_inifile.h"
+#include "hdhomerun_control.h"
+#include "hdhomerun_controller.h"
+#include "http_streamer.h"
+#include "latency_histogram.h"
+#include "log_file.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+
+using namespace std;
+
+static const int DEFAULT_METRICS_INTERVAL = 10;
+
+// A scraper gets this long to send its request and take the answer
+static const int CLIENT_TIMEOUT = 2;
+
+static uint64_t MonotonicUs()
+{
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static string LabelValue(const string& _value)
+{
+   string escaped;
+   for(string::size_type i = 0; i < _value.size(); ++i) {
+      if(_value[i] == '"' || _value[i] == '\\') {
+         escaped += '\\';
+      }
+      escaped += _value[i];
+   }
+   return escaped;
+}
+
+static void Header(ostringstream& _out, const char* _name, const char* _type, const char* _help)
+{
+   _out << "# HELP " << _name << " " << _help << "\n";
+   _out << "# TYPE " << _name << " " << _type << "\n";
+}
+
+static void Histogram(ostringstream& _out, const char* _name, const string& _labels, const LatencyHistogram& _latency)
+{
+   // The last bucket also has everything longer, +Inf covers it
+   unsigned long cumulative = 0;
+   for(int bucket = 0; bucket < LatencyHistogram::NUM_BUCKETS - 1; ++bucket) {
+      cumulative += _latency.Bucket(bucket);
+      _out << _name << "_bucket{" << _labels << ",le=\""
+           << (double)(1UL << bucket) / 1000000 << "\"} " << cumulative << "\n";
+   }
+   _out << _name << "_bucket{" << _labels << ",le=\"+Inf\"} " << _latency.Count() << "\n";
+   _out << _name << "_sum{" << _labels << "} " << (double)_latency.Sum() / 1000000 << "\n";
+   _out << _name << "_count{" << _labels << "} " << _latency.Count() << "\n";
+}
+
+//
+// What the per tuner metrics read, see Render()
+//
+struct TunerValues {
+   HdhomerunTuner* tuner;
+   HdhomerunTuner::StreamStats live;
+   // As of the last sample
+   HdhomerunTuner::StreamStats sampled;
+   uint64_t bitrate;
+};
+
+static uint64_t Streaming(const TunerValues& _v) { return _v.live.streaming ? 1 : 0; }
+static uint64_t Offline(const TunerValues& _v) { return _v.tuner->IsOffline() ? 1 : 0; }
+static uint64_t Bytes(const TunerValues& _v) { return _v.live.bytes; }
+static uint64_t Bitrate(const TunerValues& _v) { return _v.bitrate; }
+static uint64_t Packets(const TunerValues& _v) { return _v.sampled.packets; }
+static uint64_t NetworkErrors(const TunerValues& _v) { return _v.sampled.networkErrors; }
+static uint64_t TransportErrors(const TunerValues& _v) { return _v.sampled.transportErrors; }
+static uint64_t SequenceErrors(const TunerValues& _v) { return _v.sampled.sequenceErrors; }
+static uint64_t OverflowErrors(const TunerValues& _v) { return _v.sampled.overflowErrors; }
+static uint64_t SocketBuffer(const TunerValues& _v) { return _v.sampled.socketBuffer; }
+static uint64_t SocketQueued(const TunerValues& _v) { return _v.sampled.socketQueued; }
+static uint64_t SocketQueuedPeak(const TunerValues& _v) { return _v.sampled.socketQueuedPeak; }
+static uint64_t SocketDrops(const TunerValues& _v) { return _v.sampled.socketDrops; }
+static uint64_t RtpLost(const TunerValues& _v) { return _v.sampled.rtp.lost; }
+static uint64_t RtpReordered(const TunerValues& _v) { return _v.sampled.rtp.reordered; }
+static uint64_t RtpDuplicates(const TunerValues& _v) { return _v.sampled.rtp.duplicates; }
+static uint64_t RtpLate(const TunerValues& _v) { return _v.sampled.rtp.late; }
+static uint64_t RtpInvalid(const TunerValues& _v) { return _v.sampled.rtp.invalid; }
+static uint64_t RtpJitter(const TunerValues& _v) { return _v.sampled.rtp.jitter; }
+
+struct TunerMetric {
+   const char* name;
+   const char* type;
+   const char* help;
+   uint64_t (*value)(const TunerValues& _v);
+};
+
+struct FanoutMetric {
+   const char* name;
+   const char* type;
+   const char* help;
+   uint64_t StreamFanout::Stats::*value;
+};
+
+struct RingMetric {
+   const char* name;
+   const char* type;
+   const char* help;
+   uint64_t TsRingPublisher::ReaderStats::*value;
+};
+
+MetricsServer::MetricsServer(HdhomerunController* _controller, const ConfIniFile* _conf)
+   : m_controller(_controller), m_port(0), m_interval(DEFAULT_METRICS_INTERVAL),
+     m_tcpFd(-1), m_unixFd(-1), m_socketBound(false), m_socketDev(0), m_socketIno(0)
+{
+   pfd[0] = pfd[1] = -1;
+
+   if(!_conf) {
+      return;
+   }
+
+   string value;
+   if(_conf->GetSecValue("userhdhomerun", "metrics_port", value)) {
+      m_port = atoi(value.c_str());
+   }
+   _conf->GetSecValue("userhdhomerun", "metrics_socket", m_socketPath);
+   if(_conf->GetSecValue("userhdhomerun", "metrics_interval", value) && atoi(value.c_str()) > 0) {
+      m_interval = atoi(value.c_str());
+   }
+}
+
+MetricsServer::~MetricsServer()
+{
+   if(m_tcpFd >= 0) {
+      close(m_tcpFd);
+   }
+   if(m_unixFd >= 0) {
+      close(m_unixFd);
+   }
+   UnlinkSocket();
+   if(pfd[0] >= 0) {
+      close(pfd[0]);
+   }
+}
+
+bool MetricsServer::Listen()
+{
+   if(m_port > 0) {
+      m_tcpFd = socket(AF_INET, SOCK_STREAM, 0);
+      int on = 1;
+      setsockopt(m_tcpFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+      // Only for this machine, there is no access control
+      struct sockaddr_in addr;
+      memset(&addr, 0, sizeof(addr));
+      addr.sin_family = AF_INET;
+      addr.sin_port = htons(m_port);
+      addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+      if(m_tcpFd < 0 || bind(m_tcpFd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(m_tcpFd, 8) < 0) {
+         ERR() << "Couldn't serve metrics on port " << m_port << ": " << strerror(errno) << endl;
+         if(m_tcpFd >= 0) {
+            close(m_tcpFd);
+            m_tcpFd = -1;
+         }
+      }
+      else {
+         LOG() << "Serving metrics on 127.0.0.1:" << m_port << endl;
+      }
+   }
+
+   if(!m_socketPath.empty()) {
+      struct sockaddr_un addr;
+      memset(&addr, 0, sizeof(addr));
+      addr.sun_family = AF_UNIX;
+      strncpy(addr.sun_path, m_socketPath.c_str(), sizeof(addr.sun_path) - 1);
+
+      m_unixFd = socket(AF_UNIX, SOCK_STREAM, 0);
+      if(m_unixFd >= 0 && connect(m_unixFd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+         ERR() << "Another userhdhomerun serves metrics on " << m_socketPath << ", not replacing it" << endl;
+         close(m_unixFd);
+         m_unixFd = -1;
+      }
+      else if(m_unixFd >= 0) {
+         // Nobody answers, left behind by a crash
+         close(m_unixFd);
+         unlink(m_socketPath.c_str());
+
+         m_unixFd = socket(AF_UNIX, SOCK_STREAM, 0);
+         if(m_unixFd >= 0 && bind(m_unixFd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+            struct stat st;
+            if(stat(m_socketPath.c_str(), &st) == 0) {
+               m_socketBound = true;
+               m_socketDev = st.st_dev;
+               m_socketIno = st.st_ino;
+            }
+         }
+         if(m_unixFd < 0 || !m_socketBound || listen(m_unixFd, 8) < 0) {
+            ERR() << "Couldn't serve metrics on " << m_socketPath << ": " << strerror(errno) << endl;
+            if(m_unixFd >= 0) {
+               close(m_unixFd);
+               m_unixFd = -1;
+            }
+            UnlinkSocket();
+         }
+         else {
+            LOG() << "Serving metrics on " << m_socketPath << endl;
+         }
+      }
+      else {
+         ERR() << "Couldn't serve metrics on " << m_socketPath << ": " << strerror(errno) << endl;
+      }
+   }
+
+   if(m_tcpFd < 0 && m_unixFd < 0) {
+      return false;
+   }
+
+   if(pipe(pfd) == -1) {
+      ERR() << "Could not create a pipe" << endl;
+      return false;
+   }
+
+   return true;
+}
+
+void MetricsServer::UnlinkSocket()
+{
+   if(!m_socketBound) {
+      return;
+   }
+   m_socketBound = false;
+
+   struct stat st;
+   if(stat(m_socketPath.c_str(), &st) == 0 && st.st_dev == m_socketDev && st.st_ino == m_socketIno) {
+      unlink(m_socketPath.c_str());
+   }
+}
+
+void MetricsServer::run()
+{
+   fd_set fds;
+   struct timeval timeout;
+   char buf[8];
+   uint64_t nextSample = MonotonicUs();
+
+   while(!isStopping()) {
+      uint64_t now = MonotonicUs();
+      if(now >= nextSample) {
+         Sample();
+         nextSample = now + (uint64_t)m_interval * 1000000;
+         now = MonotonicUs();
+      }
+
+      FD_ZERO(&fds);
+      FD_SET(pfd[0], &fds);
+      int highfd = pfd[0];
+      if(m_tcpFd >= 0) {
+         FD_SET(m_tcpFd, &fds);
+         highfd = std::max(highfd, m_tcpFd);
+      }
+      if(m_unixFd >= 0) {
+         FD_SET(m_unixFd, &fds);
+         highfd = std::max(highfd, m_unixFd);
+      }
+
+      uint64_t wait = nextSample > now ? nextSample - now : 0;
+      timeout.tv_sec = wait / 1000000;
+      timeout.tv_usec = wait % 1000000;
+
+      int r = select(highfd + 1, &fds, NULL, NULL, &timeout);
+      if(r == -1 && errno == EINTR) {
+         continue;
+      }
+      if(r == -1) {
+         ERR() << "select() failure in metrics server" << endl;
+         break;
+      }
+
+      if(r > 0 && FD_ISSET(pfd[0], &fds) && read(pfd[0], buf, sizeof(buf)) == 0) {
+         break;
+      }
+      if(r > 0 && m_tcpFd >= 0 && FD_ISSET(m_tcpFd, &fds)) {
+         Serve(m_tcpFd);
+      }
+      if(r > 0 && m_unixFd >= 0 && FD_ISSET(m_unixFd, &fds)) {
+         Serve(m_unixFd);
+      }
+   }
+}
+
+void MetricsServer::pre_stop()
+{
+   if(pfd[1] >= 0) {
+      close(pfd[1]);
+      pfd[1] = -1;
+   }
+}
+
+void MetricsServer::Sample()
+{
+   vector<HdhomerunTuner*> tuners;
+   m_controller->GetTuners(tuners);
+
+   uint64_t now = MonotonicUs();
+   vector<HdhomerunTuner*>::iterator it;
+   for(it = tuners.begin(); it != tuners.end(); ++it) {
+      (*it)->SampleStreamStats();
+
+      TunerSample sample;
+      sample.stats = (*it)->GetStreamStats();
+      sample.time = now;
+      sample.bitrate = 0;
+
+      map<HdhomerunTuner*, TunerSample>::iterator last = m_samples.find(*it);
+      if(last != m_samples.end() && now > last->second.time) {
+         sample.bitrate = (sample.stats.bytes - last->second.stats.bytes) * 8 * 1000000 /
+            (now - last->second.time);
+      }
+      m_samples[*it] = sample;
+   }
+}
+
+void MetricsServer::Serve(int _listenFd)
+{
+   int fd = accept(_listenFd, NULL, NULL);
+   if(fd < 0) {
+      return;
+   }
+
+   struct timeval timeout;
+   timeout.tv_sec = CLIENT_TIMEOUT;
+   timeout.tv_usec = 0;
+   setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+   setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+   // Whatever is asked for gets the metrics, read up to the end of
+   // the request headers.
+   string request;
+   char buf[1024];
+   while(request.find("\r\n\r\n") == string::npos && request.find("\n\n") == string::npos &&
+         request.size() < 8192) {
+      ssize_t r = recv(fd, buf, sizeof(buf), 0);
+      if(r <= 0) {
+         break;
+      }
+      request.append(buf, r);
+   }
+
+   string body = Render();
+   ostringstream response;
+   response << "HTTP/1.0 200 OK\r\n"
+            << "Content-Type: text/plain; version=0.0.4\r\n"
+            << "Content-Length: " << body.size() << "\r\n"
+            << "Connection: close\r\n\r\n"
+            << body;
+
+   string data = response.str();
+   size_t sent = 0;
+   while(sent < data.size()) {
+      ssize_t r = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+      if(r <= 0) {
+         break;
+      }
+      sent += r;
+   }
+
+   close(fd);
+}
+
+string MetricsServer::Render()
+{
+   ostringstream out;
+
+   vector<HdhomerunTuner*> tuners;
+   m_controller->GetTuners(tuners);
+
+   //
+   // Per tuner, as of the last sample except for the byte count
+   //
+   static const TunerMetric tunerMetrics[] = {
+      { "hdhomerun_tuner_streaming", "gauge", "1 while the tuner streams to its data device", Streaming },
+      { "hdhomerun_tuner_offline", "gauge", "1 while the HDHomeRun doesn't answer", Offline },
+      { "hdhomerun_tuner_bytes_total", "counter", "Bytes written to the data device", Bytes },
+      { "hdhomerun_tuner_bitrate_bps", "gauge", "Bits per second over the last sample interval", Bitrate },
+      { "hdhomerun_tuner_packets_total", "counter", "TS packets received from the HDHomeRun", Packets },
+      { "hdhomerun_tuner_network_errors_total", "counter", "Packets lost on the network", NetworkErrors },
+      { "hdhomerun_tuner_transport_errors_total", "counter", "Packets with the transport error flag set", TransportErrors },
+      { "hdhomerun_tuner_sequence_errors_total", "counter", "Packets with a continuity counter out of sequence", SequenceErrors },
+      { "hdhomerun_tuner_overflow_errors_total", "counter", "Packets dropped by libhdhomerun's receive buffer", OverflowErrors },
+      { "hdhomerun_tuner_socket_buffer_bytes", "gauge", "Receive buffer of the video socket", SocketBuffer },
+      { "hdhomerun_tuner_socket_queued_bytes", "gauge", "Waiting in the video socket's receive buffer", SocketQueued },
+      { "hdhomerun_tuner_socket_queued_peak_bytes", "gauge", "Most waiting in the video socket's receive buffer over the last sample interval", SocketQueuedPeak },
+      { "hdhomerun_tuner_socket_drops_total", "counter", "Datagrams dropped by the video socket's full receive buffer", SocketDrops },
+      { "hdhomerun_tuner_rtp_lost_total", "counter", "RTP datagrams that never arrived", RtpLost },
+      { "hdhomerun_tuner_rtp_reordered_total", "counter", "RTP datagrams that arrived out of order and were put back in place", RtpReordered },
+      { "hdhomerun_tuner_rtp_duplicates_total", "counter", "RTP datagrams that arrived twice", RtpDuplicates },
+      { "hdhomerun_tuner_rtp_late_total", "counter", "RTP datagrams that arrived after the reorder window gave up on them", RtpLate },
+      { "hdhomerun_tuner_rtp_invalid_total", "counter", "Datagrams that weren't RTP with TS payload", RtpInvalid },
+      { "hdhomerun_tuner_rtp_jitter_microseconds", "gauge", "RFC 3550 interarrival jitter", RtpJitter }
+   };
+
+   for(size_t m = 0; m < sizeof(tunerMetrics) / sizeof(tunerMetrics[0]); ++m) {
+      Header(out, tunerMetrics[m].name, tunerMetrics[m].type, tunerMetrics[m].help);
+
+      vector<HdhomerunTuner*>::iterator it;
+      for(it = tuners.begin(); it != tuners.end(); ++it) {
+         HdhomerunTuner* tuner = *it;
+         TunerValues values;
+         values.tuner = tuner;
+         values.live = tuner->GetStreamStats();
+         values.sampled = HdhomerunTuner::StreamStats();
+         values.bitrate = 0;
+         map<HdhomerunTuner*, TunerSample>::iterator found = m_samples.find(tuner);
+         if(found != m_samples.end()) {
+            values.sampled = found->second.stats;
+            values.bitrate = found->second.bitrate;
+         }
+
+         out << tunerMetrics[m].name << "{tuner=\"" << LabelValue(tuner->GetName())
+             << "\",id=\"" << tuner->GetKernelId() << "\"} " << tunerMetrics[m].value(values) << "\n";
+      }
+   }
+
+   //
+   // Control queues
+   //
+   Control* control = m_controller->GetControl();
+   Control::QueueStats stats[Control::NUM_CLASSES];
+   for(int i = 0; i < Control::NUM_CLASSES; ++i) {
+      stats[i] = control->GetQueueStats((Control::MessageClass)i);
+   }
+
+   Header(out, "hdhomerun_control_queue_depth", "gauge", "Requests from the kernel waiting to be handled");
+   for(int i = 0; i < Control::NUM_CLASSES; ++i) {
+      out << "hdhomerun_control_queue_depth{class=\"" << Control::GetClassName(i) << "\"} " << stats[i].depth << "\n";
+   }
+   Header(out, "hdhomerun_control_messages_total", "counter", "Requests handled");
+   for(int i = 0; i < Control::NUM_CLASSES; ++i) {
+      out << "hdhomerun_control_messages_total{class=\"" << Control::GetClassName(i) << "\"} " << stats[i].messages << "\n";
+   }
+   Header(out, "hdhomerun_control_merged_total", "counter", "Status reads answered together with an earlier one");
+   for(int i = 0; i < Control::NUM_CLASSES; ++i) {
+      out << "hdhomerun_control_merged_total{class=\"" << Control::GetClassName(i) << "\"} " << stats[i].merged << "\n";
+   }
+   Header(out, "hdhomerun_control_expired_total", "counter", "Requests skipped because the kernel gave up on them");
+   for(int i = 0; i < Control::NUM_CLASSES; ++i) {
+      out << "hdhomerun_control_expired_total{class=\"" << Control::GetClassName(i) << "\"} " << stats[i].expired << "\n";
+   }
+
+   //
+   // Control latency, kernel post to reply. Same log2 buckets as
+   // /sys/kernel/debug/dvb_hdhomerun/latency.
+   //
+   out << fixed << setprecision(6);
+   Header(out, "hdhomerun_control_latency_seconds", "histogram", "Control request latency per stage: kernel post to read (fifo), read to reply (daemon) and both (total)");
+   for(unsigned int type = 0; type < DVB_HDHOMERUN_NUM_MESG_TYPES; ++type) {
+      for(int stage = 0; stage < Control::NUM_STAGES; ++stage) {
+         LatencyHistogram latency = control->GetLatency(type, (Control::LatencyStage)stage);
+         if(latency.Count() == 0) {
+            continue;
+         }
+
+         ostringstream labels;
+         labels << "type=\"" << Control::GetMessageName(type) << "\",stage=\"" << Control::GetStageName(stage) << "\"";
+         Histogram(out, "hdhomerun_control_latency_seconds", labels.str(), latency);
+      }
+   }
+
+   //
+   // Ingest latency per tuner, see HdhomerunTuner::StreamStats
+   //
+   Header(out, "hdhomerun_tuner_ingest_latency_seconds", "histogram", "Upper bound of the time a batch of packets spent between libhdhomerun and the data device");
+   vector<HdhomerunTuner*>::iterator it;
+   for(it = tuners.begin(); it != tuners.end(); ++it) {
+      HdhomerunTuner::StreamStats live = (*it)->GetStreamStats();
+      if(live.ingestLatency.Count() == 0) {
+         continue;
+      }
+
+      ostringstream labels;
+      labels << "tuner=\"" << LabelValue((*it)->GetName()) << "\",id=\"" << (*it)->GetKernelId() << "\"";
+      Histogram(out, "hdhomerun_tuner_ingest_latency_seconds", labels.str(), live.ingestLatency);
+   }
+
+   //
+   // Fanout per tuner and destination
+   //
+   static const FanoutMetric fanoutMetrics[] = {
+      { "hdhomerun_tuner_fanout_sent_total", "counter", "Datagrams sent on to the fanout destination", &StreamFanout::Stats::sent },
+      { "hdhomerun_tuner_fanout_dropped_total", "counter", "Datagrams the fanout destination couldn't keep up with", &StreamFanout::Stats::dropped },
+      { "hdhomerun_tuner_fanout_errors_total", "counter", "Send errors, e.g. nobody listening on a unicast port", &StreamFanout::Stats::errors }
+   };
+   for(size_t m = 0; m < sizeof(fanoutMetrics) / sizeof(fanoutMetrics[0]); ++m) {
+      Header(out, fanoutMetrics[m].name, fanoutMetrics[m].type, fanoutMetrics[m].help);
+
+      for(it = tuners.begin(); it != tuners.end(); ++it) {
+         vector<StreamFanout::Stats> fanout;
+         (*it)->GetFanoutStats(fanout);
+
+         vector<StreamFanout::Stats>::iterator dest;
+         for(dest = fanout.begin(); dest != fanout.end(); ++dest) {
+            out << fanoutMetrics[m].name << "{tuner=\"" << LabelValue((*it)->GetName())
+                << "\",id=\"" << (*it)->GetKernelId() << "\",destination=\""
+                << LabelValue(dest->destination) << "\"} " << (*dest).*fanoutMetrics[m].value << "\n";
+         }
+      }
+   }
+
+   //
+   // shm_ring readers per tuner
+   //
+   static const RingMetric ringMetrics[] = {
+      { "hdhomerun_tuner_shm_reader_lag_bytes", "gauge", "Bytes the shared memory reader is behind", &TsRingPublisher::ReaderStats::lag },
+      { "hdhomerun_tuner_shm_reader_overruns_total", "counter", "Times the shared memory reader fell more than the ring behind", &TsRingPublisher::ReaderStats::overruns },
+      { "hdhomerun_tuner_shm_reader_lost_bytes_total", "counter", "Bytes the shared memory reader lost to overruns", &TsRingPublisher::ReaderStats::lost }
+   };
+   for(size_t m = 0; m < sizeof(ringMetrics) / sizeof(ringMetrics[0]); ++m) {
+      Header(out, ringMetrics[m].name, ringMetrics[m].type, ringMetrics[m].help);
+
+      for(it = tuners.begin(); it != tuners.end(); ++it) {
+         vector<TsRingPublisher::ReaderStats> readers;
+         (*it)->GetRingStats(readers);
+
+         vector<TsRingPublisher::ReaderStats>::iterator reader;
+         for(reader = readers.begin(); reader != readers.end(); ++reader) {
+            out << ringMetrics[m].name << "{tuner=\"" << LabelValue((*it)->GetName())
+                << "\",id=\"" << (*it)->GetKernelId() << "\",pid=\"" << reader->pid << "\"} "
+                << (*reader).*ringMetrics[m].value << "\n";
+         }
+      }
+   }
+
+   //
+   // HTTP clients
+   //
+   HttpStreamer* http = m_controller->GetHttpStreamer();
+   if(http) {
+      vector<HttpStreamer::ClientStats> clients;
+      http->GetClientStats(clients);
+
+      Header(out, "hdhomerun_http_client_bytes_total", "counter", "Bytes sent to the HTTP client");
+      vector<HttpStreamer::ClientStats>::iterator client;
+      for(client = clients.begin(); client != clients.end(); ++client) {
+         out << "hdhomerun_http_client_bytes_total{tuner=\"" << LabelValue(client->tunerName) << "\",id=\""
+             << client->tuner << "\",client=\"" << client->peer << "\"} " << client->bytes << "\n";
+      }
+      Header(out, "hdhomerun_http_client_lag_bytes", "gauge", "Bytes the HTTP client is behind the tuner");
+      for(client = clients.begin(); client != clients.end(); ++client) {
+         out << "hdhomerun_http_client_lag_bytes{tuner=\"" << LabelValue(client->tunerName) << "\",id=\""
+             << client->tuner << "\",client=\"" << client->peer << "\"} " << client->lag << "\n";
+      }
+      Header(out, "hdhomerun_http_client_connected_seconds", "gauge", "How long the HTTP client has been connected");
+      time_t now = time(NULL);
+      for(client = clients.begin(); client != clients.end(); ++client) {
+         out << "hdhomerun_http_client_connected_seconds{tuner=\"" << LabelValue(client->tunerName) << "\",id=\""
+             << client->tuner << "\",client=\"" << client->peer << "\"} " << now - client->started << "\n";
+      }
+      Header(out, "hdhomerun_http_slow_disconnects_total", "counter", "HTTP clients cut off for falling too far behind");
+      out << "hdhomerun_http_slow_disconnects_total " << http->GetSlowDisconnects() << "\n";
+   }
+
+   return out.str();
+}
@@ -0,0 +1,89 @@
+/*
+ * metrics_server.h, serves statistics in the Prometheus text format
+ *
+ * Copyright (C) 2010 Villy Thomsen <tfylliv@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef _metrics_server_h_
+#define _metrics_server_h_
+
+#include "hdhomerun_tuner.h"
+#include "thread_pthread.h"
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <map>
+#include <string>
+
+class ConfIniFile;
+class HdhomerunController;
+
+// Samples the tuners every metrics_interval seconds and answers HTTP
+// requests on 127.0.0.1:metrics_port and/or the Unix socket
+// metrics_socket with the per-tuner stream statistics, the control
+// queues and the control latency histograms. Everything happens on
+// this thread, a scrape never touches the streaming threads beyond
+// copying their counters.
+class MetricsServer : public ThreadPthread
+{
+public:
+   MetricsServer(HdhomerunController* _controller, const ConfIniFile* _conf);
+   ~MetricsServer();
+
+   // False when neither metrics_port nor metrics_socket is set, or
+   // none of them could be opened.
+   bool Listen();
+
+   void run();
+   void pre_stop();
+
+private:
+   struct TunerSample {
+      HdhomerunTuner::StreamStats stats;
+      // Monotonic us
+      uint64_t time;
+      // Bits per second between the last two samples
+      uint64_t bitrate;
+   };
+
+   void Sample();
+   void Serve(int _listenFd);
+   void UnlinkSocket();
+   std::string Render();
+
+private:
+   HdhomerunController* m_controller;
+
+   int m_port;
+   std::string m_socketPath;
+   int m_interval;
+
+   int m_tcpFd;
+   int m_unixFd;
+   // m_socketPath is ours to unlink only while it is the socket we
+   // bound, not one a later userhdhomerun put there.
+   bool m_socketBound;
+   dev_t m_socketDev;
+   ino_t m_socketIno;
+   int pfd[2];
+
+   std::map<HdhomerunTuner*, TunerSample> m_samples;
+};
+
+#endif // _metrics_server_h_
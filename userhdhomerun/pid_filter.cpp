@@ -0,0 +1,229 @@
+/*
+ * pid_filter.cpp, PID set for the HDHomeRun tuner filter
+ *
+ * Copyright (C) 2010 Villy Thomsen <tfylliv@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include "pid_filter.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+
+using namespace std;
+
+static const int TS_PACKET_SIZE = 188;
+static const uint8_t TS_SYNC_BYTE = 0x47;
+
+PidFilter::PidFilter()
+{
+   Clear();
+}
+
+bool PidFilter::Add(int _pid)
+{
+   if(_pid < 0 || _pid >= NUM_PIDS || Contains(_pid)) {
+      return false;
+   }
+
+   m_bits[_pid >> 5] |= (1u << (_pid & 31));
+   return true;
+}
+
+bool PidFilter::Remove(int _pid)
+{
+   if(_pid < 0 || _pid >= NUM_PIDS || !Contains(_pid)) {
+      return false;
+   }
+
+   m_bits[_pid >> 5] &= ~(1u << (_pid & 31));
+   return true;
+}
+
+void PidFilter::Clear()
+{
+   memset(m_bits, 0, sizeof(m_bits));
+}
+
+void PidFilter::Fill()
+{
+   memset(m_bits, 0xff, sizeof(m_bits));
+}
+
+bool PidFilter::Empty() const
+{
+   for(int i = 0; i < NUM_WORDS; ++i) {
+      if(m_bits[i] != 0) {
+         return false;
+      }
+   }
+   return true;
+}
+
+bool PidFilter::IsFull() const
+{
+   for(int i = 0; i < NUM_WORDS; ++i) {
+      if(m_bits[i] != 0xffffffff) {
+         return false;
+      }
+   }
+   return true;
+}
+
+int PidFilter::Count() const
+{
+   int count = 0;
+   for(int i = 0; i < NUM_WORDS; ++i) {
+      count += __builtin_popcount(m_bits[i]);
+   }
+   return count;
+}
+
+void PidFilter::GetRanges(std::vector<Range>& _ranges) const
+{
+   _ranges.clear();
+
+   int first = -1;
+   for(int i = 0; i < NUM_WORDS; ++i) {
+      uint32_t word = m_bits[i];
+
+      // Skip the words where nothing changes.
+      if((word == 0 && first < 0) || (word == 0xffffffff && first >= 0)) {
+         continue;
+      }
+
+      for(int bit = 0; bit < 32; ++bit) {
+         int pid = (i << 5) + bit;
+         bool set = (word >> bit) & 1;
+         if(set && first < 0) {
+            first = pid;
+         }
+         else if(!set && first >= 0) {
+            _ranges.push_back(make_pair(first, pid - 1));
+            first = -1;
+         }
+      }
+   }
+
+   if(first >= 0) {
+      _ranges.push_back(make_pair(first, NUM_PIDS - 1));
+   }
+}
+
+// Used to sort the gaps between ranges, smallest first.
+static bool CompareGap(const pair<int, size_t>& _gap1, const pair<int, size_t>& _gap2)
+{
+   return _gap1.first < _gap2.first;
+}
+
+PidFilter PidFilter::Widen(int _maxRanges) const
+{
+   vector<Range> ranges;
+   GetRanges(ranges);
+
+   if(_maxRanges < 1) {
+      _maxRanges = 1;
+   }
+
+   if(ranges.size() <= (size_t)_maxRanges) {
+      return *this;
+   }
+
+   // Gap i is the hole between range i and range i+1.
+   vector<pair<int, size_t> > gaps;
+   gaps.reserve(ranges.size() - 1);
+   for(size_t i = 0; i + 1 < ranges.size(); ++i) {
+      gaps.push_back(make_pair(ranges[i + 1].first - ranges[i].second - 1, i));
+   }
+   stable_sort(gaps.begin(), gaps.end(), CompareGap);
+
+   PidFilter widened(*this);
+   size_t toMerge = ranges.size() - _maxRanges;
+   for(size_t i = 0; i < toMerge; ++i) {
+      size_t r = gaps[i].second;
+      for(int pid = ranges[r].second + 1; pid < ranges[r + 1].first; ++pid) {
+         widened.Add(pid);
+      }
+   }
+
+   return widened;
+}
+
+std::string PidFilter::ToString() const
+{
+   vector<Range> ranges;
+   GetRanges(ranges);
+
+   ostringstream str;
+   str << hex << uppercase << setfill('0');
+
+   vector<Range>::const_iterator it;
+   for(it = ranges.begin(); it != ranges.end(); ++it) {
+      if(it != ranges.begin()) {
+         str << " ";
+      }
+      str << "0x" << setw(4) << it->first;
+      if(it->second != it->first) {
+         str << "-0x" << setw(4) << it->second;
+      }
+   }
+
+   return str.str();
+}
+
+void PidFilter::Diff(const PidFilter& _old, const PidFilter& _new,
+                     PidFilter& _added, PidFilter& _removed)
+{
+   for(int i = 0; i < NUM_WORDS; ++i) {
+      _added.m_bits[i] = _new.m_bits[i] & ~_old.m_bits[i];
+      _removed.m_bits[i] = _old.m_bits[i] & ~_new.m_bits[i];
+   }
+}
+
+size_t PidFilter::FilterPackets(uint8_t* _data, size_t _size) const
+{
+   size_t out = 0;
+   size_t in = 0;
+
+   for(; in + TS_PACKET_SIZE <= _size; in += TS_PACKET_SIZE) {
+      const uint8_t* packet = _data + in;
+      int pid = ((packet[1] & 0x1f) << 8) | packet[2];
+
+      // Let the demux deal with packets out of sync.
+      if(packet[0] != TS_SYNC_BYTE || Contains(pid)) {
+         if(out != in) {
+            memmove(_data + out, packet, TS_PACKET_SIZE);
+         }
+         out += TS_PACKET_SIZE;
+      }
+   }
+
+   // Trailing partial packet, pass it on untouched.
+   if(in < _size) {
+      memmove(_data + out, _data + in, _size - in);
+      out += _size - in;
+   }
+
+   return out;
+}
+
+bool PidFilter::operator==(const PidFilter& _other) const
+{
+   return memcmp(m_bits, _other.m_bits, sizeof(m_bits)) == 0;
+}
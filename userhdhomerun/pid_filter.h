@@ -0,0 +1,93 @@
+/*
+ * pid_filter.h, PID set for the HDHomeRun tuner filter
+ *
+ * Copyright (C) 2010 Villy Thomsen <tfylliv@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef _pid_filter_h_
+#define _pid_filter_h_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+// Set of the 8192 possible TS PIDs, kept as a bitmap.
+class PidFilter
+{
+public:
+   enum {
+      NUM_PIDS = 0x2000,
+      PASS_ALL = 0x2000  // What the demux uses for "give me the whole TS"
+   };
+
+   typedef std::pair<int, int> Range;  // First and last PID, inclusive
+
+public:
+   PidFilter();
+
+   // Both return true if the set changed.
+   bool Add(int _pid);
+   bool Remove(int _pid);
+
+   bool Contains(int _pid) const {
+      return (m_bits[_pid >> 5] >> (_pid & 31)) & 1;
+   }
+
+   void Clear();
+   void Fill();
+
+   bool Empty() const;
+   bool IsFull() const;
+   int Count() const;
+
+   void GetRanges(std::vector<Range>& _ranges) const;
+
+   // Smallest superset of this set that can be described with at
+   // most _maxRanges ranges. Adjacent ranges with the smallest gaps
+   // are merged first.
+   PidFilter Widen(int _maxRanges) const;
+
+   // HDHomeRun filter syntax, i.e. "0x0100-0x0104 0x0200".
+   std::string ToString() const;
+
+   // Exact difference between two sets: PIDs in _new but not in _old
+   // end up in _added, PIDs in _old but not in _new in _removed.
+   static void Diff(const PidFilter& _old, const PidFilter& _new,
+                    PidFilter& _added, PidFilter& _removed);
+
+   // Remove the TS packets with a PID not in the set. The buffer is
+   // compacted in place and the new size is returned.
+   size_t FilterPackets(uint8_t* _data, size_t _size) const;
+
+   bool operator==(const PidFilter& _other) const;
+   bool operator!=(const PidFilter& _other) const {
+      return !(*this == _other);
+   }
+
+private:
+   enum {
+      NUM_WORDS = NUM_PIDS / 32
+   };
+
+   uint32_t m_bits[NUM_WORDS];
+};
+
+#endif // _pid_filter_h_
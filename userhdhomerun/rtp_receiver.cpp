@@ -0,0 +1,370 @@
+/*
+ * rtp_receiver.cpp, receives an RTP stream and puts it back in order
+ *
+ * Copyright (C) 2010 Villy Thomsen <tfylliv@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include "rtp_receiver.h"
+
+#include "log_file.h"
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+
+using namespace std;
+
+static const int RTP_HEADER_SIZE = 12;
+static const int TS_PACKET_SIZE = 188;
+
+static uint64_t MonotonicUs()
+{
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// The RTP timestamps of MPEG-2 TS run at 90 kHz
+static uint64_t To90kHz(const struct timespec& _time)
+{
+   return (uint64_t)_time.tv_sec * 90000 + (uint64_t)_time.tv_nsec * 9 / 100000;
+}
+
+// The slots are indexed by seq % window, which has to survive the
+// wrap at 65536
+static int WindowSize(int _window)
+{
+   int size = 1;
+   while(size < _window && size < 4096) {
+      size *= 2;
+   }
+   return size;
+}
+
+RtpReceiver::RtpReceiver(int _window, int _holdMs)
+   : m_fd(-1), m_port(0), m_window(WindowSize(_window)), m_holdUs((uint64_t)max(_holdMs, 0) * 1000),
+     m_held(0), m_synced(false), m_ssrc(0), m_next(0), m_highest(0),
+     m_haveTransit(false), m_lastTransit(0), m_jitter(0), m_outStart(0)
+{
+   m_slots.resize(m_window);
+   for(int i = 0; i < m_window; ++i) {
+      m_slots[i].used = false;
+   }
+   m_given.resize(m_window, -1);
+   m_recvBuffers.resize(RECV_BATCH * MAX_DATAGRAM);
+   m_recvControl.resize(RECV_BATCH * CMSG_SPACE(sizeof(struct timespec)));
+   memset(&m_stats, 0, sizeof(m_stats));
+}
+
+RtpReceiver::~RtpReceiver()
+{
+   if(m_fd >= 0) {
+      close(m_fd);
+   }
+}
+
+bool RtpReceiver::Open(int _port)
+{
+   m_fd = socket(AF_INET, SOCK_DGRAM, 0);
+   if(m_fd < 0) {
+      ERR() << "Couldn't create the RTP socket: " << strerror(errno) << endl;
+      return false;
+   }
+
+   struct sockaddr_in addr;
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_addr.s_addr = htonl(INADDR_ANY);
+   addr.sin_port = htons(_port);
+   if(bind(m_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+      ERR() << "Couldn't bind the RTP socket to port " << _port << ": " << strerror(errno) << endl;
+      close(m_fd);
+      m_fd = -1;
+      return false;
+   }
+
+   socklen_t len = sizeof(addr);
+   getsockname(m_fd, (struct sockaddr*)&addr, &len);
+   m_port = ntohs(addr.sin_port);
+
+   // The kernel's receive time, jitter doesn't depend on when we got
+   // around to reading
+   int on = 1;
+   setsockopt(m_fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+
+   return true;
+}
+
+uint8_t* RtpReceiver::Receive(size_t _max, size_t* _actual)
+{
+   if(m_outStart > 0) {
+      m_out.erase(m_out.begin(), m_out.begin() + m_outStart);
+      m_outStart = 0;
+   }
+
+   while(m_out.size() < _max && ReadSocket()) {
+   }
+   Release(MonotonicUs());
+
+   *_actual = min(_max, m_out.size());
+   m_outStart = *_actual;
+   return m_out.empty() ? NULL : &m_out[0];
+}
+
+void RtpReceiver::Reset()
+{
+   // Left over from the last stream
+   char datagram[MAX_DATAGRAM];
+   while(m_fd >= 0 && recv(m_fd, datagram, sizeof(datagram), MSG_DONTWAIT) >= 0) {
+   }
+
+   for(int i = 0; i < m_window; ++i) {
+      m_slots[i].used = false;
+   }
+   fill(m_given.begin(), m_given.end(), -1);
+   m_held = 0;
+   m_synced = false;
+   m_haveTransit = false;
+   m_out.clear();
+   m_outStart = 0;
+}
+
+bool RtpReceiver::ReadSocket()
+{
+   if(m_fd < 0) {
+      return false;
+   }
+
+   struct mmsghdr msgs[RECV_BATCH];
+   struct iovec iovs[RECV_BATCH];
+   const size_t controlSize = CMSG_SPACE(sizeof(struct timespec));
+   memset(msgs, 0, sizeof(msgs));
+   for(int i = 0; i < RECV_BATCH; ++i) {
+      iovs[i].iov_base = &m_recvBuffers[i * MAX_DATAGRAM];
+      iovs[i].iov_len = MAX_DATAGRAM;
+      msgs[i].msg_hdr.msg_iov = &iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+      msgs[i].msg_hdr.msg_control = &m_recvControl[i * controlSize];
+      msgs[i].msg_hdr.msg_controllen = controlSize;
+   }
+
+   int count = recvmmsg(m_fd, msgs, RECV_BATCH, MSG_DONTWAIT, NULL);
+   if(count <= 0) {
+      return false;
+   }
+
+   uint64_t now = MonotonicUs();
+   struct timespec realNow;
+   clock_gettime(CLOCK_REALTIME, &realNow);
+
+   for(int i = 0; i < count; ++i) {
+      // SO_TIMESTAMPNS is CLOCK_REALTIME
+      uint64_t arrived90k = To90kHz(realNow);
+      for(struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg != NULL;
+          cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg)) {
+         if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+            struct timespec stamp;
+            memcpy(&stamp, CMSG_DATA(cmsg), sizeof(stamp));
+            arrived90k = To90kHz(stamp);
+         }
+      }
+      Insert(&m_recvBuffers[i * MAX_DATAGRAM], msgs[i].msg_len, now, arrived90k);
+   }
+
+   return count == RECV_BATCH;
+}
+
+void RtpReceiver::Insert(const uint8_t* _datagram, size_t _size, uint64_t _arrived, uint64_t _arrived90k)
+{
+   //
+   // RFC 3550 header: V=2, padding, extension and CSRCs around the TS
+   //
+   if(_size < (size_t)RTP_HEADER_SIZE || (_datagram[0] >> 6) != 2) {
+      ++m_stats.invalid;
+      return;
+   }
+   size_t header = RTP_HEADER_SIZE + (_datagram[0] & 0x0f) * 4;
+   if((_datagram[0] & 0x10) && header + 4 <= _size) {
+      header += 4 + ((_datagram[header + 2] << 8) | _datagram[header + 3]) * 4;
+   }
+   size_t padding = (_datagram[0] & 0x20) ? _datagram[_size - 1] : 0;
+   if(header + padding > _size || (_size - header - padding) % TS_PACKET_SIZE != 0) {
+      ++m_stats.invalid;
+      return;
+   }
+   size_t payloadSize = _size - header - padding;
+
+   uint16_t seq = (_datagram[2] << 8) | _datagram[3];
+   uint32_t timestamp = ((uint32_t)_datagram[4] << 24) | (_datagram[5] << 16) | (_datagram[6] << 8) | _datagram[7];
+   uint32_t ssrc = ((uint32_t)_datagram[8] << 24) | (_datagram[9] << 16) | (_datagram[10] << 8) | _datagram[11];
+
+   //
+   // Jitter, in arrival order
+   //
+   int64_t transit = (int64_t)(uint32_t)(_arrived90k - timestamp);
+   if(m_haveTransit && ssrc == m_ssrc) {
+      int64_t d = (int32_t)(transit - m_lastTransit);
+      if(d < 0) {
+         d = -d;
+      }
+      m_jitter += d - ((m_jitter + 8) >> 4);
+      m_stats.jitter = (m_jitter >> 4) * 100 / 9;
+   }
+   m_lastTransit = transit;
+   m_haveTransit = true;
+
+   //
+   // Into the window
+   //
+   if(!m_synced || ssrc != m_ssrc) {
+      if(m_synced) {
+         LOG() << "RTP sender changed, ssrc " << hex << m_ssrc << " to " << ssrc << dec << endl;
+      }
+      m_ssrc = ssrc;
+      Resync(seq);
+   }
+
+   int16_t diff = (int16_t)(seq - m_next);
+   if(diff < -RESYNC_DISTANCE || diff > RESYNC_DISTANCE) {
+      LOG() << "RTP sequence jumped from " << m_next << " to " << seq << ", resyncing" << endl;
+      Resync(seq);
+      diff = 0;
+   }
+
+   if(diff < 0) {
+      int32_t& given = m_given[seq % m_window];
+      if(given == seq) {
+         ++m_stats.late;
+         given = -1;
+      }
+      else {
+         ++m_stats.duplicates;
+      }
+      return;
+   }
+
+   // Beyond the window, give up on the oldest
+   while(diff >= m_window) {
+      SkipHead();
+      diff = (int16_t)(seq - m_next);
+   }
+
+   Slot& slot = m_slots[seq % m_window];
+   if(slot.used) {
+      ++m_stats.duplicates;
+      return;
+   }
+
+   if((int16_t)(seq - m_highest) < 0) {
+      ++m_stats.reordered;
+   }
+   else {
+      m_highest = seq;
+   }
+
+   // In order with nothing held, the usual case
+   if(diff == 0 && m_held == 0) {
+      Deliver(_datagram + header, payloadSize);
+      m_given[seq % m_window] = -1;
+      ++m_next;
+      return;
+   }
+
+   slot.used = true;
+   slot.seq = seq;
+   slot.arrived = _arrived;
+   slot.size = payloadSize;
+   memcpy(slot.data, _datagram + header, payloadSize);
+   ++m_held;
+
+   // The hold time is up to Receive(), once the socket is read
+   while(m_held > 0 && m_slots[m_next % m_window].used) {
+      SkipHead();
+   }
+}
+
+void RtpReceiver::Release(uint64_t _now)
+{
+   while(m_held > 0) {
+      Slot& head = m_slots[m_next % m_window];
+      if(head.used) {
+         SkipHead();
+         continue;
+      }
+
+      // A gap, wait for it unless a later one has been held too long
+      uint64_t oldest = _now;
+      for(int i = 0; i < m_window; ++i) {
+         if(m_slots[i].used) {
+            oldest = min(oldest, m_slots[i].arrived);
+         }
+      }
+      if(_now - oldest < m_holdUs) {
+         break;
+      }
+      SkipHead();
+   }
+}
+
+void RtpReceiver::SkipHead()
+{
+   int index = m_next % m_window;
+   Slot& head = m_slots[index];
+   if(head.used) {
+      Deliver(head.data, head.size);
+      head.used = false;
+      --m_held;
+      m_given[index] = -1;
+   }
+   else {
+      ++m_stats.lost;
+      m_given[index] = m_next;
+   }
+   ++m_next;
+}
+
+void RtpReceiver::Resync(uint16_t _seq)
+{
+   // What we have is still good, in order, gaps and all
+   for(int i = 0; i < m_window && m_held > 0; ++i) {
+      Slot& slot = m_slots[(uint16_t)(m_next + i) % m_window];
+      if(slot.used) {
+         Deliver(slot.data, slot.size);
+         slot.used = false;
+         --m_held;
+      }
+   }
+
+   fill(m_given.begin(), m_given.end(), -1);
+   m_next = _seq;
+   m_highest = _seq;
+   m_synced = true;
+}
+
+void RtpReceiver::Deliver(const uint8_t* _payload, size_t _size)
+{
+   m_out.insert(m_out.end(), _payload, _payload + _size);
+   ++m_stats.packets;
+}
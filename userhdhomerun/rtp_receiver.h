@@ -0,0 +1,144 @@
+/*
+ * rtp_receiver.h, receives an RTP stream and puts it back in order
+ *
+ * Copyright (C) 2010 Villy Thomsen <tfylliv@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef _rtp_receiver_h_
+#define _rtp_receiver_h_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <vector>
+
+// The video from the HDHomeRun (or anything else sending RTP with TS
+// payload) on our own UDP socket. Datagrams are put back in sequence
+// number order within a small window before the TS goes on. Only
+// used by the ingest thread, GetStats() is a copy for the others.
+class RtpReceiver
+{
+public:
+   struct Stats {
+      // Passed on, in sequence
+      uint64_t packets;
+      // Never arrived, given up on when the window moved past them
+      uint64_t lost;
+      // Arrived after a later one and put back in place
+      uint64_t reordered;
+      uint64_t duplicates;
+      // Arrived after being given up on, dropped
+      uint64_t late;
+      // Not RTP version 2 carrying whole TS packets
+      uint64_t invalid;
+      // RFC 3550 interarrival jitter from the RTP timestamps, us
+      uint32_t jitter;
+   };
+
+   // A gap is waited for until _window later datagrams have arrived or
+   // _holdMs has passed. _window is rounded up to a power of two.
+   RtpReceiver(int _window, int _holdMs);
+   ~RtpReceiver();
+
+   // Binds to _port on all addresses, 0 for any free one.
+   bool Open(int _port);
+
+   int GetFd() const {
+      return m_fd;
+   }
+
+   int GetPort() const {
+      return m_port;
+   }
+
+   // Reads what the socket has without waiting and returns up to _max
+   // bytes of TS, the same way as hdhomerun_device_stream_recv(). The
+   // data is good until the next call.
+   uint8_t* Receive(size_t _max, size_t* _actual);
+
+   // For a new stream: drops what is queued and held, the next
+   // datagram starts the sequence. The counters keep going.
+   void Reset();
+
+   Stats GetStats() const {
+      return m_stats;
+   }
+
+private:
+   enum {
+      MAX_DATAGRAM = 1500,
+      // Datagrams per recvmmsg()
+      RECV_BATCH = 64,
+      // A jump this far is the sender starting over, not loss
+      RESYNC_DISTANCE = 1000
+   };
+
+   struct Slot {
+      bool used;
+      uint16_t seq;
+      // Monotonic us
+      uint64_t arrived;
+      size_t size;
+      uint8_t data[MAX_DATAGRAM];
+   };
+
+   // False once the socket is empty
+   bool ReadSocket();
+   void Insert(const uint8_t* _datagram, size_t _size, uint64_t _arrived, uint64_t _arrived90k);
+   // Passes on the in-order datagrams from m_next, gives up on a gap
+   // held longer than m_holdUs
+   void Release(uint64_t _now);
+   // Gives up on m_next if it's missing, passes it on if not
+   void SkipHead();
+   void Resync(uint16_t _seq);
+   void Deliver(const uint8_t* _payload, size_t _size);
+
+private:
+   int m_fd;
+   int m_port;
+
+   int m_window;
+   uint64_t m_holdUs;
+   // Indexed by seq % m_window
+   std::vector<Slot> m_slots;
+   // Seq given up on per slot, -1 for none. Tells a late datagram from
+   // a duplicate.
+   std::vector<int32_t> m_given;
+   int m_held;
+
+   bool m_synced;
+   uint32_t m_ssrc;
+   uint16_t m_next;
+   uint16_t m_highest;
+
+   // RFC 3550 A.8, in 1/16 RTP timestamp units
+   bool m_haveTransit;
+   int64_t m_lastTransit;
+   uint64_t m_jitter;
+
+   std::vector<uint8_t> m_out;
+   size_t m_outStart;
+
+   // For recvmmsg()
+   std::vector<uint8_t> m_recvBuffers;
+   std::vector<uint8_t> m_recvControl;
+
+   Stats m_stats;
+};
+
+#endif // _rtp_receiver_h_
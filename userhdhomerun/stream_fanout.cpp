@@ -0,0 +1,209 @@
+/*
+ * stream_fanout.cpp, sends a tuner's TS on to other local consumers
+ *
+ * Copyright (C) 2010 Villy Thomsen <tfylliv@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include "stream_fanout.h"
+
+#include "log_file.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+
+#include <sstream>
+
+using namespace std;
+
+static uint64_t MonotonicUs()
+{
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+StreamFanout::StreamFanout(const std::string& _destinations, int _ttl, int _waitMs)
+   : m_waitMs(_waitMs)
+{
+   memset(m_msgs, 0, sizeof(m_msgs));
+   memset(m_iovs, 0, sizeof(m_iovs));
+
+   istringstream str(_destinations);
+   string destination;
+   while(str >> destination) {
+      if(!AddDestination(destination, _ttl)) {
+         ERR() << "Invalid fanout destination: " << destination << endl;
+      }
+   }
+}
+
+StreamFanout::~StreamFanout()
+{
+   vector<Destination>::iterator it;
+   for(it = m_destinations.begin(); it != m_destinations.end(); ++it) {
+      close(it->fd);
+   }
+}
+
+bool StreamFanout::AddDestination(const std::string& _destination, int _ttl)
+{
+   Destination dest;
+   dest.name = _destination;
+   dest.wait = false;
+   dest.sent = dest.dropped = dest.errors = 0;
+
+   string address = _destination;
+   size_t slash = address.find('/');
+   if(slash != string::npos) {
+      string policy = address.substr(slash + 1);
+      address.erase(slash);
+      if(policy == "wait") {
+         dest.wait = true;
+      }
+      else if(policy != "drop") {
+         return false;
+      }
+   }
+
+   size_t colon = address.rfind(':');
+   if(colon == string::npos) {
+      return false;
+   }
+   int port = atoi(address.c_str() + colon + 1);
+   memset(&dest.addr, 0, sizeof(dest.addr));
+   dest.addr.sin_family = AF_INET;
+   dest.addr.sin_port = htons(port);
+   if(port <= 0 || port > 65535 || inet_pton(AF_INET, address.substr(0, colon).c_str(), &dest.addr.sin_addr) != 1) {
+      return false;
+   }
+
+   dest.fd = socket(AF_INET, SOCK_DGRAM, 0);
+   if(dest.fd < 0) {
+      ERR() << "Couldn't create a fanout socket: " << strerror(errno) << endl;
+      return true;
+   }
+   fcntl(dest.fd, F_SETFL, fcntl(dest.fd, F_GETFL) | O_NONBLOCK);
+
+   if(IN_MULTICAST(ntohl(dest.addr.sin_addr.s_addr))) {
+      // Also to the consumers on this machine
+      unsigned char ttl = _ttl;
+      unsigned char loop = 1;
+      setsockopt(dest.fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+      setsockopt(dest.fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+   }
+
+   // One datagram per message, so this is the only address needed
+   if(connect(dest.fd, (struct sockaddr*)&dest.addr, sizeof(dest.addr)) != 0) {
+      ERR() << "Couldn't connect fanout to " << _destination << ": " << strerror(errno) << endl;
+      close(dest.fd);
+      return true;
+   }
+
+   LOG() << "Fanout to " << address << (dest.wait ? ", waiting" : ", dropping") << " when it can't keep up" << endl;
+   m_destinations.push_back(dest);
+   return true;
+}
+
+void StreamFanout::Send(const uint8_t* _data, size_t _size)
+{
+   // The wait time is for the whole batch, however many destinations
+   // and sendmmsg() calls it takes
+   uint64_t deadline = MonotonicUs() + (uint64_t)m_waitMs * 1000;
+
+   size_t offset = 0;
+   while(offset < _size) {
+      int count = 0;
+      for(; count < SEND_BATCH && offset < _size; ++count) {
+         size_t size = min((size_t)DATAGRAM_SIZE, _size - offset);
+         m_iovs[count].iov_base = const_cast<uint8_t*>(_data + offset);
+         m_iovs[count].iov_len = size;
+         m_msgs[count].msg_hdr.msg_iov = &m_iovs[count];
+         m_msgs[count].msg_hdr.msg_iovlen = 1;
+         offset += size;
+      }
+
+      vector<Destination>::iterator it;
+      for(it = m_destinations.begin(); it != m_destinations.end(); ++it) {
+         SendTo(*it, count, deadline);
+      }
+   }
+}
+
+void StreamFanout::SendTo(Destination& _destination, int _count, uint64_t _deadline)
+{
+   int done = 0;
+   while(done < _count) {
+      int ret = sendmmsg(_destination.fd, m_msgs + done, _count - done, MSG_DONTWAIT);
+      if(ret > 0) {
+         done += ret;
+         continue;
+      }
+
+      if(ret < 0 && errno == EINTR) {
+         continue;
+      }
+
+      // The ICMP port unreachable of an earlier datagram, nobody
+      // listens on the unicast port right now. Reported once, the
+      // rest of the batch can still go.
+      if(ret < 0 && errno == ECONNREFUSED) {
+         __sync_fetch_and_add(&_destination.errors, 1);
+         continue;
+      }
+
+      if(ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && _destination.wait) {
+         struct pollfd pfd;
+         pfd.fd = _destination.fd;
+         pfd.events = POLLOUT;
+         uint64_t now = MonotonicUs();
+         int waitMs = now < _deadline ? (int)((_deadline - now + 999) / 1000) : 0;
+         if(poll(&pfd, 1, waitMs) > 0) {
+            continue;
+         }
+      }
+      else if(ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+         __sync_fetch_and_add(&_destination.errors, 1);
+      }
+
+      break;
+   }
+
+   __sync_fetch_and_add(&_destination.sent, done);
+   __sync_fetch_and_add(&_destination.dropped, _count - done);
+}
+
+void StreamFanout::GetStats(std::vector<Stats>& _stats) const
+{
+   _stats.clear();
+   vector<Destination>::const_iterator it;
+   for(it = m_destinations.begin(); it != m_destinations.end(); ++it) {
+      Stats stats;
+      stats.destination = it->name;
+      stats.sent = it->sent;
+      stats.dropped = it->dropped;
+      stats.errors = it->errors;
+      _stats.push_back(stats);
+   }
+}
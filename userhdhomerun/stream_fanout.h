@@ -0,0 +1,93 @@
+/*
+ * stream_fanout.h, sends a tuner's TS on to other local consumers
+ *
+ * Copyright (C) 2010 Villy Thomsen <tfylliv@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef _stream_fanout_h_
+#define _stream_fanout_h_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <string>
+#include <vector>
+
+// Sends the batches run() receives on to UDP unicast or multicast
+// destinations as well, 7 TS packets a datagram like the HDHomeRun.
+// The datagrams point into the batch, nothing is copied. Each
+// destination has its own socket, so a slow one only holds up itself:
+// "drop" loses what doesn't fit in its send buffer, "wait" waits for
+// room first, up to the wait time per batch for all of them together.
+class StreamFanout
+{
+public:
+   struct Stats {
+      std::string destination;
+      uint64_t sent;
+      uint64_t dropped;
+      // Failed sends, including nobody listening on a unicast port
+      uint64_t errors;
+   };
+
+   // _destinations is a space separated list of <ip>:<port>[/drop|/wait]
+   StreamFanout(const std::string& _destinations, int _ttl, int _waitMs);
+   ~StreamFanout();
+
+   bool Empty() const {
+      return m_destinations.empty();
+   }
+
+   // From the ingest thread only
+   void Send(const uint8_t* _data, size_t _size);
+
+   void GetStats(std::vector<Stats>& _stats) const;
+
+private:
+   enum {
+      DATAGRAM_SIZE = 7 * 188,
+      // Datagrams per sendmmsg()
+      SEND_BATCH = 256
+   };
+
+   struct Destination {
+      std::string name;
+      struct sockaddr_in addr;
+      int fd;
+      bool wait;
+      volatile uint64_t sent;
+      volatile uint64_t dropped;
+      volatile uint64_t errors;
+   };
+
+   bool AddDestination(const std::string& _destination, int _ttl);
+   // _deadline in monotonic us, when a "wait" destination gives up
+   void SendTo(Destination& _destination, int _count, uint64_t _deadline);
+
+private:
+   std::vector<Destination> m_destinations;
+   int m_waitMs;
+
+   struct mmsghdr m_msgs[SEND_BATCH];
+   struct iovec m_iovs[SEND_BATCH];
+};
+
+#endif // _stream_fanout_h_
@@ -0,0 +1,150 @@
+/*
+ * stream_ring.cpp, a tuner's recent TS in memory for the HTTP clients
+ *
+ * Copyright (C) 2010 Villy Thomsen <tfylliv@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include "stream_ring.h"
+
+#include "log_file.h"
+#include "thread_pthread.h"
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+using namespace std;
+
+static const size_t TS_PACKET_SIZE = 188;
+
+StreamRing::StreamRing()
+   : m_data(NULL), m_size(0), m_mapSize(0), m_maxWrite(0), m_head(0), m_waiters(0)
+{
+   pthread_condattr_t attr;
+   pthread_condattr_init(&attr);
+   pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+   pthread_cond_init(&m_cond, &attr);
+   pthread_condattr_destroy(&attr);
+   pthread_mutex_init(&m_mutex, NULL);
+}
+
+StreamRing::~StreamRing()
+{
+   if(m_data) {
+      munmap(m_data, m_mapSize);
+   }
+   pthread_cond_destroy(&m_cond);
+   pthread_mutex_destroy(&m_mutex);
+}
+
+bool StreamRing::Create(size_t _size)
+{
+   m_size = _size - _size % TS_PACKET_SIZE;
+   // Pages of its own, they end up referenced from pipes and sockets
+   long page = sysconf(_SC_PAGESIZE);
+   m_mapSize = (m_size + page - 1) / page * page;
+   void* map = mmap(NULL, m_mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if(m_size == 0 || map == MAP_FAILED) {
+      ERR() << "Couldn't allocate a " << _size << " byte stream ring: " << strerror(errno) << endl;
+      if(map != MAP_FAILED) {
+         munmap(map, m_mapSize);
+      }
+      return false;
+   }
+   m_data = (uint8_t*)map;
+   return true;
+}
+
+void StreamRing::Write(const uint8_t* _data, size_t _size)
+{
+   _size -= _size % TS_PACKET_SIZE;
+   if(_size > m_size) {
+      _data += _size - m_size;
+      _size = m_size;
+   }
+   if(_size == 0) {
+      return;
+   }
+   if(_size > m_maxWrite) {
+      m_maxWrite = _size;
+   }
+
+   uint64_t head = m_head;
+   struct iovec iov[2];
+   int count = GetIov(head, _size, iov);
+   memcpy(iov[0].iov_base, _data, iov[0].iov_len);
+   if(count == 2) {
+      memcpy(iov[1].iov_base, _data + iov[0].iov_len, iov[1].iov_len);
+   }
+
+   // The data before the head, the head before looking for sleepers.
+   // A reader counts itself before checking the head.
+   __sync_synchronize();
+   m_head = head + _size;
+   __sync_synchronize();
+   if(m_waiters > 0) {
+      MutexLocker lock(&m_mutex);
+      pthread_cond_broadcast(&m_cond);
+   }
+}
+
+uint64_t StreamRing::GetHead() const
+{
+   uint64_t head = m_head;
+   __sync_synchronize();
+   return head;
+}
+
+uint64_t StreamRing::WaitForData(uint64_t _pos, int _ms)
+{
+   struct timespec deadline;
+   clock_gettime(CLOCK_MONOTONIC, &deadline);
+   deadline.tv_sec += _ms / 1000;
+   deadline.tv_nsec += (_ms % 1000) * 1000000L;
+   if(deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+   }
+
+   MutexLocker lock(&m_mutex);
+   __sync_fetch_and_add(&m_waiters, 1);
+   while(GetHead() == _pos) {
+      if(pthread_cond_timedwait(&m_cond, &m_mutex, &deadline) == ETIMEDOUT) {
+         break;
+      }
+   }
+   __sync_fetch_and_sub(&m_waiters, 1);
+   return GetHead();
+}
+
+int StreamRing::GetIov(uint64_t _pos, size_t _size, struct iovec _iov[2]) const
+{
+   size_t offset = _pos % m_size;
+   size_t first = min(m_size - offset, _size);
+   _iov[0].iov_base = m_data + offset;
+   _iov[0].iov_len = first;
+   if(first == _size) {
+      return 1;
+   }
+   _iov[1].iov_base = m_data;
+   _iov[1].iov_len = _size - first;
+   return 2;
+}
@@ -0,0 +1,77 @@
+/*
+ * stream_ring.h, a tuner's recent TS in memory for the HTTP clients
+ *
+ * Copyright (C) 2010 Villy Thomsen <tfylliv@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef _stream_ring_h_
+#define _stream_ring_h_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+// The last few MB a tuner received, written by its ingest thread and
+// read by any number of HttpStreamer clients. The writer never waits:
+// a reader more than a ring behind gets overwritten data, it has to
+// keep its own distance (see HttpStreamer). Positions count the bytes
+// written since the ring was created.
+class StreamRing
+{
+public:
+   StreamRing();
+   ~StreamRing();
+
+   // _size is rounded down to whole TS packets
+   bool Create(size_t _size);
+
+   size_t GetSize() const {
+      return m_size;
+   }
+   // Largest single Write() so far
+   size_t GetMaxWrite() const {
+      return m_maxWrite;
+   }
+
+   // From the ingest thread only
+   void Write(const uint8_t* _data, size_t _size);
+
+   uint64_t GetHead() const;
+   // Returns the head once it is past _pos, or after _ms
+   uint64_t WaitForData(uint64_t _pos, int _ms);
+
+   // Where [_pos, _pos + _size) is, in one or two pieces. _size must
+   // not be more than the ring.
+   int GetIov(uint64_t _pos, size_t _size, struct iovec _iov[2]) const;
+
+private:
+   uint8_t* m_data;
+   size_t m_size;
+   size_t m_mapSize;
+   volatile size_t m_maxWrite;
+   volatile uint64_t m_head;
+
+   // WaitForData() sleeps here, Write() only takes the mutex when
+   // somebody does
+   volatile int m_waiters;
+   pthread_mutex_t m_mutex;
+   pthread_cond_t m_cond;
+};
+
+#endif // _stream_ring_h_
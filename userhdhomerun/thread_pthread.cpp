@@ -1,39 +1,113 @@
 #include "thread_pthread.h"
 
-#include <unistd.h>
+#include <errno.h>
+#include <time.h>
 
 ThreadPthread::ThreadPthread() 
-: m_running(false), 
-  m_stop(false)
+: m_stop(0), 
+  m_running(0),
+  m_started(false)
 {
+  pthread_mutex_init(&m_mutexJoin, NULL);
+  pthread_mutex_init(&m_mutexWait, NULL);
+
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&m_condWait, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+ThreadPthread::~ThreadPthread()
+{
+  pthread_cond_destroy(&m_condWait);
+  pthread_mutex_destroy(&m_mutexWait);
+  pthread_mutex_destroy(&m_mutexJoin);
 }
 
 void* ThreadPthread::threadEntryFunc(void* _ptr)
 {
   ThreadPthread* thread = static_cast<ThreadPthread *>(_ptr);
-  thread->m_running = true;
+  if(!thread->m_name.empty()) {
+    // 15 characters at most
+    pthread_setname_np(pthread_self(), thread->m_name.substr(0, 15).c_str());
+  }
+  thread->m_sched.Apply(0, thread->m_name);
   thread->run();
-  pthread_detach(thread->m_thread);  // Remove "leak" from valgrind.
-  thread->m_running = false;
+  __sync_lock_release(&thread->m_running);
   return NULL;
 }
 
 int ThreadPthread::start()
 {
-    return pthread_create(&m_thread, NULL, &ThreadPthread::threadEntryFunc, this);
+  MutexLocker lock(&m_mutexJoin);
+
+  if(m_started) {
+    return EBUSY;
+  }
+
+  __sync_lock_release(&m_stop);
+  __sync_lock_test_and_set(&m_running, 1);
+  int ret = pthread_create(&m_thread, NULL, &ThreadPthread::threadEntryFunc, this);
+  if(ret != 0) {
+    __sync_lock_release(&m_running);
+    return ret;
+  }
+  m_started = true;
+  return 0;
+}
+
+void ThreadPthread::setSched(const ThreadSched& _sched, const std::string& _name)
+{
+  m_sched = _sched;
+  m_name = _name;
 }
 
 void ThreadPthread::stop()
 {
-  m_stop = true;
-  pre_stop();
-  while(m_running)
-  {
-    usleep(100000);
+  MutexLocker lock(&m_mutexJoin);
+
+  if(!m_started) {
+    return;
   }
+
+  pthread_mutex_lock(&m_mutexWait);
+  __sync_lock_test_and_set(&m_stop, 1);
+  pthread_cond_broadcast(&m_condWait);
+  pthread_mutex_unlock(&m_mutexWait);
+
+  pre_stop();
+
+  pthread_join(m_thread, NULL);
+  m_started = false;
 }
 
 bool ThreadPthread::isFinished() const
 {
-  return !m_running;
+  return __sync_fetch_and_add(const_cast<volatile int*>(&m_running), 0) == 0;
+}
+
+bool ThreadPthread::isStopping() const
+{
+  return __sync_fetch_and_add(const_cast<volatile int*>(&m_stop), 0) != 0;
+}
+
+bool ThreadPthread::waitForStop(int _ms)
+{
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += _ms / 1000;
+  deadline.tv_nsec += (long)(_ms % 1000) * 1000000;
+  if(deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+
+  MutexLocker lock(&m_mutexWait);
+  while(!isStopping()) {
+    if(pthread_cond_timedwait(&m_condWait, &m_mutexWait, &deadline) == ETIMEDOUT) {
+      break;
+    }
+  }
+  return !isStopping();
 }
@@ -1,30 +1,70 @@
 #ifndef _thread_pthread_h_
 #define _thread_pthread_h_
 
+#include "thread_sched.h"
+
 #include <pthread.h>
 
+#include <string>
+
 class ThreadPthread
 {
 public:
   ThreadPthread();
+  ~ThreadPthread();
 
+  // A stopped thread may be started again.
   int start();
+  // Wakes run() through pre_stop() and waitForStop() and joins the
+  // thread. Returns right away if it isn't running.
   void stop();
   bool isFinished() const;
 
+  // Applied by the thread itself when it starts, _name is for the log
+  // and top -H.
+  void setSched(const ThreadSched& _sched, const std::string& _name);
+
 protected:
   virtual void run() = 0;
   virtual void pre_stop() { return; };
 
-protected:
-  bool m_stop;
+  bool isStopping() const;
+  // Sleeps _ms milliseconds or until stop() is called. Returns false
+  // when stopping.
+  bool waitForStop(int _ms);
 
 private:
   static void* threadEntryFunc(void* _ptr);
 
 private:
-  bool m_running;
+  // Only touched through the __sync builtins.
+  volatile int m_stop;
+  volatile int m_running;
+
+  ThreadSched m_sched;
+  std::string m_name;
+
+  bool m_started;
   pthread_t m_thread; 
+  // m_started and the join, stop() may race with itself.
+  pthread_mutex_t m_mutexJoin;
+  pthread_mutex_t m_mutexWait;
+  pthread_cond_t m_condWait;
+};
+
+// Holds a pthread mutex for as long as it is in scope.
+class MutexLocker
+{
+public:
+  MutexLocker(pthread_mutex_t* _mutex) : m_mutex(_mutex) {
+    pthread_mutex_lock(m_mutex);
+  }
+  ~MutexLocker() {
+    pthread_mutex_unlock(m_mutex);
+  }
+
+private:
+  pthread_mutex_t* m_mutex;
 };
 
 #endif // _thread_pthread_h_
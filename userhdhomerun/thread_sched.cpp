@@ -0,0 +1,237 @@
+/*
+ * thread_sched.cpp, CPU affinity, scheduling policy and nice level of a thread
+ *
+ * Copyright (C) 2010 Villy Thomsen <tfylliv@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include "thread_sched.h"
+#include "conf_inifile.h"
+#include "log_file.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <sstream>
+
+using namespace std;
+
+ThreadSched::ThreadSched()
+   : m_haveCpus(false), m_havePolicy(false), m_policy(SCHED_OTHER), m_priority(0),
+     m_haveNice(false), m_nice(0)
+{
+   CPU_ZERO(&m_cpus);
+}
+
+void ThreadSched::Read(const ConfIniFile& _conf, const std::string& _section, const std::string& _role)
+{
+   string value;
+   if(_conf.GetSecValue(_section, _role + "_cpus", value)) {
+      cpu_set_t cpus;
+      if(ParseCpus(value, cpus)) {
+         m_cpus = cpus;
+         m_haveCpus = true;
+      }
+      else {
+         ERR() << "Invalid " << _role << "_cpus: " << value << endl;
+      }
+   }
+
+   if(_conf.GetSecValue(_section, _role + "_sched", value)) {
+      int policy;
+      if(ParsePolicy(value, policy)) {
+         m_policy = policy;
+         m_havePolicy = true;
+      }
+      else {
+         ERR() << "Invalid " << _role << "_sched: " << value << endl;
+      }
+   }
+
+   if(_conf.GetSecValue(_section, _role + "_priority", value)) {
+      m_priority = atoi(value.c_str());
+   }
+
+   if(_conf.GetSecValue(_section, _role + "_nice", value)) {
+      m_nice = atoi(value.c_str());
+      m_haveNice = true;
+   }
+}
+
+bool ThreadSched::IsSet() const
+{
+   return m_haveCpus || m_havePolicy || m_haveNice;
+}
+
+void ThreadSched::Apply(pid_t _tid, const std::string& _name) const
+{
+   if(!IsSet()) {
+      return;
+   }
+
+   pid_t tid = _tid ? _tid : GetTid();
+
+   if(m_haveCpus && sched_setaffinity(tid, sizeof(m_cpus), &m_cpus) != 0) {
+      ERR() << "Couldn't set the cpus of " << _name << ": " << strerror(errno) << endl;
+   }
+
+   if(m_havePolicy) {
+      struct sched_param param;
+      memset(&param, 0, sizeof(param));
+      if(m_policy == SCHED_FIFO || m_policy == SCHED_RR) {
+         // 0 is only valid for the other policies, fifo and rr without
+         // a <role>_priority get the lowest real time priority
+         int low = sched_get_priority_min(m_policy);
+         int high = sched_get_priority_max(m_policy);
+         param.sched_priority = m_priority == 0 ? low : m_priority;
+         if(param.sched_priority < low || param.sched_priority > high) {
+            ERR() << "Invalid " << PolicyName(m_policy) << " priority " << m_priority << " for " << _name
+                  << ", using " << low << "-" << high << endl;
+            param.sched_priority = std::max(low, std::min(high, param.sched_priority));
+         }
+      }
+      if(sched_setscheduler(tid, m_policy, &param) != 0) {
+         ERR() << "Couldn't set " << PolicyName(m_policy) << " scheduling of " << _name
+               << ": " << strerror(errno) << endl;
+      }
+   }
+
+   // Linux keeps the nice level per thread
+   if(m_haveNice && setpriority(PRIO_PROCESS, tid, m_nice) != 0) {
+      ERR() << "Couldn't set the nice level of " << _name << ": " << strerror(errno) << endl;
+   }
+
+   // What we got, which may not be what was asked for
+   cpu_set_t cpus;
+   CPU_ZERO(&cpus);
+   sched_getaffinity(tid, sizeof(cpus), &cpus);
+   int policy = sched_getscheduler(tid);
+   struct sched_param param;
+   memset(&param, 0, sizeof(param));
+   sched_getparam(tid, &param);
+   errno = 0;
+   int nice = getpriority(PRIO_PROCESS, tid);
+
+   LOG() << "Thread " << _name << " (" << tid << "): cpus " << CpusToString(cpus)
+         << ", " << PolicyName(policy) << " priority " << param.sched_priority
+         << ", nice " << nice << endl;
+}
+
+pid_t ThreadSched::GetTid()
+{
+   return syscall(SYS_gettid);
+}
+
+bool ThreadSched::ParseCpus(const std::string& _cpus, cpu_set_t& _set)
+{
+   CPU_ZERO(&_set);
+
+   istringstream str(_cpus);
+   string item;
+   while(getline(str, item, ',')) {
+      char* end;
+      long first = strtol(item.c_str(), &end, 10);
+      long last = first;
+      if(end == item.c_str()) {
+         return false;
+      }
+      if(*end == '-') {
+         const char* start = end + 1;
+         last = strtol(start, &end, 10);
+         if(end == start) {
+            return false;
+         }
+      }
+      if(*end != '\0' || first < 0 || last < first || last >= CPU_SETSIZE) {
+         return false;
+      }
+      for(long cpu = first; cpu <= last; ++cpu) {
+         CPU_SET(cpu, &_set);
+      }
+   }
+   return CPU_COUNT(&_set) > 0;
+}
+
+std::string ThreadSched::CpusToString(const cpu_set_t& _set)
+{
+   ostringstream str;
+   for(int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+      if(!CPU_ISSET(cpu, &_set)) {
+         continue;
+      }
+      int last = cpu;
+      while(last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, &_set)) {
+         ++last;
+      }
+      if(str.tellp() > 0) {
+         str << ",";
+      }
+      str << cpu;
+      if(last > cpu) {
+         str << "-" << last;
+      }
+      cpu = last;
+   }
+   return str.str();
+}
+
+bool ThreadSched::ParsePolicy(const std::string& _policy, int& _value)
+{
+   if(_policy == "other") {
+      _value = SCHED_OTHER;
+   }
+   else if(_policy == "batch") {
+      _value = SCHED_BATCH;
+   }
+   else if(_policy == "idle") {
+      _value = SCHED_IDLE;
+   }
+   else if(_policy == "fifo") {
+      _value = SCHED_FIFO;
+   }
+   else if(_policy == "rr") {
+      _value = SCHED_RR;
+   }
+   else {
+      return false;
+   }
+   return true;
+}
+
+const char* ThreadSched::PolicyName(int _policy)
+{
+   switch(_policy) {
+   case SCHED_OTHER:
+      return "other";
+   case SCHED_BATCH:
+      return "batch";
+   case SCHED_IDLE:
+      return "idle";
+   case SCHED_FIFO:
+      return "fifo";
+   case SCHED_RR:
+      return "rr";
+   default:
+      return "unknown";
+   }
+}
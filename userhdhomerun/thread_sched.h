@@ -0,0 +1,68 @@
+/*
+ * thread_sched.h, CPU affinity, scheduling policy and nice level of a thread
+ *
+ * Copyright (C) 2010 Villy Thomsen <tfylliv@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef _thread_sched_h_
+#define _thread_sched_h_
+
+#include <sched.h>
+#include <sys/types.h>
+
+#include <string>
+
+class ConfIniFile;
+
+// Where and how a thread runs, from the conf file keys <role>_cpus
+// (e.g. "2,3" or "0-3"), <role>_sched (other, batch, idle, fifo or
+// rr), <role>_priority (1-99 for fifo and rr) and <role>_nice.
+class ThreadSched
+{
+public:
+   ThreadSched();
+
+   // Takes the keys present in _section, others keep their value, so
+   // a tuner's section can override the [userhdhomerun] defaults.
+   void Read(const ConfIniFile& _conf, const std::string& _section, const std::string& _role);
+
+   bool IsSet() const;
+
+   // Applies to thread _tid, 0 being the calling thread, and logs
+   // what the thread ends up with.
+   void Apply(pid_t _tid, const std::string& _name) const;
+
+   static pid_t GetTid();
+
+private:
+   static bool ParseCpus(const std::string& _cpus, cpu_set_t& _set);
+   static std::string CpusToString(const cpu_set_t& _set);
+   static bool ParsePolicy(const std::string& _policy, int& _value);
+   static const char* PolicyName(int _policy);
+
+private:
+   bool m_haveCpus;
+   cpu_set_t m_cpus;
+   bool m_havePolicy;
+   int m_policy;
+   int m_priority;
+   bool m_haveNice;
+   int m_nice;
+};
+
+#endif // _thread_sched_h_
@@ -0,0 +1,80 @@
+/*
+ * ts_ring.h, layout of the shared memory TS ring
+ *
+ * Copyright (C) 2010 Villy Thomsen <tfylliv@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef __DVBHDHOMERUN_TS_RING_H__
+#define __DVBHDHOMERUN_TS_RING_H__
+
+#include <stdint.h>
+
+/* With shm_ring set userhdhomerun copies each tuner's TS into the
+   shared memory object TS_RING_PREFIX<tuner name>, e.g.
+   /dev/shm/dvbhdhomerun-1010ABCD-0, next to writing it to the data
+   device. One writer, up to TS_RING_MAX_READERS readers, nobody waits
+   for a reader: one that falls more than a ring behind has lost data.
+   Readers register an eventfd at the abstract Unix datagram socket of
+   the same name to be woken up. ts_ring_client.h does all of that. */
+
+#define TS_RING_PREFIX "/dvbhdhomerun-"
+#define TS_RING_MAGIC 0x54535247
+#define TS_RING_VERSION 1
+#define TS_RING_MAX_READERS 16
+
+/* Owned by the reader that set pid, the writer only reads it and
+   clears waiting when it wakes the reader. */
+struct ts_ring_reader {
+   volatile uint32_t pid;
+   /* Set before sleeping on the eventfd */
+   volatile uint32_t waiting;
+   /* Bytes read, counted like head */
+   volatile uint64_t pos;
+   /* Times the writer lapped the reader, and the bytes lost to it */
+   volatile uint64_t overruns;
+   volatile uint64_t lost;
+} __attribute__((aligned(64)));
+
+/* Registration datagram, sent with the eventfd as SCM_RIGHTS */
+struct ts_ring_register {
+   uint32_t slot;
+};
+
+struct ts_ring_header {
+   uint32_t magic;
+   uint32_t version;
+   /* Bytes of TS data, a multiple of 188, starting at data_offset
+      from the start of the object */
+   uint64_t size;
+   uint64_t data_offset;
+   /* The tuner is streaming */
+   volatile uint32_t streaming;
+   /* userhdhomerun let go of the ring, open it again */
+   volatile uint32_t closed;
+
+   /* Bytes written since the ring was created, always a multiple of
+      188. Data up to head is complete. */
+   volatile uint64_t head __attribute__((aligned(64)));
+   /* Where the writer is writing up to, set before the data is copied.
+      Data before writing - size is being overwritten. */
+   volatile uint64_t writing;
+
+   struct ts_ring_reader readers[TS_RING_MAX_READERS];
+};
+
+#endif /* __DVBHDHOMERUN_TS_RING_H__ */
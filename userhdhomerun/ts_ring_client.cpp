@@ -0,0 +1,267 @@
+/*
+ * ts_ring_client.cpp, reads a tuner's TS from its shared memory ring
+ *
+ * Copyright (C) 2010 Villy Thomsen <tfylliv@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include "ts_ring_client.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+using namespace std;
+
+static const size_t TS_PACKET_SIZE = 188;
+
+// Upper bound of a sleep, in case the wakeup got lost or userhdhomerun
+// hasn't seen the eventfd yet
+static const int WAIT_SLICE_MS = 100;
+
+static uint64_t MonotonicMs()
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+TsRingClient::TsRingClient()
+   : m_header(NULL), m_data(NULL), m_mapSize(0), m_reader(NULL), m_eventFd(-1)
+{
+}
+
+TsRingClient::~TsRingClient()
+{
+   Close();
+}
+
+bool TsRingClient::Open(const std::string& _name)
+{
+   Close();
+
+   string shmName = TS_RING_PREFIX + _name;
+   int fd = shm_open(shmName.c_str(), O_RDWR, 0);
+   if(fd < 0) {
+      return false;
+   }
+
+   struct stat st;
+   void* map = MAP_FAILED;
+   if(fstat(fd, &st) == 0 && (size_t)st.st_size > sizeof(struct ts_ring_header)) {
+      map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   }
+   close(fd);
+   if(map == MAP_FAILED) {
+      return false;
+   }
+
+   m_header = (struct ts_ring_header*)map;
+   m_mapSize = st.st_size;
+   __sync_synchronize();
+   if(m_header->magic != TS_RING_MAGIC || m_header->version != TS_RING_VERSION ||
+      m_header->data_offset + m_header->size > m_mapSize || m_header->closed) {
+      Close();
+      errno = EPROTO;
+      return false;
+   }
+   m_data = (const uint8_t*)map + m_header->data_offset;
+
+   uint32_t pid = getpid();
+   int slot = 0;
+   for(; slot < TS_RING_MAX_READERS; ++slot) {
+      if(__sync_bool_compare_and_swap(&m_header->readers[slot].pid, 0, pid)) {
+         break;
+      }
+   }
+   if(slot == TS_RING_MAX_READERS) {
+      Close();
+      errno = EBUSY;
+      return false;
+   }
+
+   m_reader = &m_header->readers[slot];
+   m_reader->waiting = 0;
+   m_reader->overruns = 0;
+   m_reader->lost = 0;
+   m_reader->pos = m_header->head;
+
+   // Hand userhdhomerun an eventfd to wake us with. Without it Read()
+   // polls, so a failure here isn't fatal.
+   m_eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+   int sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+   if(m_eventFd >= 0 && sock >= 0) {
+      struct sockaddr_un addr;
+      memset(&addr, 0, sizeof(addr));
+      addr.sun_family = AF_UNIX;
+      size_t len = min(shmName.size(), sizeof(addr.sun_path) - 1);
+      memcpy(addr.sun_path + 1, shmName.data(), len);
+
+      struct ts_ring_register reg;
+      reg.slot = slot;
+      struct iovec iov;
+      iov.iov_base = &reg;
+      iov.iov_len = sizeof(reg);
+      union {
+         char buf[CMSG_SPACE(sizeof(int))];
+         struct cmsghdr align;
+      } control;
+      struct msghdr msg;
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_name = &addr;
+      msg.msg_namelen = offsetof(struct sockaddr_un, sun_path) + 1 + len;
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      msg.msg_control = control.buf;
+      msg.msg_controllen = sizeof(control.buf);
+      struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_RIGHTS;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+      memcpy(CMSG_DATA(cmsg), &m_eventFd, sizeof(int));
+      sendmsg(sock, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+   }
+   if(sock >= 0) {
+      close(sock);
+   }
+
+   return true;
+}
+
+void TsRingClient::Close()
+{
+   if(m_reader) {
+      m_reader->waiting = 0;
+      __sync_synchronize();
+      m_reader->pid = 0;
+      m_reader = NULL;
+   }
+   if(m_header) {
+      munmap(m_header, m_mapSize);
+      m_header = NULL;
+      m_data = NULL;
+   }
+   if(m_eventFd >= 0) {
+      close(m_eventFd);
+      m_eventFd = -1;
+   }
+}
+
+ssize_t TsRingClient::Read(uint8_t* _buf, size_t _size, int _timeoutMs)
+{
+   if(!m_reader) {
+      errno = EBADF;
+      return -1;
+   }
+   _size -= _size % TS_PACKET_SIZE;
+   if(_size == 0) {
+      errno = EINVAL;
+      return -1;
+   }
+
+   uint64_t size = m_header->size;
+   uint64_t deadline = MonotonicMs() + _timeoutMs;
+   for(;;) {
+      if(m_header->closed) {
+         return -1;
+      }
+
+      uint64_t pos = m_reader->pos;
+      uint64_t head = m_header->head;
+      __sync_synchronize();
+      if(m_header->writing - pos > size) {
+         // Lapped, what is left at pos is newer data
+         m_reader->overruns++;
+         m_reader->lost += head - pos;
+         m_reader->pos = head;
+         continue;
+      }
+
+      if(head != pos) {
+         size_t n = min((uint64_t)_size, head - pos);
+         size_t offset = pos % size;
+         size_t first = min((size_t)(size - offset), n);
+         memcpy(_buf, m_data + offset, first);
+         memcpy(_buf + first, m_data, n - first);
+
+         // Did the writer get around to pos while we copied?
+         __sync_synchronize();
+         if(m_header->writing - pos > size) {
+            continue;
+         }
+
+         m_reader->pos = pos + n;
+         return n;
+      }
+
+      int left = _timeoutMs;
+      if(_timeoutMs >= 0) {
+         uint64_t now = MonotonicMs();
+         if(now >= deadline) {
+            return 0;
+         }
+         left = deadline - now;
+      }
+      Wait(left);
+   }
+}
+
+void TsRingClient::Wait(int _timeoutMs)
+{
+   // The writer sets head before checking waiting, we set waiting
+   // before checking head. One of us sees the other.
+   m_reader->waiting = 1;
+   __sync_synchronize();
+   if(m_header->head == m_reader->pos && !m_header->closed) {
+      struct pollfd pfd;
+      pfd.fd = m_eventFd;
+      pfd.events = POLLIN;
+      int slice = (_timeoutMs < 0 || _timeoutMs > WAIT_SLICE_MS) ? WAIT_SLICE_MS : _timeoutMs;
+      poll(&pfd, m_eventFd >= 0 ? 1 : 0, slice);
+   }
+   m_reader->waiting = 0;
+
+   uint64_t count;
+   if(m_eventFd >= 0 && read(m_eventFd, &count, sizeof(count)) < 0) {
+      // Not woken up, nothing to clear
+   }
+}
+
+bool TsRingClient::IsStreaming() const
+{
+   return m_header && m_header->streaming;
+}
+
+uint64_t TsRingClient::GetOverruns() const
+{
+   return m_reader ? m_reader->overruns : 0;
+}
+
+uint64_t TsRingClient::GetLost() const
+{
+   return m_reader ? m_reader->lost : 0;
+}
@@ -0,0 +1,79 @@
+/*
+ * ts_ring_client.h, reads a tuner's TS from its shared memory ring
+ *
+ * Copyright (C) 2010 Villy Thomsen <tfylliv@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef _ts_ring_client_h_
+#define _ts_ring_client_h_
+
+#include "ts_ring.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include <string>
+
+// The reading end of ts_ring.h, for programs that want a tuner's raw
+// TS without the DVB API. Link with libtsring and -lrt. The tuner
+// streams while something has it open through /dev/dvb, the ring only
+// carries what the demux asked the HDHomeRun for.
+//
+//   TsRingClient ring;
+//   ring.Open("1010ABCD-0");
+//   while((n = ring.Read(buf, sizeof(buf), 1000)) >= 0) ...
+class TsRingClient
+{
+public:
+   TsRingClient();
+   ~TsRingClient();
+
+   // Maps the ring of tuner _name and starts reading at the newest
+   // data. False when userhdhomerun doesn't publish it, or all reader
+   // slots are taken.
+   bool Open(const std::string& _name);
+   void Close();
+
+   // Copies up to _size bytes of whole TS packets into _buf, waiting
+   // up to _timeoutMs (-1 forever) when there is nothing new. Returns
+   // the bytes copied, 0 on timeout and -1 when userhdhomerun closed
+   // the ring, Open() it again then. A reader that fell more than the
+   // ring size behind continues at the newest data, see GetOverruns().
+   ssize_t Read(uint8_t* _buf, size_t _size, int _timeoutMs);
+
+   bool IsStreaming() const;
+
+   uint64_t GetOverruns() const;
+   // Bytes skipped by the overruns
+   uint64_t GetLost() const;
+
+private:
+   // Sleeps until head moves, or a poll slice when the eventfd isn't
+   // registered yet
+   void Wait(int _timeoutMs);
+
+private:
+   struct ts_ring_header* m_header;
+   const uint8_t* m_data;
+   size_t m_mapSize;
+   struct ts_ring_reader* m_reader;
+   int m_eventFd;
+};
+
+#endif // _ts_ring_client_h_
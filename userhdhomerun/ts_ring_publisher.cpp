@@ -0,0 +1,312 @@
+/*
+ * ts_ring_publisher.cpp, writes a tuner's TS to its shared memory ring
+ *
+ * Copyright (C) 2010 Villy Thomsen <tfylliv@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include "ts_ring_publisher.h"
+
+#include "log_file.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+using namespace std;
+
+static const size_t TS_PACKET_SIZE = 188;
+
+// The abstract socket readers register at, same name as the ring
+static socklen_t RingSocketAddress(const std::string& _name, struct sockaddr_un* _addr)
+{
+   memset(_addr, 0, sizeof(*_addr));
+   _addr->sun_family = AF_UNIX;
+   string path = string(TS_RING_PREFIX) + _name;
+   size_t len = min(path.size(), sizeof(_addr->sun_path) - 1);
+   memcpy(_addr->sun_path + 1, path.data(), len);
+   return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
+
+TsRingPublisher::TsRingPublisher()
+   : m_header(NULL), m_data(NULL), m_mapSize(0), m_sock(-1)
+{
+   for(int i = 0; i < TS_RING_MAX_READERS; ++i) {
+      m_eventFds[i] = -1;
+      m_eventPids[i] = 0;
+      m_overrunsSeen[i] = 0;
+   }
+}
+
+TsRingPublisher::~TsRingPublisher()
+{
+   if(m_header) {
+      m_header->closed = 1;
+      __sync_synchronize();
+      Wake(true);
+      munmap(m_header, m_mapSize);
+      // Ours, nobody else creates it while we hold the wakeup socket
+      shm_unlink((TS_RING_PREFIX + m_name).c_str());
+   }
+   for(int i = 0; i < TS_RING_MAX_READERS; ++i) {
+      if(m_eventFds[i] >= 0) {
+         close(m_eventFds[i]);
+      }
+   }
+   if(m_sock >= 0) {
+      close(m_sock);
+   }
+}
+
+bool TsRingPublisher::Open(const std::string& _name, size_t _size)
+{
+   m_name = _name;
+   string shmName = TS_RING_PREFIX + m_name;
+   size_t size = _size - _size % TS_PACKET_SIZE;
+   if(size == 0) {
+      ERR() << "Invalid shm_ring size: " << _size << endl;
+      return false;
+   }
+
+   // The wakeup socket is bound first, it is the lock on the name: the
+   // kernel lets go of an abstract socket when its process exits. A
+   // ring left behind without one is from a userhdhomerun that is gone,
+   // its readers keep their mapping and see it closed.
+   m_sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+   struct sockaddr_un addr;
+   socklen_t addrLen = RingSocketAddress(m_name, &addr);
+   int one = 1;
+   if(m_sock < 0 || setsockopt(m_sock, SOL_SOCKET, SO_PASSCRED, &one, sizeof(one)) != 0 ||
+      bind(m_sock, (struct sockaddr*)&addr, addrLen) != 0) {
+      if(errno == EADDRINUSE) {
+         ERR() << "Another userhdhomerun publishes " << shmName << ", not replacing it" << endl;
+         close(m_sock);
+         m_sock = -1;
+         return false;
+      }
+      // Readers still get the data, they just poll for it
+      ERR() << "Couldn't bind the " << shmName << " wakeup socket: " << strerror(errno) << endl;
+      if(m_sock >= 0) {
+         close(m_sock);
+         m_sock = -1;
+      }
+   }
+   if(m_sock >= 0) {
+      shm_unlink(shmName.c_str());
+   }
+   int fd = shm_open(shmName.c_str(), O_RDWR | O_CREAT | O_EXCL, 0660);
+   if(fd < 0) {
+      ERR() << "Couldn't create " << shmName << ": " << strerror(errno) << endl;
+      return false;
+   }
+
+   size_t headerSize = (sizeof(struct ts_ring_header) + 4095) & ~(size_t)4095;
+   m_mapSize = headerSize + size;
+   void* map = MAP_FAILED;
+   if(ftruncate(fd, m_mapSize) == 0) {
+      map = mmap(NULL, m_mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   }
+   close(fd);
+   if(map == MAP_FAILED) {
+      ERR() << "Couldn't map " << shmName << ": " << strerror(errno) << endl;
+      shm_unlink(shmName.c_str());
+      return false;
+   }
+
+   m_header = (struct ts_ring_header*)map;
+   m_data = (uint8_t*)map + headerSize;
+   m_header->size = size;
+   m_header->data_offset = headerSize;
+   m_header->version = TS_RING_VERSION;
+   // Readers check the magic last
+   __sync_synchronize();
+   m_header->magic = TS_RING_MAGIC;
+
+   LOG() << "Publishing the TS in " << shmName << ", " << size << " bytes" << endl;
+   return true;
+}
+
+void TsRingPublisher::Publish(const uint8_t* _data, size_t _size)
+{
+   _size -= _size % TS_PACKET_SIZE;
+   uint64_t size = m_header->size;
+   // Only the last ring full of a huge batch would survive anyway
+   if(_size > size) {
+      _data += _size - size;
+      _size = size;
+   }
+   if(_size == 0) {
+      return;
+   }
+
+   uint64_t head = m_header->head;
+   m_header->writing = head + _size;
+   __sync_synchronize();
+   size_t offset = head % size;
+   size_t first = min((size_t)(size - offset), _size);
+   memcpy(m_data + offset, _data, first);
+   memcpy(m_data, _data + first, _size - first);
+
+   // The data before the new head, and the new head before checking
+   // who sleeps. The reader sets waiting before checking head.
+   __sync_synchronize();
+   m_header->head = head + _size;
+   __sync_synchronize();
+   Wake(false);
+}
+
+void TsRingPublisher::SetStreaming(bool _streaming)
+{
+   m_header->streaming = _streaming ? 1 : 0;
+   __sync_synchronize();
+   Wake(true);
+}
+
+void TsRingPublisher::Wake(bool _all)
+{
+   static const uint64_t one = 1;
+   for(int i = 0; i < TS_RING_MAX_READERS; ++i) {
+      if(m_eventFds[i] < 0) {
+         continue;
+      }
+      struct ts_ring_reader& reader = m_header->readers[i];
+      if(__sync_bool_compare_and_swap(&reader.waiting, 1, 0) || _all) {
+         if(write(m_eventFds[i], &one, sizeof(one)) < 0) {
+            // The counter is full, the reader is awake anyway
+         }
+      }
+   }
+}
+
+void TsRingPublisher::Forget(int _slot)
+{
+   if(m_eventFds[_slot] >= 0) {
+      close(m_eventFds[_slot]);
+      m_eventFds[_slot] = -1;
+   }
+   m_eventPids[_slot] = 0;
+   m_overrunsSeen[_slot] = 0;
+}
+
+void TsRingPublisher::Service()
+{
+   //
+   // Registrations, the slot in the datagram and the eventfd with the
+   // sender's credentials
+   //
+   while(m_sock >= 0) {
+      struct ts_ring_register reg;
+      struct iovec iov;
+      iov.iov_base = &reg;
+      iov.iov_len = sizeof(reg);
+      union {
+         char buf[CMSG_SPACE(sizeof(int)) + CMSG_SPACE(sizeof(struct ucred))];
+         struct cmsghdr align;
+      } control;
+      struct msghdr msg;
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      msg.msg_control = control.buf;
+      msg.msg_controllen = sizeof(control.buf);
+
+      ssize_t ret = recvmsg(m_sock, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+      if(ret < 0) {
+         break;
+      }
+
+      int fd = -1;
+      pid_t pid = 0;
+      for(struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+         if(cmsg->cmsg_level != SOL_SOCKET) {
+            continue;
+         }
+         if(cmsg->cmsg_type == SCM_RIGHTS) {
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+         }
+         else if(cmsg->cmsg_type == SCM_CREDENTIALS) {
+            struct ucred cred;
+            memcpy(&cred, CMSG_DATA(cmsg), sizeof(cred));
+            pid = cred.pid;
+         }
+      }
+
+      // Only the reader owning the slot gets to register for it
+      if(ret != sizeof(reg) || fd < 0 || reg.slot >= TS_RING_MAX_READERS ||
+         pid == 0 || m_header->readers[reg.slot].pid != (uint32_t)pid) {
+         ERR() << "Invalid " << TS_RING_PREFIX << m_name << " registration from pid " << pid << endl;
+         if(fd >= 0) {
+            close(fd);
+         }
+         continue;
+      }
+
+      Forget(reg.slot);
+      m_eventFds[reg.slot] = fd;
+      m_eventPids[reg.slot] = pid;
+      DBG() << TS_RING_PREFIX << m_name << " reader " << pid << " registered" << endl;
+   }
+
+   //
+   // Readers that went away, with or without closing
+   //
+   for(int i = 0; i < TS_RING_MAX_READERS; ++i) {
+      struct ts_ring_reader& reader = m_header->readers[i];
+      uint32_t pid = reader.pid;
+      if(pid != 0 && kill(pid, 0) != 0 && errno == ESRCH) {
+         LOG() << TS_RING_PREFIX << m_name << " reader " << pid << " exited without closing" << endl;
+         __sync_bool_compare_and_swap(&reader.pid, pid, 0);
+         pid = 0;
+      }
+      if(m_eventPids[i] != 0 && m_eventPids[i] != pid) {
+         Forget(i);
+      }
+
+      uint64_t overruns = reader.overruns;
+      if(pid != 0 && overruns != m_overrunsSeen[i]) {
+         LOG_EVERY(LogFile::LEVEL_INFO, 60) << TS_RING_PREFIX << m_name << " reader " << pid
+            << " can't keep up, overrun " << overruns << " times, " << reader.lost << " bytes lost" << endl;
+         m_overrunsSeen[i] = overruns;
+      }
+   }
+}
+
+void TsRingPublisher::GetStats(std::vector<ReaderStats>& _stats) const
+{
+   _stats.clear();
+   uint64_t head = m_header->head;
+   for(int i = 0; i < TS_RING_MAX_READERS; ++i) {
+      const struct ts_ring_reader& reader = m_header->readers[i];
+      ReaderStats stats;
+      stats.pid = reader.pid;
+      if(stats.pid == 0) {
+         continue;
+      }
+      uint64_t pos = reader.pos;
+      stats.lag = head > pos ? head - pos : 0;
+      stats.overruns = reader.overruns;
+      stats.lost = reader.lost;
+      _stats.push_back(stats);
+   }
+}
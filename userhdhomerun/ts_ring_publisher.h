@@ -0,0 +1,84 @@
+/*
+ * ts_ring_publisher.h, writes a tuner's TS to its shared memory ring
+ *
+ * Copyright (C) 2010 Villy Thomsen <tfylliv@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef _ts_ring_publisher_h_
+#define _ts_ring_publisher_h_
+
+#include "ts_ring.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include <string>
+#include <vector>
+
+// The writing end of ts_ring.h. Publish() and Service() are for the
+// ingest thread only, GetStats() reads the shared counters for the
+// others.
+class TsRingPublisher
+{
+public:
+   struct ReaderStats {
+      pid_t pid;
+      // Bytes behind the writer
+      uint64_t lag;
+      uint64_t overruns;
+      uint64_t lost;
+   };
+
+   TsRingPublisher();
+   ~TsRingPublisher();
+
+   // Creates the ring for tuner _name with _size bytes of TS, replacing
+   // whatever a previous userhdhomerun left behind. Fails while another
+   // userhdhomerun publishes it.
+   bool Open(const std::string& _name, size_t _size);
+
+   // Copies whole TS packets in and wakes the readers waiting.
+   void Publish(const uint8_t* _data, size_t _size);
+   void SetStreaming(bool _streaming);
+
+   // Takes the eventfds readers registered, forgets the readers that
+   // exited and logs the ones that were overrun.
+   void Service();
+
+   void GetStats(std::vector<ReaderStats>& _stats) const;
+
+private:
+   void Wake(bool _all);
+   void Forget(int _slot);
+
+private:
+   std::string m_name;
+   struct ts_ring_header* m_header;
+   uint8_t* m_data;
+   size_t m_mapSize;
+   int m_sock;
+
+   // Per slot, the registered eventfd and the pid it belongs to
+   int m_eventFds[TS_RING_MAX_READERS];
+   uint32_t m_eventPids[TS_RING_MAX_READERS];
+   // For Service()'s overrun log
+   uint64_t m_overrunsSeen[TS_RING_MAX_READERS];
+};
+
+#endif // _ts_ring_publisher_h_
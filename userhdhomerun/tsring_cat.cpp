@@ -0,0 +1,72 @@
+/*
+ * tsring_cat.cpp, writes a tuner's TS from its shared memory ring to stdout
+ *
+ * Copyright (C) 2010 Villy Thomsen <tfylliv@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include "ts_ring_client.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+// 348 TS packets, ~64 KB
+static uint8_t g_buf[348 * 188];
+
+int main(int argc, char** argv)
+{
+   if(argc != 2) {
+      fprintf(stderr, "usage: %s <tuner name, e.g. 1010ABCD-0>\n", argv[0]);
+      return 1;
+   }
+
+   TsRingClient ring;
+   if(!ring.Open(argv[1])) {
+      fprintf(stderr, "Couldn't open the ring of %s: %s\n", argv[1], strerror(errno));
+      return 1;
+   }
+
+   uint64_t overruns = 0;
+   for(;;) {
+      ssize_t n = ring.Read(g_buf, sizeof(g_buf), 1000);
+      if(n < 0) {
+         // userhdhomerun restarted
+         while(!ring.Open(argv[1])) {
+            sleep(1);
+         }
+         fprintf(stderr, "Reopened the ring of %s\n", argv[1]);
+         overruns = 0;
+         continue;
+      }
+
+      if(ring.GetOverruns() != overruns) {
+         overruns = ring.GetOverruns();
+         fprintf(stderr, "Overrun %llu times, %llu bytes lost\n",
+                 (unsigned long long)overruns, (unsigned long long)ring.GetLost());
+      }
+
+      for(ssize_t done = 0; done < n; ) {
+         ssize_t w = write(STDOUT_FILENO, g_buf + done, n - done);
+         if(w <= 0) {
+            return w < 0 && errno == EPIPE ? 0 : 1;
+         }
+         done += w;
+      }
+   }
+}
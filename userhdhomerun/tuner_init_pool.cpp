@@ -0,0 +1,190 @@
+/*
+ * tuner_init_pool.cpp, creates HDHomeRun tuner objects in parallel
+ *
+ * Copyright (C) 2010 Villy Thomsen <tfylliv@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include "tuner_init_pool.h"
+
+#include "hdhomerun_tuner.h"
+#include "log_file.h"
+
+#include <iostream>
+
+using namespace std;
+
+TunerInitPool::TunerInitPool(int _numOfThreads, int _timeout,
+                             const ConfIniFile* _conf, struct hdhomerun_debug_t* _dbg)
+   : m_stopping(false), m_numOfThreads(_numOfThreads), m_timeout(_timeout),
+     m_conf(_conf), m_dbg(_dbg)
+{
+   if(m_numOfThreads < 1) {
+      m_numOfThreads = 1;
+   }
+
+   pthread_mutex_init(&m_mutex, NULL);
+   pthread_cond_init(&m_cond, NULL);
+}
+
+TunerInitPool::~TunerInitPool()
+{
+   pthread_mutex_lock(&m_mutex);
+   m_stopping = true;
+   pthread_cond_broadcast(&m_cond);
+   pthread_mutex_unlock(&m_mutex);
+
+   vector<Worker*>::iterator it;
+   for(it = m_workers.begin(); it != m_workers.end(); ++it) {
+      (*it)->stop();
+      delete *it;
+   }
+
+   pthread_cond_destroy(&m_cond);
+   pthread_mutex_destroy(&m_mutex);
+}
+
+void TunerInitPool::Worker::run()
+{
+   Job* job;
+   while((job = m_pool->GetJob()) != NULL) {
+      HdhomerunTuner* tuner = new HdhomerunTuner(job->address.deviceId, job->address.deviceIP,
+                                                 job->address.tuner, m_pool->m_conf, m_pool->m_dbg);
+      m_pool->JobDone(job, tuner);
+   }
+}
+
+TunerInitPool::Job* TunerInitPool::GetJob()
+{
+   Job* job = NULL;
+
+   pthread_mutex_lock(&m_mutex);
+   while(m_queue.empty() && !m_stopping) {
+      pthread_cond_wait(&m_cond, &m_mutex);
+   }
+   if(!m_stopping) {
+      job = m_queue.front();
+      m_queue.pop();
+      job->state = RUNNING;
+      job->started = time(NULL);
+   }
+   pthread_mutex_unlock(&m_mutex);
+
+   return job;
+}
+
+void TunerInitPool::JobDone(Job* _job, HdhomerunTuner* _tuner)
+{
+   pthread_mutex_lock(&m_mutex);
+   if(_job->state == ABANDONED) {
+      // CreateTuners gave up on it, nobody else will clean up.
+      LOG() << "Tuner " << _tuner->GetName() << " came up after the timeout, ignoring it" << endl;
+      delete _tuner;
+      delete _job;
+   }
+   else {
+      _job->tuner = _tuner;
+      _job->state = DONE;
+   }
+   pthread_cond_broadcast(&m_cond);
+   pthread_mutex_unlock(&m_mutex);
+}
+
+void TunerInitPool::CreateTuners(const std::vector<TunerAddress>& _addresses,
+                                 std::vector<HdhomerunTuner*>& _tuners)
+{
+   vector<Job*> jobs;
+
+   pthread_mutex_lock(&m_mutex);
+
+   vector<TunerAddress>::const_iterator addrIt;
+   for(addrIt = _addresses.begin(); addrIt != _addresses.end(); ++addrIt) {
+      Job* job = new Job;
+      job->address = *addrIt;
+      job->state = QUEUED;
+      job->started = 0;
+      job->tuner = NULL;
+      jobs.push_back(job);
+      m_queue.push(job);
+   }
+
+   while(m_workers.size() < (size_t)m_numOfThreads && m_workers.size() < jobs.size()) {
+      Worker* worker = new Worker(this);
+      if(worker->start() != 0) {
+         ERR() << "Couldn't start tuner init thread" << endl;
+         delete worker;
+         break;
+      }
+      m_workers.push_back(worker);
+   }
+
+   if(m_workers.empty()) {
+      // Nothing to run the jobs, do them here instead.
+      pthread_mutex_unlock(&m_mutex);
+      Job* job;
+      while((job = GetJob()) != NULL) {
+         JobDone(job, new HdhomerunTuner(job->address.deviceId, job->address.deviceIP,
+                                         job->address.tuner, m_conf, m_dbg));
+      }
+      pthread_mutex_lock(&m_mutex);
+   }
+
+   // Wait for every job to finish or time out.
+   size_t pending = jobs.size();
+   while(pending > 0) {
+      time_t now = time(NULL);
+
+      pending = 0;
+      vector<Job*>::iterator it;
+      for(it = jobs.begin(); it != jobs.end(); ++it) {
+         Job* job = *it;
+         if(job->state == RUNNING && now - job->started >= m_timeout) {
+            ERR() << "Timeout setting up tuner " << hex << job->address.deviceId
+                  << "-" << dec << job->address.tuner << ", skipping it" << endl;
+            job->state = ABANDONED;
+         }
+         if(job->state == QUEUED || job->state == RUNNING) {
+            ++pending;
+         }
+      }
+
+      if(pending > 0) {
+         struct timespec wakeup;
+         wakeup.tv_sec = now + 1;
+         wakeup.tv_nsec = 0;
+         pthread_cond_timedwait(&m_cond, &m_mutex, &wakeup);
+      }
+   }
+
+   // Abandoned jobs are freed by the worker when it is done with them.
+   vector<Job*>::iterator it;
+   for(it = jobs.begin(); it != jobs.end(); ++it) {
+      Job* job = *it;
+      if(job->state == DONE) {
+         if(job->tuner->InitFailed()) {
+            ERR() << "Couldn't set up tuner " << job->tuner->GetName() << ", skipping it" << endl;
+            delete job->tuner;
+         }
+         else {
+            _tuners.push_back(job->tuner);
+         }
+         delete job;
+      }
+   }
+
+   pthread_mutex_unlock(&m_mutex);
+}
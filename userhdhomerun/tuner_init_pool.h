@@ -0,0 +1,103 @@
+/*
+ * tuner_init_pool.h, creates HDHomeRun tuner objects in parallel
+ *
+ * Copyright (C) 2010 Villy Thomsen <tfylliv@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef _tuner_init_pool_h_
+#define _tuner_init_pool_h_
+
+#include "thread_pthread.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <queue>
+#include <vector>
+
+class ConfIniFile;
+class HdhomerunTuner;
+struct hdhomerun_debug_t;
+
+// Setting up a tuner means several round trips to the HDHomeRun, so
+// a small pool of threads does them for all tuners at once.
+class TunerInitPool
+{
+public:
+   struct TunerAddress {
+      uint32_t deviceId;
+      uint32_t deviceIP;
+      int tuner;
+   };
+
+public:
+   TunerInitPool(int _numOfThreads, int _timeout,
+                 const ConfIniFile* _conf, struct hdhomerun_debug_t* _dbg);
+   ~TunerInitPool();
+
+   // Create a tuner object for each address. Tuners that failed or
+   // didn't finish within the timeout (in seconds, counted from when a
+   // thread started on it) are left out of _tuners.
+   void CreateTuners(const std::vector<TunerAddress>& _addresses,
+                     std::vector<HdhomerunTuner*>& _tuners);
+
+private:
+   enum JobState {
+      QUEUED,
+      RUNNING,
+      DONE,
+      ABANDONED
+   };
+
+   struct Job {
+      TunerAddress address;
+      JobState state;
+      time_t started;
+      HdhomerunTuner* tuner;
+   };
+
+   class Worker : public ThreadPthread
+   {
+   public:
+      Worker(TunerInitPool* _pool) : m_pool(_pool) {}
+      void run();
+
+   private:
+      TunerInitPool* m_pool;
+   };
+
+   Job* GetJob();
+   void JobDone(Job* _job, HdhomerunTuner* _tuner);
+
+private:
+   std::vector<Worker*> m_workers;
+   std::queue<Job*> m_queue;
+   bool m_stopping;
+   int m_numOfThreads;
+
+   pthread_mutex_t m_mutex;
+   pthread_cond_t m_cond;
+
+   int m_timeout;
+
+   const ConfIniFile* m_conf;
+   struct hdhomerun_debug_t* m_dbg;
+};
+
+#endif // _tuner_init_pool_h_